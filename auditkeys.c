@@ -0,0 +1,297 @@
+#include "batchgcd.h"
+#include "rsa.h"
+#include <dirent.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "t:vh"
+#define MAX_THREADS 256
+#define USERNAME_SIZE 10000
+
+/* One public key file and what the audit found out about it */
+typedef struct {
+  char *path;
+  char *username;
+  mpz_t n;
+  mpz_t g;    /* gcd of n with the product of every other modulus */
+  int status; /* 0 unreadable, 1 read */
+} KeyAudit;
+
+static void usage(char *program) {
+  fprintf(stderr, "Usage: %s [options] <pbfile|directory>...\n", program);
+  fprintf(stderr, "  %s finds public keys whose moduli share a prime with "
+                  "another key,\n",
+          program);
+  fprintf(stderr, "  reading every .pub file in each given directory. A shared "
+                  "prime lets\n");
+  fprintf(stderr, "  anyone factor both moduli.\n");
+  fprintf(stderr, "    -t <threads>: Build the trees with <threads> threads. "
+                  "Default: number of CPUs.\n");
+  fprintf(stderr, "    -v          : Print the time taken to read the keys.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+/* Appends path to the list of keys to audit, growing it when full */
+static void add_key(KeyAudit **keys, size_t *count, size_t *capacity,
+                    const char *path) {
+  if (*count == *capacity) {
+    *capacity = *capacity == 0 ? 64 : *capacity * 2;
+    *keys = (KeyAudit *)realloc(*keys, *capacity * sizeof(KeyAudit));
+  }
+  KeyAudit *key = &(*keys)[*count];
+  key->path = strdup(path);
+  key->username = NULL;
+  key->status = 0;
+  *count += 1;
+}
+
+/* Orders keys by path so directory listings give a stable report */
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(((const KeyAudit *)a)->path, ((const KeyAudit *)b)->path);
+}
+
+/* Adds path itself, or every .pub file inside it if it is a directory */
+static void add_path(KeyAudit **keys, size_t *count, size_t *capacity,
+                     const char *path) {
+  struct stat info;
+  if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+    add_key(keys, count, capacity, path);
+    return;
+  }
+
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    add_key(keys, count, capacity, path);
+    return;
+  }
+
+  size_t first = *count;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t length = strlen(entry->d_name);
+    if (length > 4 && strcmp(entry->d_name + length - 4, ".pub") == 0) {
+      char *full = (char *)malloc(strlen(path) + length + 2);
+      sprintf(full, "%s/%s", path, entry->d_name);
+      add_key(keys, count, capacity, full);
+      free(full);
+    }
+  }
+  closedir(dir);
+  qsort(*keys + first, *count - first, sizeof(KeyAudit), compare_paths);
+}
+
+/* Reads the modulus and username of one public key */
+static void read_key(KeyAudit *key, char *username) {
+  mpz_inits(key->n, key->g, NULL);
+  FILE *pbfile = fopen(key->path, "r");
+  if (pbfile == NULL) {
+    return;
+  }
+
+  mpz_t e;
+  mpz_t s;
+  mpz_inits(e, s, NULL);
+  username[0] = '\0';
+  rsa_read_pub(key->n, e, s, username, pbfile);
+  fclose(pbfile);
+  username[strcspn(username, "\n")] = '\0';
+  key->username = strdup(username);
+  key->status = mpz_cmp_ui(key->n, 1) > 0 ? 1 : 0;
+  mpz_clears(e, s, NULL);
+}
+
+/* Orders pointers to keys by modulus, so copies of a modulus are adjacent */
+static int compare_moduli(const void *a, const void *b) {
+  return mpz_cmp((*(KeyAudit *const *)a)->n, (*(KeyAudit *const *)b)->n);
+}
+
+/* Returns another key with the same modulus as key from the sorted list,
+or NULL if there is none */
+static KeyAudit *find_copy(KeyAudit **sorted, size_t count, KeyAudit *key) {
+  KeyAudit **found = (KeyAudit **)bsearch(&key, sorted, count,
+                                          sizeof(KeyAudit *), compare_moduli);
+  if (found == NULL) {
+    return NULL;
+  }
+  while (found > sorted && mpz_cmp((*(found - 1))->n, key->n) == 0) {
+    found--;
+  }
+  for (; found < sorted + count && mpz_cmp((*found)->n, key->n) == 0;
+       found++) {
+    if (*found != key) {
+      return *found;
+    }
+  }
+  return NULL;
+}
+
+static double seconds_since(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+  int opt = 0;
+  bool verbose = false;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 't':
+      threads = atol(optarg);
+      if (threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "Number of threads must be 1-%d, not %s.\n",
+                MAX_THREADS, optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  KeyAudit *keys = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  for (int i = optind; i < argc; i++) {
+    add_path(&keys, &count, &capacity, argv[i]);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  char *username = calloc(USERNAME_SIZE, sizeof(char));
+  size_t readable = 0;
+  for (size_t i = 0; i < count; i++) {
+    read_key(&keys[i], username);
+    readable += keys[i].status;
+  }
+  free(username);
+  if (verbose) {
+    fprintf(stderr, "read %zu keys in %.3f s\n", count,
+            seconds_since(&start));
+  }
+
+  /* The moduli that were read are gathered for the trees */
+  mpz_t *n = (mpz_t *)malloc((readable + 1) * sizeof(mpz_t));
+  mpz_t *g = (mpz_t *)malloc((readable + 1) * sizeof(mpz_t));
+  size_t m = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (keys[i].status == 1) {
+      mpz_init_set(n[m], keys[i].n);
+      mpz_init(g[m]);
+      m++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  batch_gcd(g, n, m, (size_t)threads);
+  double seconds = seconds_since(&start);
+  m = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (keys[i].status == 1) {
+      mpz_set(keys[i].g, g[m]);
+      mpz_clears(n[m], g[m], NULL);
+      m++;
+    }
+  }
+  free(n);
+  free(g);
+
+  /* Keys sharing both primes are either copies of a modulus, found next to
+  each other once sorted by modulus, or share each prime with a different
+  key */
+  size_t flagged = 0;
+  KeyAudit **whole = (KeyAudit **)malloc((count + 1) * sizeof(KeyAudit *));
+  KeyAudit **weak = (KeyAudit **)malloc((count + 1) * sizeof(KeyAudit *));
+  size_t wholes = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (keys[i].status == 1 && mpz_cmp_ui(keys[i].g, 1) != 0) {
+      weak[flagged++] = &keys[i];
+      if (mpz_cmp(keys[i].g, keys[i].n) == 0) {
+        whole[wholes++] = &keys[i];
+      }
+    }
+  }
+  qsort(whole, wholes, sizeof(KeyAudit *), compare_moduli);
+
+  /* Prints the report in the order the keys were given */
+  size_t duplicates = 0;
+  size_t shared = 0;
+  mpz_t prime;
+  mpz_init(prime);
+  for (size_t i = 0; i < count; i++) {
+    KeyAudit *key = &keys[i];
+    if (key->status == 0) {
+      printf("ERROR %s: couldn't read public key\n", key->path);
+      continue;
+    }
+    if (mpz_cmp_ui(key->g, 1) == 0) {
+      continue;
+    }
+
+    KeyAudit *copy = find_copy(whole, wholes, key);
+    if (copy != NULL) {
+      duplicates++;
+      printf("DUPLICATE %s %s: same modulus as %s\n", key->path,
+             key->username, copy->path);
+      continue;
+    }
+
+    /* With both primes shared, either one is found by a gcd with another
+    flagged key */
+    mpz_set(prime, key->g);
+    for (size_t j = 0; j < flagged && mpz_cmp(prime, key->n) == 0; j++) {
+      if (weak[j] != key) {
+        mpz_gcd(prime, key->n, weak[j]->n);
+        if (mpz_cmp_ui(prime, 1) == 0) {
+          mpz_set(prime, key->n);
+        }
+      }
+    }
+    char *hex = mpz_get_str(NULL, 16, prime);
+    shared++;
+    printf("SHARED %s %s: prime %.16s (%zu bits)%s\n", key->path,
+           key->username, hex, mpz_sizeinbase(prime, 2),
+           mpz_cmp(key->g, key->n) == 0 ? ", both primes shared" : "");
+    free(hex);
+  }
+  mpz_clear(prime);
+
+  printf("keys: %zu, shared prime: %zu, duplicate: %zu, unreadable: %zu\n",
+         count, shared, duplicates, count - readable);
+  printf("threads: %ld, batch gcd time: %.3f s, throughput: %.1f keys/s\n",
+         threads, seconds, seconds > 0 ? readable / seconds : 0.0);
+
+  for (size_t i = 0; i < count; i++) {
+    free(keys[i].path);
+    free(keys[i].username);
+    mpz_clears(keys[i].n, keys[i].g, NULL);
+  }
+  free(keys);
+  free(whole);
+  free(weak);
+  return shared > 0 || duplicates > 0 || readable < count ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+#include "batchgcd.h"
+#include "workqueue.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/* One level of a tree, whose nodes are computed from the level below
+(product tree) or the level above (remainder tree) by the threads */
+typedef struct {
+  mpz_t *out;
+  size_t count;
+  mpz_t *below;       /* Product tree: the level multiplied in pairs */
+  size_t below_count;
+  mpz_t *above;       /* Remainder tree: the remainders of the parents */
+  WorkQueue queue;    /* One item per node */
+} TreeLevel;
+
+/* Sets a product node to the product of its two children, or to its only
+child at the end of an odd level */
+static void product_node(TreeLevel *level, size_t i) {
+  if (2 * i + 1 < level->below_count) {
+    mpz_mul(level->out[i], level->below[2 * i], level->below[2 * i + 1]);
+  } else {
+    mpz_set(level->out[i], level->below[2 * i]);
+  }
+}
+
+/* Sets a remainder node to its parent's remainder modulo the square of the
+node's product */
+static void remainder_node(TreeLevel *level, size_t i) {
+  mpz_t square;
+  mpz_init(square);
+  mpz_mul(square, level->below[i], level->below[i]);
+  mpz_mod(level->out[i], level->above[i / 2], square);
+  mpz_clear(square);
+}
+
+/* Thread body: computes nodes of the level until there are none left */
+static void *level_worker(void *arg) {
+  TreeLevel *level = (TreeLevel *)arg;
+  size_t i;
+  size_t taken;
+  while (workqueue_take(&level->queue, &i, &taken)) {
+    if (level->above == NULL) {
+      product_node(level, i);
+    } else {
+      remainder_node(level, i);
+    }
+  }
+  return NULL;
+}
+
+/* Computes every node of a level, on no more threads than there are
+nodes */
+static void level_run(mpz_t *out, size_t count, mpz_t *below,
+                      size_t below_count, mpz_t *above, size_t threads) {
+  TreeLevel level;
+  level.out = out;
+  level.count = count;
+  level.below = below;
+  level.below_count = below_count;
+  level.above = above;
+  workqueue_init(&level.queue, count, 1);
+  workqueue_run(&level.queue, level_worker, &level, threads);
+  workqueue_clear(&level.queue);
+}
+
+static mpz_t *level_alloc(size_t count) {
+  mpz_t *level = (mpz_t *)malloc(count * sizeof(mpz_t));
+  for (size_t i = 0; i < count; i++) {
+    mpz_init(level[i]);
+  }
+  return level;
+}
+
+static void level_free(mpz_t *level, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    mpz_clear(level[i]);
+  }
+  free(level);
+}
+
+void batch_gcd(mpz_t g[], mpz_t n[], size_t count, size_t threads) {
+  if (count == 0) {
+    return;
+  }
+
+  /* Product tree: level 0 is the moduli themselves */
+  size_t depth = 1;
+  for (size_t c = count; c > 1; c = (c + 1) / 2) {
+    depth++;
+  }
+  mpz_t **levels = (mpz_t **)malloc(depth * sizeof(mpz_t *));
+  size_t *counts = (size_t *)malloc(depth * sizeof(size_t));
+  levels[0] = n;
+  counts[0] = count;
+  for (size_t l = 1; l < depth; l++) {
+    counts[l] = (counts[l - 1] + 1) / 2;
+    levels[l] = level_alloc(counts[l]);
+    level_run(levels[l], counts[l], levels[l - 1], counts[l - 1], NULL,
+              threads);
+  }
+
+  /* Remainder tree: starts from the product and frees each level of the
+  product tree once the remainders below it are known */
+  mpz_t *above = level_alloc(1);
+  mpz_set(above[0], levels[depth - 1][0]);
+  size_t above_count = 1;
+  for (size_t l = depth - 1; l-- > 0;) {
+    mpz_t *out = level_alloc(counts[l]);
+    level_run(out, counts[l], levels[l], counts[l], above, threads);
+    level_free(above, above_count);
+    level_free(levels[l + 1], counts[l + 1]);
+    above = out;
+    above_count = counts[l];
+  }
+
+  /* P mod n_i^2 divided by n_i is (P / n_i) mod n_i */
+  for (size_t i = 0; i < count; i++) {
+    mpz_divexact(above[i], above[i], n[i]);
+    mpz_gcd(g[i], above[i], n[i]);
+  }
+
+  level_free(above, above_count);
+  free(levels);
+  free(counts);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <gmp.h>
+#include <stddef.h>
+
+//
+// Bernstein's batch GCD. Finds, for each of many moduli, whether it shares
+// a prime with any of the others, without comparing every pair. The product
+// tree multiplies the moduli in pairs, level by level, up to their product
+// P. The remainder tree goes back down, reducing P modulo the square of each
+// node, so that each leaf ends up with P mod n_i^2. Dividing that by n_i
+// gives (P / n_i) mod n_i, whose gcd with n_i is the part of n_i shared with
+// the other moduli. The work is a few multiplications and divisions of
+// numbers the size of P per level, quasi-linear in the number of moduli.
+//
+
+//
+// Computes g_i = gcd(n_i, product of all n_j with j != i) for every i.
+// The nodes of each tree level are spread over the threads.
+// All mpz_t arguments are expected to be initialized.
+//
+// g: will store the gcd for each modulus; 1 if it shares no prime, n_i if
+// it shares both primes, including with a copy of itself.
+// n: the moduli, all positive.
+// count: the number of moduli.
+// threads: the number of threads to use, at least 1.
+//
+void batch_gcd(mpz_t g[], mpz_t n[], size_t count, size_t threads);
@@ -0,0 +1,50 @@
+#include "cdc.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Cut when the hash has zeros under the mask: a mask with more bits
+before CDC_AVG and fewer after it keeps chunk sizes close to CDC_AVG
+(the masks for 8 KiB chunks from the FastCDC paper) */
+#define MASK_SMALL 0x0003590703530000ULL
+#define MASK_LARGE 0x0000d90003530000ULL
+
+static uint64_t gear[256]; /* A random value for each byte */
+
+/* Fills the gear table from a fixed seed, so every build cuts the same
+data at the same places */
+__attribute__((constructor)) static void cdc_init(void) {
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  for (int i = 0; i < 256; i++) {
+    /* splitmix64 */
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+size_t cdc_cut(const uint8_t *data, size_t len) {
+  if (len <= CDC_MIN) {
+    return len;
+  }
+  if (len > CDC_MAX) {
+    len = CDC_MAX;
+  }
+  size_t normal = len < CDC_AVG ? len : CDC_AVG;
+
+  uint64_t hash = 0;
+  size_t i = CDC_MIN;
+  for (; i < normal; i++) {
+    hash = (hash << 1) + gear[data[i]];
+    if ((hash & MASK_SMALL) == 0) {
+      return i + 1;
+    }
+  }
+  for (; i < len; i++) {
+    hash = (hash << 1) + gear[data[i]];
+    if ((hash & MASK_LARGE) == 0) {
+      return i + 1;
+    }
+  }
+  return len;
+}
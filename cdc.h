@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Content-defined chunking (FastCDC). Cut points are chosen by a rolling
+// gear hash of the data itself, so an edit only changes the chunks around
+// it: the chunks before and after line up with those of the old data and
+// can be recognised by their hashes.
+//
+#define CDC_MIN (1 << 11) /* Smallest chunk, except the last */
+#define CDC_AVG (1 << 13) /* Chunk size the cut masks aim for */
+#define CDC_MAX (1 << 16) /* Largest chunk */
+
+//
+// Returns the length of the chunk at the start of data.
+//
+// data: the data, holding at least CDC_MAX bytes unless it is the rest of
+// the input.
+// len: the number of bytes in data.
+// returns: the length of the first chunk, at most len and CDC_MAX.
+//
+size_t cdc_cut(const uint8_t *data, size_t len);
@@ -0,0 +1,105 @@
+#include "chacha.h"
+#include <stdint.h>
+#include <string.h>
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                    \
+  a += b;                                                                      \
+  d = ROTL(d ^ a, 16);                                                         \
+  c += d;                                                                      \
+  b = ROTL(b ^ c, 12);                                                         \
+  a += b;                                                                      \
+  d = ROTL(d ^ a, 8);                                                          \
+  c += d;                                                                      \
+  b = ROTL(b ^ c, 7)
+
+static uint32_t load_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void store_le32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+/* Computes one 64-byte block for the current counter */
+static void chacha_block(const uint32_t input[16], uint8_t out[64]) {
+  uint32_t x[16];
+  memcpy(x, input, sizeof(x));
+
+  for (int round = 0; round < 10; round++) {
+    QUARTER(x[0], x[4], x[8], x[12]);
+    QUARTER(x[1], x[5], x[9], x[13]);
+    QUARTER(x[2], x[6], x[10], x[14]);
+    QUARTER(x[3], x[7], x[11], x[15]);
+    QUARTER(x[0], x[5], x[10], x[15]);
+    QUARTER(x[1], x[6], x[11], x[12]);
+    QUARTER(x[2], x[7], x[8], x[13]);
+    QUARTER(x[3], x[4], x[9], x[14]);
+  }
+
+  for (int i = 0; i < 16; i++) {
+    store_le32(out + 4 * i, x[i] + input[i]);
+  }
+}
+
+/* Refills the buffer with the next CHACHA_BLOCKS blocks */
+static void chacha_refill(ChaCha *c) {
+  for (int b = 0; b < CHACHA_BLOCKS; b++) {
+    chacha_block(c->input, c->buffer + 64 * b);
+    /* Words 12 and 13 are a 64-bit block counter */
+    if (++c->input[12] == 0) {
+      c->input[13]++;
+    }
+  }
+  c->pos = 0;
+}
+
+void chacha_init(ChaCha *c, const uint8_t key[32], uint64_t nonce) {
+  static const uint8_t sigma[16] = "expand 32-byte k";
+  for (int i = 0; i < 4; i++) {
+    c->input[i] = load_le32(sigma + 4 * i);
+  }
+  for (int i = 0; i < 8; i++) {
+    c->input[4 + i] = load_le32(key + 4 * i);
+  }
+  c->input[12] = 0;
+  c->input[13] = 0;
+  c->input[14] = (uint32_t)nonce;
+  c->input[15] = (uint32_t)(nonce >> 32);
+  c->pos = sizeof(c->buffer);
+}
+
+void chacha_bytes(ChaCha *c, void *out, size_t len) {
+  uint8_t *p = (uint8_t *)out;
+  while (len > 0) {
+    if (c->pos == sizeof(c->buffer)) {
+      chacha_refill(c);
+    }
+    size_t take = sizeof(c->buffer) - c->pos;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(p, c->buffer + c->pos, take);
+    c->pos += take;
+    p += take;
+    len -= take;
+  }
+}
+
+uint64_t chacha_u64(ChaCha *c) {
+  uint8_t bytes[8];
+  chacha_bytes(c, bytes, sizeof(bytes));
+  return (uint64_t)load_le32(bytes) | (uint64_t)load_le32(bytes + 4) << 32;
+}
+
+void chacha_clear(ChaCha *c) {
+  volatile uint8_t *p = (volatile uint8_t *)c;
+  for (size_t i = 0; i < sizeof(*c); i++) {
+    p[i] = 0;
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Number of 64-byte ChaCha20 blocks generated per refill of the buffer.
+//
+#define CHACHA_BLOCKS 16
+
+//
+// A ChaCha20 keystream used as a random number generator. The 256-bit key
+// is the seed and the 64-bit nonce picks one of 2^64 independent streams
+// for that seed. Output is generated CHACHA_BLOCKS blocks at a time into a
+// buffer, so most requests are a copy out of the buffer.
+//
+typedef struct {
+  uint32_t input[16]; /* Constants, key, block counter and nonce */
+  uint8_t buffer[64 * CHACHA_BLOCKS];
+  size_t pos; /* Next unused byte of buffer */
+} ChaCha;
+
+//
+// Starts a keystream.
+//
+// c: the generator to initialize.
+// key: the 32-byte key.
+// nonce: the stream number.
+//
+void chacha_init(ChaCha *c, const uint8_t key[32], uint64_t nonce);
+
+//
+// Fills a buffer with the next bytes of the keystream.
+//
+// c: the generator.
+// out: where to write.
+// len: the number of bytes.
+//
+void chacha_bytes(ChaCha *c, void *out, size_t len);
+
+//
+// Returns the next 64 bits of the keystream.
+//
+uint64_t chacha_u64(ChaCha *c);
+
+//
+// Wipes the key and any buffered output.
+//
+void chacha_clear(ChaCha *c);
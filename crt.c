@@ -0,0 +1,115 @@
+#include "crt.h"
+#include <gmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* Thread body: exponentiates cq each time a request is posted, spinning
+for a while after each one before going to sleep */
+static void *crt_helper(void *arg) {
+  CrtCtx *ctx = (CrtCtx *)arg;
+  uint_fast64_t seen = 0;
+
+  while (true) {
+    uint_fast64_t posted = seen;
+    for (int i = 0; i < CRT_SPIN && posted == seen; i++) {
+      posted = atomic_load_explicit(&ctx->posted, memory_order_acquire);
+    }
+    if (posted == seen) {
+      pthread_mutex_lock(&ctx->lock);
+      while (atomic_load(&ctx->posted) == seen && !ctx->stop) {
+        ctx->sleeping = true;
+        pthread_cond_wait(&ctx->wake, &ctx->lock);
+        ctx->sleeping = false;
+      }
+      bool stop = ctx->stop;
+      pthread_mutex_unlock(&ctx->lock);
+      if (stop) {
+        return NULL;
+      }
+      posted = atomic_load_explicit(&ctx->posted, memory_order_acquire);
+    }
+
+    mpz_powm(ctx->mq, ctx->cq, ctx->dq, ctx->q);
+    seen = posted;
+    atomic_store_explicit(&ctx->done, seen, memory_order_release);
+  }
+}
+
+bool crt_init(CrtCtx *ctx, mpz_t n, mpz_t d, mpz_t p, mpz_t q) {
+  mpz_inits(ctx->n, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, ctx->mp,
+            ctx->t, ctx->cq, ctx->mq, NULL);
+  mpz_mul(ctx->t, p, q);
+  if (mpz_cmp(ctx->t, n) != 0 || mpz_cmp_ui(p, 2) <= 0 ||
+      mpz_cmp_ui(q, 2) <= 0 || mpz_invert(ctx->qinv, q, p) == 0) {
+    mpz_clears(ctx->n, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, ctx->mp,
+               ctx->t, ctx->cq, ctx->mq, NULL);
+    return false;
+  }
+
+  mpz_set(ctx->n, n);
+  mpz_set(ctx->p, p);
+  mpz_set(ctx->q, q);
+  mpz_sub_ui(ctx->t, p, 1);
+  mpz_mod(ctx->dp, d, ctx->t);
+  mpz_sub_ui(ctx->t, q, 1);
+  mpz_mod(ctx->dq, d, ctx->t);
+
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->wake, NULL);
+  ctx->sleeping = false;
+  ctx->stop = false;
+  atomic_init(&ctx->posted, 0);
+  atomic_init(&ctx->done, 0);
+  ctx->threaded = sysconf(_SC_NPROCESSORS_ONLN) > 1 &&
+                  pthread_create(&ctx->helper, NULL, crt_helper, ctx) == 0;
+  return true;
+}
+
+void crt_clear(CrtCtx *ctx) {
+  if (ctx->threaded) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stop = true;
+    pthread_cond_signal(&ctx->wake);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_join(ctx->helper, NULL);
+  }
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_cond_destroy(&ctx->wake);
+  mpz_clears(ctx->n, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, ctx->mp,
+             ctx->t, ctx->cq, ctx->mq, NULL);
+}
+
+void crt_powm(CrtCtx *ctx, mpz_t m, mpz_t c) {
+  mpz_mod(ctx->cq, c, ctx->q);
+  uint_fast64_t request = 0;
+  if (ctx->threaded) {
+    pthread_mutex_lock(&ctx->lock);
+    request = atomic_load(&ctx->posted) + 1;
+    atomic_store_explicit(&ctx->posted, request, memory_order_release);
+    if (ctx->sleeping) {
+      pthread_cond_signal(&ctx->wake);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  mpz_mod(ctx->t, c, ctx->p);
+  mpz_powm(ctx->mp, ctx->t, ctx->dp, ctx->p);
+
+  if (ctx->threaded) {
+    while (atomic_load_explicit(&ctx->done, memory_order_acquire) !=
+           request) {
+    }
+  } else {
+    mpz_powm(ctx->mq, ctx->cq, ctx->dq, ctx->q);
+  }
+
+  /* Garner: m = mq + q * ((mp - mq) * qinv mod p) */
+  mpz_sub(ctx->t, ctx->mp, ctx->mq);
+  mpz_mul(ctx->t, ctx->t, ctx->qinv);
+  mpz_mod(ctx->t, ctx->t, ctx->p);
+  mpz_mul(ctx->t, ctx->t, ctx->q);
+  mpz_add(m, ctx->t, ctx->mq);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <gmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Number of times the helper thread checks for new work before it sleeps
+// until it is woken, so that back-to-back requests don't pay for a wakeup.
+//
+#define CRT_SPIN (1 << 16)
+
+//
+// Low-latency decryption by the Chinese remainder theorem. m = c^d mod n
+// is computed from m_p = c^(d mod p-1) mod p and m_q = c^(d mod q-1) mod q,
+// exponentiations with half-size numbers, recombined with Garner's
+// formula. The two halves run at the same time: m_q on a helper thread
+// that is started once and waits for work, and m_p on the calling thread,
+// so a single ciphertext is decrypted in about the time of one half.
+// On a machine with one CPU the halves run one after the other instead.
+//
+typedef struct {
+  mpz_t n;
+  mpz_t p;
+  mpz_t q;
+  mpz_t dp;   /* d mod (p - 1) */
+  mpz_t dq;   /* d mod (q - 1) */
+  mpz_t qinv; /* q^-1 mod p */
+  mpz_t mp;   /* Result of the calling thread's half */
+  mpz_t t;
+  mpz_t cq; /* Input of the helper's half */
+  mpz_t mq; /* Result of the helper's half */
+  bool threaded;
+  pthread_t helper;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool sleeping; /* The helper is waiting on wake */
+  bool stop;
+  atomic_uint_fast64_t posted; /* Requests handed to the helper */
+  atomic_uint_fast64_t done;   /* Requests the helper has finished */
+} CrtCtx;
+
+//
+// Precomputes the CRT exponents and starts the helper thread. The context
+// must stay at the same address until crt_clear().
+// All mpz_t arguments are expected to be initialized.
+//
+// ctx: the context to initialize.
+// n: the public modulus.
+// d: the private exponent.
+// p: the first prime factor of n.
+// q: the second prime factor of n.
+// returns: false, leaving ctx uninitialized, if p * q is not n.
+//
+bool crt_init(CrtCtx *ctx, mpz_t n, mpz_t d, mpz_t p, mpz_t q);
+
+//
+// Stops the helper thread and frees the context.
+//
+void crt_clear(CrtCtx *ctx);
+
+//
+// Computes m = c^d mod n. Only one thread may use a context at a time.
+//
+// ctx: the context.
+// m: will store the result; may be the same variable as c.
+// c: the ciphertext, less than n.
+//
+void crt_powm(CrtCtx *ctx, mpz_t m, mpz_t c);
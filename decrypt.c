@@ -1,17 +1,26 @@
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "shard.h"
+#include <getopt.h>
 #include <gmp.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:lvh"
+
+static const struct option long_options[] = {
+    {"manifest", required_argument, NULL, 'M'},
+    {"shard", required_argument, NULL, 'I'},
+    {"resume", no_argument, NULL, 'R'},
+    {NULL, 0, NULL, 0}};
 
 int main(int argc, char **argv) {
 
@@ -21,6 +30,10 @@ int main(int argc, char **argv) {
   char *input_file2 = "eageag";
   char *output_file = "eageag";
   char *private_key_file = "rsa.priv";
+  char *manifest_file = NULL; /* Manifest of a sharded cipher file */
+  long shard = -1;            /* The one shard to decrypt, if any */
+  bool low_latency = false;   /* Decrypt each block by CRT as it arrives */
+  bool resume = false;        /* Continue from the checkpoint of -o */
 
   FILE *in_file = NULL;
   FILE *out_file = NULL;
@@ -32,7 +45,8 @@ int main(int argc, char **argv) {
   mpz_init_set_ui(n, 0);
   mpz_init_set_ui(d, 0);
 
-  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+  while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) !=
+         -1) {
     switch (opt) {
     case 'i':
       activation_options[0] = 1;
@@ -46,9 +60,26 @@ int main(int argc, char **argv) {
       activation_options[2] = 1;
       private_key_file = optarg;
       break;
+    case 'l':
+      low_latency = true;
+      break;
+    case 'R':
+      resume = true;
+      break;
     case 'v':
       activation_options[3] = 1;
       break;
+    case 'M':
+      manifest_file = optarg;
+      break;
+    case 'I':
+      shard = atol(optarg);
+      if (shard < 0) {
+        fprintf(stderr, "Shard index must not be negative, not %s.\n",
+                optarg);
+        activation_options[4] = 1;
+      }
+      break;
     case 'h':
       activation_options[4] = 1;
       fprintf(stderr, "Usage: %s [options]\n", argv[0]);
@@ -63,6 +94,14 @@ int main(int argc, char **argv) {
                       "standard output.\n");
       fprintf(stderr, "    -n <keyfile>: Private key is in <keyfile>. Default: "
                       "rsa.priv.\n");
+      fprintf(stderr, "    --manifest <file>: Decrypt the shards listed in "
+                      "<file>, in parallel when <outfile> is given.\n");
+      fprintf(stderr, "    --shard <i> : With --manifest, decrypt only shard "
+                      "<i> into its place in <outfile>.\n");
+      fprintf(stderr, "    -l          : Low latency: decrypt each block as "
+                      "it arrives, by CRT on two threads.\n");
+      fprintf(stderr, "    --resume    : Continue an interrupted run from "
+                      "<outfile>.ckpt.\n");
       fprintf(stderr, "    -v          : Enable verbose output.\n");
       fprintf(stderr,
               "    -h          : Display program synopsis and usage.\n");
@@ -81,6 +120,14 @@ int main(int argc, char **argv) {
                       "standard output.\n");
       fprintf(stderr, "    -n <keyfile>: Private key is in <keyfile>. Default: "
                       "rsa.priv.\n");
+      fprintf(stderr, "    --manifest <file>: Decrypt the shards listed in "
+                      "<file>, in parallel when <outfile> is given.\n");
+      fprintf(stderr, "    --shard <i> : With --manifest, decrypt only shard "
+                      "<i> into its place in <outfile>.\n");
+      fprintf(stderr, "    -l          : Low latency: decrypt each block as "
+                      "it arrives, by CRT on two threads.\n");
+      fprintf(stderr, "    --resume    : Continue an interrupted run from "
+                      "<outfile>.ckpt.\n");
       fprintf(stderr, "    -v          : Enable verbose output.\n");
       fprintf(stderr,
               "    -h          : Display program synopsis and usage.\n");
@@ -133,64 +180,153 @@ int main(int argc, char **argv) {
     fprintf(
         stderr,
         "    -n <keyfile>: Private key is in <keyfile>. Default: rsa.priv.\n");
+    fprintf(stderr, "    --manifest <file>: Decrypt the shards listed in "
+                    "<file>, in parallel when <outfile> is given.\n");
+    fprintf(stderr, "    --shard <i> : With --manifest, decrypt only shard "
+                    "<i> into its place in <outfile>.\n");
+    fprintf(stderr, "    -l          : Low latency: decrypt each block as it "
+                    "arrives, by CRT on two threads.\n");
+    fprintf(stderr, "    --resume    : Continue an interrupted run from "
+                    "<outfile>.ckpt.\n");
     fprintf(stderr, "    -v          : Enable verbose output.\n");
     fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
     return 1;
   }
   rsa_read_priv(n, d, pri_file);
 
+  /* Low latency needs the prime factors that keygen writes after d */
+  CrtCtx ctx;
+  CrtCtx *crt = NULL;
+  if (low_latency) {
+    mpz_t p;
+    mpz_t q;
+    mpz_inits(p, q, NULL);
+    if (!rsa_read_priv_factors(n, p, q, pri_file) ||
+        !crt_init(&ctx, n, d, p, q)) {
+      fprintf(stderr, "decrypt: -l needs the prime factors of n in %s; "
+                      "make the key again with keygen\n",
+              private_key_file);
+      mpz_clears(p, q, n, d, NULL);
+      return 1;
+    }
+    mpz_clears(p, q, NULL);
+    crt = &ctx;
+  }
+
   /* Prints out verbose output*/
   if (activation_options[3] == 1) {
     fprintf(stderr, "n - modulus (%zu bits): ", mpz_sizeinbase(n, 2));
     gmp_printf("%Zd\n", n);
     fprintf(stderr, "d - private exponent (%zu bits): ", mpz_sizeinbase(d, 2));
     gmp_printf("%Zd\n", d);
+    if (crt != NULL) {
+      fprintf(stderr, "crt halves: %s\n",
+              crt->threaded ? "concurrent" : "serial, one CPU");
+    }
+  }
+
+  /* Sharded cipher files are decrypted shard by shard into their places
+  in the output, either all here or one shard per process with --shard */
+  if (manifest_file != NULL) {
+    Manifest m;
+    if (!manifest_read(manifest_file, &m)) {
+      fprintf(stderr, "decrypt: Couldn't read manifest %s\n", manifest_file);
+      return 1;
+    }
+
+    bool ok = true;
+    if (shard >= 0) {
+      if (activation_options[1] != 1 || (size_t)shard >= m.count) {
+        fprintf(stderr, "decrypt: --shard needs -o and a shard index below "
+                        "%zu\n",
+                m.count);
+        manifest_clear(&m);
+        return 1;
+      }
+      ok = shard_decrypt(&m, (size_t)shard, output_file, n, d);
+    } else if (activation_options[1] == 1) {
+      out_file = fopen(output_file, "w+");
+      ok = out_file != NULL &&
+           shard_decrypt_all(&m, out_file, output_file, n, d,
+                             (size_t)sysconf(_SC_NPROCESSORS_ONLN));
+      if (out_file != NULL) {
+        fclose(out_file);
+      }
+    } else {
+      ok = shard_decrypt_all(&m, stdout, NULL, n, d, 1);
+    }
+
+    if (!ok) {
+      fprintf(stderr, "decrypt: A shard is missing, corrupt, or doesn't "
+                      "match the manifest\n");
+    }
+    manifest_clear(&m);
+    mpz_clears(n, d, NULL);
+    return ok ? 0 : 1;
   }
 
   /* Decrypts input file or stdin with the private key file and sends
   the output to either stdout or a given output file. */
+  bool ok = true;
+  RsaStreamStats stats;
   if (activation_options[1] == 0) {
     if (activation_options[0] == 0) {
-      rsa_decrypt_file(stdin, stdout, n, d);
+      ok = rsa_decrypt_file_crt(stdin, stdout, n, d, crt, &stats);
     } else {
-      rsa_decrypt_file(in_file, stdout, n, d);
+      ok = rsa_decrypt_file_crt(in_file, stdout, n, d, crt, &stats);
     }
   } else {
-    out_file = fopen(output_file, "w+");
-    uint64_t size = 0;
+    /* Long runs into a file leave a checkpoint next to it to resume from */
+    char *checkpoint = (char *)malloc(strlen(output_file) + 6);
+    sprintf(checkpoint, "%s.ckpt", output_file);
+    RsaCheckpoint ckpt = {checkpoint, resume, RSA_CHECKPOINT_SECONDS, 0, 0,
+                          false};
+    out_file = resume ? fopen(output_file, "r+") : NULL;
+    if (out_file == NULL) {
+      out_file = fopen(output_file, "w+");
+    }
 
     if (activation_options[0] == 0) {
-      rsa_decrypt_file(stdin, out_file, n, d);
-      fseek(out_file, 0, SEEK_END);
-      size = ftell(out_file);
-      while (size == 0) {
-        rsa_decrypt_file(stdin, out_file, n, d);
-        fseek(out_file, 0, SEEK_END);
-        size = ftell(out_file);
-
-        if (size != 0) {
-          break;
-        }
-      }
+      ok = rsa_decrypt_file_resumable(stdin, out_file, n, d, crt, &stats,
+                                      &ckpt);
     } else {
-      rsa_decrypt_file(in_file, out_file, n, d);
-      fseek(out_file, 0, SEEK_END);
-      size = ftell(out_file);
-      while (size == 0) {
-        rsa_decrypt_file(in_file, out_file, n, d);
-        fseek(out_file, 0, SEEK_END);
-        size = ftell(out_file);
-
-        if (size != 0) {
-          break;
-        }
-      }
+      ok = rsa_decrypt_file_resumable(in_file, out_file, n, d, crt, &stats,
+                                      &ckpt);
     }
+    if (ckpt.rejected) {
+      fprintf(stderr, "decrypt: Checkpoint %s is for another input or key\n",
+              checkpoint);
+      free(checkpoint);
+      return 1;
+    }
+    if (activation_options[3] == 1 && ckpt.blocks > 0) {
+      fprintf(stderr, "resumed at block %llu, input offset %llu\n",
+              (unsigned long long)ckpt.blocks,
+              (unsigned long long)ckpt.offset);
+    }
+    free(checkpoint);
+  }
+
+  /* Streams of messages report how long each message took */
+  if (activation_options[3] == 1 && stats.messages > 0) {
+    fprintf(stderr,
+            "messages: %zu, latency (us): mean %.1f, p50 %.1f, p99 %.1f, "
+            "max %.1f\n",
+            stats.messages, stats.mean_us, stats.p50_us, stats.p99_us,
+            stats.max_us);
+  }
+
+  if (!ok) {
+    fprintf(stderr, "decrypt: Ciphertext format is unsupported or corrupt, "
+                    "or the plaintext couldn't be written\n");
   }
 
+  if (crt != NULL) {
+    crt_clear(crt);
+  }
   mpz_clears(n, d, NULL);
   free(in_file);
   free(out_file);
   free(pri_file);
-  return 0;
+  return ok ? 0 : 1;
 }
@@ -1,22 +1,71 @@
+#include "keycache.h"
+#include "keystore.h"
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "shard.h"
+#include <getopt.h>
 #include <gmp.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:K:zpmFC:vh"
+#define MAX_RECIPIENTS 256
+
+static const struct option long_options[] = {
+    {"shards", required_argument, NULL, 'S'},
+    {"resume", no_argument, NULL, 'R'},
+    {NULL, 0, NULL, 0}};
+
+/* Reads the public key named by name: a public key file, or with a
+keyring, the username or key id of a key in it. Only a key file is
+stamped for the cache of verified keys. */
+static bool read_key(Keyring *ring, const char *name, mpz_t n, mpz_t e,
+                     mpz_t s, char *username, KeyStamp *stamp) {
+  stamp->valid = false;
+  stamp->hit = false;
+  if (ring != NULL) {
+    KeyringEntry entry;
+    if (!keyring_find(ring, name, &entry)) {
+      return false;
+    }
+    mpz_set(n, entry.n);
+    mpz_set(e, entry.e);
+    mpz_set(s, entry.s);
+    snprintf(username, 10000, "%s\n", entry.username);
+    return true;
+  }
+
+  FILE *file = fopen(name, "r");
+  if (file == NULL) {
+    return false;
+  }
+  keycache_read_pub(n, e, s, username, file, stamp);
+  fclose(file);
+  return true;
+}
 
 int main(int argc, char **argv) {
 
   int opt = 0;
   int activation_options[6];
+  uint32_t flags = 0; /* Format flags for rsa_encrypt_file_with() */
+  bool stream = false; /* Encrypt messages as they arrive */
+  uint32_t stream_flags = 0;
+  long shards = 0; /* Number of shard files to split the output into */
+  char *cache_dir = NULL; /* Chunk cache for incremental encryption */
+  bool resume = false;    /* Continue from the checkpoint of -o */
+  char *recipient_files[MAX_RECIPIENTS]; /* Every -n, for several keys */
+  size_t recipients = 0;
+  char *keyring_file = NULL; /* Keyring that -n names keys in, if any */
+  Keyring *ring = NULL;
 
   char *input_file2 = "eageag";
   char *output_file = "eageag";
@@ -37,7 +86,8 @@ int main(int argc, char **argv) {
   mpz_init_set_ui(s, 0);
   mpz_init_set_ui(expected_s, 0);
 
-  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+  while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) !=
+         -1) {
     switch (opt) {
     case 'i':
       activation_options[0] = 1;
@@ -49,7 +99,46 @@ int main(int argc, char **argv) {
       break;
     case 'n':
       activation_options[2] = 1;
-      public_key_file = optarg;
+      if (recipients == 0) {
+        public_key_file = optarg;
+      }
+      if (recipients < MAX_RECIPIENTS) {
+        recipient_files[recipients++] = optarg;
+      } else {
+        fprintf(stderr, "Number of public keys must be at most %d.\n",
+                MAX_RECIPIENTS);
+        activation_options[4] = 1;
+      }
+      break;
+    case 'K':
+      keyring_file = optarg;
+      break;
+    case 'z':
+      flags |= RSA_COMPRESS;
+      break;
+    case 'p':
+      flags |= RSA_DENSE;
+      break;
+    case 'm':
+      stream = true;
+      break;
+    case 'F':
+      stream = true;
+      stream_flags |= RSA_FRAMED;
+      break;
+    case 'C':
+      cache_dir = optarg;
+      break;
+    case 'S':
+      shards = atol(optarg);
+      if (shards < 1 || shards > MAX_SHARDS) {
+        fprintf(stderr, "Number of shards must be 1-%d, not %s.\n",
+                MAX_SHARDS, optarg);
+        activation_options[4] = 1;
+      }
+      break;
+    case 'R':
+      resume = true;
       break;
     case 'v':
       activation_options[3] = 1;
@@ -69,6 +158,24 @@ int main(int argc, char **argv) {
       fprintf(
           stderr,
           "    -n <keyfile>: Public key is in <keyfile>. Default: rsa.pub.\n");
+      fprintf(stderr, "                  Repeat -n to encrypt once for several "
+                      "keys.\n");
+      fprintf(stderr, "    -K <file>   : Look up each -n as a username or key "
+                      "id in keyring <file>.\n");
+      fprintf(stderr, "    -z          : Compress the input before "
+                      "encrypting it.\n");
+      fprintf(stderr, "    -p          : Pack blocks densely, using the full "
+                      "width of the modulus.\n");
+      fprintf(stderr, "    -m          : Encrypt each line as a message as "
+                      "soon as it arrives.\n");
+      fprintf(stderr, "    -F          : Encrypt each length-prefixed frame "
+                      "as a message as soon as it arrives.\n");
+      fprintf(stderr, "    --shards <n>: Split the output into <n> shards "
+                      "<outfile>.0 ... and a manifest <outfile>.\n");
+      fprintf(stderr, "    -C <dir>    : Encrypt incrementally, reusing the "
+                      "chunks cached in <dir>.\n");
+      fprintf(stderr, "    --resume    : Continue an interrupted run from "
+                      "<outfile>.ckpt.\n");
       fprintf(stderr, "    -v          : Enable verbose output.\n");
       fprintf(stderr,
               "    -h          : Display program synopsis and usage.\n");
@@ -88,6 +195,24 @@ int main(int argc, char **argv) {
       fprintf(
           stderr,
           "    -n <keyfile>: Public key is in <keyfile>. Default: rsa.pub.\n");
+      fprintf(stderr, "                  Repeat -n to encrypt once for several "
+                      "keys.\n");
+      fprintf(stderr, "    -K <file>   : Look up each -n as a username or key "
+                      "id in keyring <file>.\n");
+      fprintf(stderr, "    -z          : Compress the input before "
+                      "encrypting it.\n");
+      fprintf(stderr, "    -p          : Pack blocks densely, using the full "
+                      "width of the modulus.\n");
+      fprintf(stderr, "    -m          : Encrypt each line as a message as "
+                      "soon as it arrives.\n");
+      fprintf(stderr, "    -F          : Encrypt each length-prefixed frame "
+                      "as a message as soon as it arrives.\n");
+      fprintf(stderr, "    --shards <n>: Split the output into <n> shards "
+                      "<outfile>.0 ... and a manifest <outfile>.\n");
+      fprintf(stderr, "    -C <dir>    : Encrypt incrementally, reusing the "
+                      "chunks cached in <dir>.\n");
+      fprintf(stderr, "    --resume    : Continue an interrupted run from "
+                      "<outfile>.ckpt.\n");
       fprintf(stderr, "    -v          : Enable verbose output.\n");
       fprintf(stderr,
               "    -h          : Display program synopsis and usage.\n");
@@ -111,10 +236,31 @@ int main(int argc, char **argv) {
     }
   }
 
-  pub_file = fopen(public_key_file, "r");
+  /* With a keyring, keys are looked up in it instead of read from files */
+  if (keyring_file != NULL) {
+    ring = keyring_open(keyring_file);
+    if (ring == NULL) {
+      fprintf(stderr, "encrypt: Couldn't read keyring %s\n", keyring_file);
+      return 1;
+    }
+    for (size_t i = 0; i < recipients; i++) {
+      KeyringEntry entry;
+      if (!keyring_find(ring, recipient_files[i], &entry)) {
+        fprintf(stderr, "encrypt: No key named %s in keyring %s\n",
+                recipient_files[i], keyring_file);
+        activation_options[4] = 1;
+      }
+    }
+    if (recipients == 0) {
+      fprintf(stderr, "encrypt: -K needs -n to name a key\n");
+      activation_options[4] = 1;
+    }
+  } else {
+    pub_file = fopen(public_key_file, "r");
+  }
 
   /* Checks if the public-key file can be accessed*/
-  if (pub_file == NULL) {
+  if (keyring_file == NULL && pub_file == NULL) {
     fprintf(stderr, "encrypt: Couldn't open %s to read public key\n",
             public_key_file);
     free(in_file);
@@ -140,17 +286,135 @@ int main(int argc, char **argv) {
     fprintf(
         stderr,
         "    -n <keyfile>: Public key is in <keyfile>. Default: rsa.pub.\n");
+    fprintf(stderr, "                  Repeat -n to encrypt once for several "
+                    "keys.\n");
+    fprintf(stderr, "    -K <file>   : Look up each -n as a username or key id "
+                    "in keyring <file>.\n");
+    fprintf(stderr, "    -z          : Compress the input before "
+                    "encrypting it.\n");
+    fprintf(stderr, "    -p          : Pack blocks densely, using the full "
+                    "width of the modulus.\n");
+    fprintf(stderr, "    -m          : Encrypt each line as a message as "
+                    "soon as it arrives.\n");
+    fprintf(stderr, "    -F          : Encrypt each length-prefixed frame "
+                    "as a message as soon as it arrives.\n");
+    fprintf(stderr, "    --shards <n>: Split the output into <n> shards "
+                    "<outfile>.0 ... and a manifest <outfile>.\n");
+    fprintf(stderr, "    -C <dir>    : Encrypt incrementally, reusing the "
+                    "chunks cached in <dir>.\n");
+    fprintf(stderr, "    --resume    : Continue an interrupted run from "
+                    "<outfile>.ckpt.\n");
     fprintf(stderr, "    -v          : Enable verbose output.\n");
     fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
     return 1;
   }
 
-  rsa_read_pub(n, e, s, username, pub_file);
+  /* Messages are encrypted one block format at a time */
+  if (stream && flags != 0) {
+    fprintf(stderr, "encrypt: -m and -F can't be combined with -z or -p\n");
+    return 1;
+  }
+  if (cache_dir != NULL && (stream || shards > 0 || flags != 0)) {
+    fprintf(stderr, "encrypt: -C can't be combined with -z, -p, -m, -F or "
+                    "--shards\n");
+    return 1;
+  }
+  if (shards > 0 && (stream || activation_options[1] != 1)) {
+    fprintf(stderr, "encrypt: --shards needs -o and can't be combined with "
+                    "-m or -F\n");
+    return 1;
+  }
+
+  /* Several keys share one copy of the ciphertext under a session key */
+  if (recipients > 1) {
+    if (stream || shards > 0 || cache_dir != NULL ||
+        (flags & RSA_DENSE) != 0) {
+      fprintf(stderr, "encrypt: Several -n can't be combined with -p, -m, "
+                      "-F, -C or --shards\n");
+      return 1;
+    }
+
+    mpz_t *keys_n = (mpz_t *)malloc(recipients * sizeof(mpz_t));
+    mpz_t *keys_e = (mpz_t *)malloc(recipients * sizeof(mpz_t));
+    char **usernames = (char **)malloc(recipients * sizeof(char *));
+    bool ok = true;
+    for (size_t i = 0; i < recipients; i++) {
+      mpz_inits(keys_n[i], keys_e[i], NULL);
+      usernames[i] = calloc(10000, sizeof(char));
+      KeyStamp stamp;
+      if (!read_key(ring, recipient_files[i], keys_n[i], keys_e[i], s,
+                    usernames[i], &stamp)) {
+        fprintf(stderr, "encrypt: Couldn't open %s to read public key\n",
+                recipient_files[i]);
+        ok = false;
+        continue;
+      }
+      mpz_set_str(expected_s, usernames[i], 62);
+      if (!keycache_verify(expected_s, s, keys_e[i], keys_n[i], &stamp)) {
+        fprintf(stderr, "encrypt: Couldn't verify user signature in %s\n",
+                recipient_files[i]);
+        ok = false;
+      }
+      if (activation_options[3] == 1) {
+        fprintf(stderr, "recipient: %s", usernames[i]);
+      }
+    }
+
+    bool seeded = ok && randstate_init_entropy();
+    if (ok && !seeded) {
+      fprintf(stderr, "encrypt: Couldn't read random numbers from the "
+                      "system\n");
+      ok = false;
+    }
+    /* An existing output file is only truncated once every key is good */
+    out_file = !ok                         ? NULL
+               : activation_options[1] == 1 ? fopen(output_file, "w")
+                                            : stdout;
+    if (ok && out_file == NULL) {
+      fprintf(stderr, "encrypt: Couldn't open %s to write ciphertext\n",
+              output_file);
+      ok = false;
+    }
+    if (ok && !rsa_encrypt_shared(activation_options[0] == 1 ? in_file
+                                                              : stdin,
+                                  out_file, recipients, keys_n, keys_e,
+                                  usernames, flags)) {
+      fprintf(stderr, "encrypt: Couldn't write the ciphertext\n");
+      ok = false;
+    }
+
+    if (out_file != NULL && out_file != stdout) {
+      fclose(out_file);
+    }
+    for (size_t i = 0; i < recipients; i++) {
+      mpz_clears(keys_n[i], keys_e[i], NULL);
+      free(usernames[i]);
+    }
+    free(keys_n);
+    free(keys_e);
+    free(usernames);
+    free(username);
+    keyring_close(ring);
+    if (seeded) {
+      randstate_clear();
+    }
+    mpz_clears(n, e, s, expected_s, NULL);
+    return ok ? 0 : 1;
+  }
+
+  KeyStamp stamp;
+  if (ring != NULL) {
+    read_key(ring, public_key_file, n, e, s, username, &stamp);
+    keyring_close(ring);
+  } else {
+    keycache_read_pub(n, e, s, username, pub_file, &stamp);
+  }
 
   mpz_set_str(expected_s, username, 62);
 
-  /* Verifies if the signature is verified*/
-  if (rsa_verify(expected_s, s, e, n) == false) {
+  /* Verifies if the signature is verified, unless this key file already
+  was */
+  if (keycache_verify(expected_s, s, e, n, &stamp) == false) {
     fprintf(stderr, "./encrpyt: Couldn't verify user signature!\n");
     return 1;
   }
@@ -158,7 +422,8 @@ int main(int argc, char **argv) {
   /* Prints out verbose output*/
   if (activation_options[3] == 1) {
     fprintf(stderr, "username: %s\n", username);
-    fprintf(stderr, "user signature (%zu bits): ", mpz_sizeinbase(s, 2));
+    fprintf(stderr, "user signature (%zu bits, %s): ", mpz_sizeinbase(s, 2),
+            stamp.hit ? "verified before" : "verified");
     gmp_printf("%Zd\n", s);
     fprintf(stderr, "n - modulus (%zu bits): ", mpz_sizeinbase(n, 2));
     gmp_printf("%Zd\n", n);
@@ -166,24 +431,126 @@ int main(int argc, char **argv) {
     gmp_printf("%Zd\n", e);
   }
 
+  /* Incremental mode only encrypts the chunks that are not cached */
+  if (cache_dir != NULL) {
+    out_file = activation_options[1] == 1 ? fopen(output_file, "w") : stdout;
+    if (out_file == NULL) {
+      fprintf(stderr, "encrypt: Couldn't open %s to write ciphertext\n",
+              output_file);
+      return 1;
+    }
+
+    RsaChunkStats stats;
+    bool ok = rsa_encrypt_incremental(
+        activation_options[0] == 1 ? in_file : stdin, out_file, n, e,
+        cache_dir, &stats);
+    if (!ok) {
+      fprintf(stderr, "encrypt: Couldn't write the ciphertext\n");
+    }
+    if (activation_options[3] == 1) {
+      fprintf(stderr,
+              "chunks: %zu, reused: %zu, bytes reused: %llu of %llu\n",
+              stats.chunks, stats.reused,
+              (unsigned long long)stats.reused_bytes,
+              (unsigned long long)stats.bytes);
+    }
+
+    if (out_file != stdout) {
+      fclose(out_file);
+    }
+    free(username);
+    mpz_clears(n, e, s, expected_s, NULL);
+    return ok ? 0 : 1;
+  }
+
+  /* Shards are written next to the manifest named by -o */
+  if (shards > 0) {
+    bool ok = shard_encrypt(activation_options[0] == 1 ? in_file : stdin,
+                            output_file, (size_t)shards, n, e, flags);
+    if (!ok) {
+      fprintf(stderr, "encrypt: Couldn't write the shards of %s\n",
+              output_file);
+    }
+    free(username);
+    mpz_clears(n, e, s, expected_s, NULL);
+    return ok ? 0 : 1;
+  }
+
+  /* Stream mode encrypts and flushes each message as soon as it arrives */
+  if (stream) {
+    out_file = activation_options[1] == 1 ? fopen(output_file, "w") : stdout;
+    if (out_file == NULL) {
+      fprintf(stderr, "encrypt: Couldn't open %s to write ciphertext\n",
+              output_file);
+      return 1;
+    }
+
+    RsaStreamStats stats;
+    bool ok = rsa_encrypt_stream(activation_options[0] == 1 ? in_file : stdin,
+                                 out_file, n, e, stream_flags, &stats);
+    if (!ok) {
+      fprintf(stderr, "encrypt: Input ended in the middle of a frame, or the "
+                      "ciphertext couldn't be written\n");
+    }
+    if (activation_options[3] == 1) {
+      fprintf(stderr,
+              "messages: %zu, latency (us): mean %.1f, p50 %.1f, p99 %.1f, "
+              "max %.1f\n",
+              stats.messages, stats.mean_us, stats.p50_us, stats.p99_us,
+              stats.max_us);
+    }
+
+    if (out_file != stdout) {
+      fclose(out_file);
+    }
+    free(username);
+    mpz_clears(n, e, s, expected_s, NULL);
+    return ok ? 0 : 1;
+  }
+
   /* Encrypts input file or stdin with the public key file and sends
   the output to either stdout or a given output file. */
+  bool ok = true;
   if (activation_options[1] == 0) {
     if (activation_options[0] == 0) {
-      rsa_encrypt_file(stdin, stdout, n, e);
+      ok = rsa_encrypt_file_with(stdin, stdout, n, e, flags);
     } else {
-      rsa_encrypt_file(in_file, stdout, n, e);
+      ok = rsa_encrypt_file_with(in_file, stdout, n, e, flags);
     }
   } else {
-    out_file = fopen(output_file, "w+");
+    /* Long runs into a file leave a checkpoint next to it to resume from */
+    char *checkpoint = (char *)malloc(strlen(output_file) + 6);
+    sprintf(checkpoint, "%s.ckpt", output_file);
+    RsaCheckpoint ckpt = {checkpoint, resume, RSA_CHECKPOINT_SECONDS, 0, 0,
+                          false};
+    out_file = resume ? fopen(output_file, "r+") : NULL;
+    if (out_file == NULL) {
+      out_file = fopen(output_file, "w+");
+    }
     uint64_t size = 0;
 
+    ok = rsa_encrypt_file_resumable(activation_options[0] == 0 ? stdin
+                                                               : in_file,
+                                    out_file, n, e, flags, &ckpt);
+    if (ckpt.rejected) {
+      fprintf(stderr, "encrypt: Checkpoint %s is for another input, key or "
+                      "format\n",
+              checkpoint);
+      free(checkpoint);
+      return 1;
+    }
+    if (activation_options[3] == 1 && ckpt.blocks > 0) {
+      fprintf(stderr, "resumed at block %llu, input offset %llu\n",
+              (unsigned long long)ckpt.blocks,
+              (unsigned long long)ckpt.offset);
+    }
+    free(checkpoint);
+
     if (activation_options[0] == 0) {
-      rsa_encrypt_file(stdin, out_file, n, e);
       fseek(out_file, 0, SEEK_END);
       size = ftell(out_file);
-      while (size == 0) {
-        rsa_encrypt_file(stdin, out_file, n, e);
+      while (ok && size == 0) {
+        ok = rsa_encrypt_file_with(stdin, out_file, n, e, flags);
         fseek(out_file, 0, SEEK_END);
         size = ftell(out_file);
 
@@ -192,11 +559,10 @@ int main(int argc, char **argv) {
         }
       }
     } else {
-      rsa_encrypt_file(in_file, out_file, n, e);
       fseek(out_file, 0, SEEK_END);
       size = ftell(out_file);
-      while (size == 0) {
-        rsa_encrypt_file(in_file, out_file, n, e);
+      while (ok && size == 0) {
+        ok = rsa_encrypt_file_with(in_file, out_file, n, e, flags);
         fseek(out_file, 0, SEEK_END);
         size = ftell(out_file);
 
@@ -207,11 +573,15 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (!ok) {
+    fprintf(stderr, "encrypt: Couldn't write the ciphertext\n");
+  }
+
   free(in_file);
   free(out_file);
   free(pub_file);
   free(username);
 
   mpz_clears(n, e, s, expected_s, NULL);
-  return 0;
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+#include "fileio.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FILEIO_URING 1
+#endif
+#endif
+
+#ifdef FILEIO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#define DEPTH 4            /* Requests kept in flight */
+#define CHUNK (1 << 20)    /* Bytes per request */
+
+#ifdef FILEIO_URING
+
+/* A minimal io_uring: one submission and one completion ring */
+typedef struct {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  bool fixed; /* Buffers were registered with the kernel */
+} Ring;
+
+/* Creates the ring and registers the buffers, returns false on failure */
+static bool ring_init(Ring *ring, uint8_t *buffers[DEPTH]) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(*ring));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, DEPTH, &params);
+  if (ring->fd < 0) {
+    return false;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = (struct io_uring_sqe *)mmap(
+      NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    close(ring->fd);
+    return false;
+  }
+
+  uint8_t *sq = (uint8_t *)ring->sq_ring;
+  uint8_t *cq = (uint8_t *)ring->cq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  /* Registered buffers save the kernel from mapping them on every request.
+  If the memlock limit does not allow it, plain reads and writes are used. */
+  struct iovec iov[DEPTH];
+  for (int i = 0; i < DEPTH; i++) {
+    iov[i].iov_base = buffers[i];
+    iov[i].iov_len = CHUNK;
+  }
+  ring->fixed = syscall(__NR_io_uring_register, ring->fd,
+                        IORING_REGISTER_BUFFERS, iov, DEPTH) == 0;
+  return true;
+}
+
+static void ring_clear(Ring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+/* Returns true if io_uring_enter() failed with an error worth retrying */
+static bool ring_transient(void) {
+  return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+}
+
+/* Queues and submits one read or write of len bytes at offset, returns
+false if the kernel didn't take it, in which case it is not queued */
+static bool ring_submit(Ring *ring, int fd, bool write, int index, uint8_t *buf,
+                        size_t len, off_t offset) {
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+  memset(sqe, 0, sizeof(*sqe));
+  if (ring->fixed) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = (uint16_t)index;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)len;
+  sqe->off = (uint64_t)offset;
+  sqe->user_data = (uint64_t)index;
+
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  /* EAGAIN and EBUSY mean the kernel is short of resources or completion
+  room for now, so they are retried a bounded number of times */
+  for (int tries = 0; tries < 1000; tries++) {
+    long submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+    if (submitted == 1) {
+      return true;
+    }
+    if (submitted < 0 && !ring_transient()) {
+      break;
+    }
+    if (submitted < 0 && errno != EINTR) {
+      sched_yield();
+    }
+  }
+
+  /* The kernel never consumed the entry, so it is taken back */
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  return false;
+}
+
+/* Waits for one completion, returns its request index and result, or -1
+if the ring failed and no completion will come */
+static int ring_wait(Ring *ring, int *result) {
+  unsigned head = *ring->cq_head;
+  while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0 &&
+        !ring_transient()) {
+      return -1;
+    }
+  }
+  struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+  int index = (int)cqe->user_data;
+  *result = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return index;
+}
+
+#endif
+
+/* States of one request buffer */
+enum { SLOT_IDLE, SLOT_BUSY, SLOT_READY };
+
+/* One buffer of DEPTH, with the file range it holds or will hold */
+typedef struct {
+  uint8_t *data;
+  size_t len;   /* Bytes requested (reads) or queued (writes) */
+  size_t done;  /* Bytes completed by the kernel */
+  size_t pos;   /* Bytes already handed out (reads) */
+  off_t offset; /* File offset of data[0] */
+  int state;
+} Slot;
+
+struct Reader {
+  FILE *file;
+  bool uring;
+#ifdef FILEIO_URING
+  Ring ring;
+#endif
+  Slot slots[DEPTH];
+  int current;      /* Slot being consumed */
+  off_t next;       /* Offset of the next read to submit */
+  off_t consumed;   /* Offset after the last byte handed out */
+  bool eof;         /* A read returned 0 or failed */
+  bool seekable;    /* The file position can be restored on close */
+};
+
+struct Writer {
+  FILE *file;
+  bool uring;
+#ifdef FILEIO_URING
+  Ring ring;
+#endif
+  Slot slots[DEPTH];
+  int current; /* Slot being filled */
+  off_t next;  /* Offset of the next write to submit */
+  bool failed;
+};
+
+/* io_uring is only worth it, and only safe with explicit offsets, for
+regular files that are not opened for appending */
+static bool uring_wanted(FILE *file) {
+#ifdef FILEIO_URING
+  const char *mode = getenv("RSA_IO");
+  if (mode != NULL && strcmp(mode, "stdio") == 0) {
+    return false;
+  }
+  struct stat info;
+  int fd = fileno(file);
+  if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    return false;
+  }
+  int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && (flags & O_APPEND) == 0;
+#else
+  (void)file;
+  return false;
+#endif
+}
+
+/* Allocates the slot buffers, page aligned for the kernel */
+static bool slots_init(Slot slots[DEPTH], uint8_t *buffers[DEPTH]) {
+  for (int i = 0; i < DEPTH; i++) {
+    memset(&slots[i], 0, sizeof(Slot));
+    slots[i].data = (uint8_t *)aligned_alloc(4096, CHUNK);
+    buffers[i] = slots[i].data;
+    if (slots[i].data == NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void slots_clear(Slot slots[DEPTH]) {
+  for (int i = 0; i < DEPTH; i++) {
+    free(slots[i].data);
+  }
+}
+
+#ifdef FILEIO_URING
+
+/* Reads the rest of a slot with pread() when the ring won't take the
+request */
+static void reader_fill_sync(Reader *r, Slot *slot) {
+  while (slot->done < slot->len) {
+    ssize_t got = pread(fileno(r->file), slot->data + slot->done,
+                        slot->len - slot->done,
+                        slot->offset + (off_t)slot->done);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    slot->done += (size_t)got;
+  }
+  slot->state = SLOT_READY;
+}
+
+/* Submits a read of the rest of a slot's range */
+static void reader_continue(Reader *r, int index) {
+  Slot *slot = &r->slots[index];
+  if (!ring_submit(&r->ring, fileno(r->file), false, index,
+                   slot->data + slot->done, slot->len - slot->done,
+                   slot->offset + (off_t)slot->done)) {
+    reader_fill_sync(r, slot);
+  }
+}
+
+/* Submits a read of the next CHUNK bytes into a slot */
+static void reader_submit(Reader *r, int index) {
+  Slot *slot = &r->slots[index];
+  slot->offset = r->next;
+  slot->len = CHUNK;
+  slot->done = 0;
+  slot->pos = 0;
+  slot->state = SLOT_BUSY;
+  r->next += CHUNK;
+  reader_continue(r, index);
+}
+
+/* Handles one read completion. Short reads are continued from where they
+stopped so that each slot always holds one contiguous range. If the ring
+fails, the reads in flight end where they are, like a read error. */
+static void reader_reap(Reader *r) {
+  int result;
+  int index = ring_wait(&r->ring, &result);
+  if (index < 0) {
+    for (int i = 0; i < DEPTH; i++) {
+      if (r->slots[i].state == SLOT_BUSY) {
+        r->slots[i].state = SLOT_READY;
+      }
+    }
+    return;
+  }
+  Slot *slot = &r->slots[index];
+
+  if (result <= 0) {
+    slot->state = SLOT_READY;
+    return;
+  }
+  slot->done += (size_t)result;
+  if (slot->done < slot->len) {
+    reader_continue(r, index);
+  } else {
+    slot->state = SLOT_READY;
+  }
+}
+
+#endif
+
+Reader *reader_open(FILE *file) {
+  Reader *r = (Reader *)calloc(1, sizeof(Reader));
+  r->file = file;
+  r->uring = uring_wanted(file);
+
+#ifdef FILEIO_URING
+  uint8_t *buffers[DEPTH];
+  if (r->uring && slots_init(r->slots, buffers) &&
+      ring_init(&r->ring, buffers)) {
+    r->next = ftello(file);
+    r->consumed = r->next;
+    for (int i = 0; i < DEPTH; i++) {
+      reader_submit(r, i);
+    }
+    return r;
+  }
+  slots_clear(r->slots);
+#endif
+  r->uring = false;
+  r->seekable = ftello(file) >= 0;
+  r->consumed = r->seekable ? ftello(file) : 0;
+  return r;
+}
+
+size_t reader_read_some(Reader *r, void *buf, size_t len) {
+  if (len == 0 || r->eof) {
+    return 0;
+  }
+
+  if (!r->uring) {
+    ssize_t got;
+    do {
+      got = read(fileno(r->file), buf, len);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+      r->eof = true;
+      return 0;
+    }
+    r->consumed += (off_t)got;
+    return (size_t)got;
+  }
+
+#ifdef FILEIO_URING
+  Slot *slot = &r->slots[r->current];
+  while (slot->state == SLOT_BUSY) {
+    reader_reap(r);
+  }
+
+  size_t available = slot->done - slot->pos;
+  size_t take = available < len ? available : len;
+  memcpy(buf, slot->data + slot->pos, take);
+  slot->pos += take;
+  r->consumed += (off_t)take;
+
+  if (slot->pos == slot->done) {
+    if (slot->done < slot->len) {
+      /* The kernel returned less than asked: end of file or an error */
+      r->eof = true;
+    } else {
+      reader_submit(r, r->current);
+      r->current = (r->current + 1) % DEPTH;
+    }
+  }
+  return take;
+#else
+  return 0;
+#endif
+}
+
+size_t reader_read(Reader *r, void *buf, size_t len) {
+  uint8_t *out = (uint8_t *)buf;
+  size_t total = 0;
+  size_t got;
+
+  while (total < len && (got = reader_read_some(r, out + total, len - total)) > 0) {
+    total += got;
+  }
+  return total;
+}
+
+off_t reader_tell(Reader *r) { return r->consumed; }
+
+void reader_close(Reader *r) {
+#ifdef FILEIO_URING
+  if (r->uring) {
+    for (int i = 0; i < DEPTH; i++) {
+      while (r->slots[i].state == SLOT_BUSY) {
+        reader_reap(r);
+      }
+    }
+    ring_clear(&r->ring);
+    slots_clear(r->slots);
+    r->seekable = true;
+  }
+#endif
+  if (r->seekable) {
+    fseeko(r->file, r->consumed, SEEK_SET);
+  }
+  free(r);
+}
+
+#ifdef FILEIO_URING
+
+/* Writes the rest of a slot with pwrite() when the ring won't take the
+request */
+static void writer_flush_sync(Writer *w, Slot *slot) {
+  while (slot->done < slot->len) {
+    ssize_t put = pwrite(fileno(w->file), slot->data + slot->done,
+                         slot->len - slot->done,
+                         slot->offset + (off_t)slot->done);
+    if (put < 0 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      w->failed = true;
+      break;
+    }
+    slot->done += (size_t)put;
+  }
+  slot->state = SLOT_IDLE;
+}
+
+/* Submits a write of the rest of a slot's range */
+static void writer_continue(Writer *w, int index) {
+  Slot *slot = &w->slots[index];
+  if (!ring_submit(&w->ring, fileno(w->file), true, index,
+                   slot->data + slot->done, slot->len - slot->done,
+                   slot->offset + (off_t)slot->done)) {
+    writer_flush_sync(w, slot);
+  }
+}
+
+/* Handles one write completion, continuing short writes. If the ring
+fails, the writes in flight are lost and the output is marked failed. */
+static void writer_reap(Writer *w) {
+  int result;
+  int index = ring_wait(&w->ring, &result);
+  if (index < 0) {
+    for (int i = 0; i < DEPTH; i++) {
+      if (w->slots[i].state == SLOT_BUSY) {
+        w->slots[i].state = SLOT_IDLE;
+        w->failed = true;
+      }
+    }
+    return;
+  }
+  Slot *slot = &w->slots[index];
+
+  if (result < 0 || (result == 0 && slot->len > 0)) {
+    w->failed = true;
+    slot->state = SLOT_IDLE;
+    return;
+  }
+  slot->done += (size_t)result;
+  if (slot->done < slot->len) {
+    writer_continue(w, index);
+  } else {
+    slot->state = SLOT_IDLE;
+  }
+}
+
+/* Submits the slot being filled and moves on to the next one */
+static void writer_submit(Writer *w) {
+  Slot *slot = &w->slots[w->current];
+  if (slot->len == 0) {
+    return;
+  }
+  slot->offset = w->next;
+  slot->done = 0;
+  slot->state = SLOT_BUSY;
+  w->next += (off_t)slot->len;
+  writer_continue(w, w->current);
+
+  w->current = (w->current + 1) % DEPTH;
+  slot = &w->slots[w->current];
+  while (slot->state == SLOT_BUSY) {
+    writer_reap(w);
+  }
+  slot->len = 0;
+}
+
+#endif
+
+Writer *writer_open(FILE *file) {
+  Writer *w = (Writer *)calloc(1, sizeof(Writer));
+  w->file = file;
+  w->uring = uring_wanted(file);
+
+#ifdef FILEIO_URING
+  uint8_t *buffers[DEPTH];
+  if (w->uring && slots_init(w->slots, buffers) &&
+      ring_init(&w->ring, buffers)) {
+    fflush(file);
+    w->next = ftello(file);
+    return w;
+  }
+  slots_clear(w->slots);
+#endif
+  w->uring = false;
+  return w;
+}
+
+void writer_write(Writer *w, const void *buf, size_t len) {
+  if (!w->uring) {
+    fwrite(buf, 1, len, w->file);
+    return;
+  }
+
+#ifdef FILEIO_URING
+  const uint8_t *in = (const uint8_t *)buf;
+  while (len > 0) {
+    Slot *slot = &w->slots[w->current];
+    size_t room = CHUNK - slot->len;
+    size_t take = room < len ? room : len;
+    memcpy(slot->data + slot->len, in, take);
+    slot->len += take;
+    in += take;
+    len -= take;
+    if (slot->len == CHUNK) {
+      writer_submit(w);
+    }
+  }
+#endif
+}
+
+void writer_flush(Writer *w) {
+  if (!w->uring) {
+    fflush(w->file);
+    return;
+  }
+#ifdef FILEIO_URING
+  writer_submit(w);
+#endif
+}
+
+bool writer_close(Writer *w) {
+#ifdef FILEIO_URING
+  if (w->uring) {
+    writer_submit(w);
+    for (int i = 0; i < DEPTH; i++) {
+      while (w->slots[i].state == SLOT_BUSY) {
+        writer_reap(w);
+      }
+    }
+    ring_clear(&w->ring);
+    slots_clear(w->slots);
+    fseeko(w->file, w->next, SEEK_SET);
+  }
+#endif
+  bool ok = !w->failed;
+  if (!w->uring) {
+    ok = fflush(w->file) == 0 && !ferror(w->file) && ok;
+  }
+  free(w);
+  return ok;
+}
+
+const char *reader_backend(Reader *r) { return r->uring ? "io_uring" : "stdio"; }
+
+const char *writer_backend(Writer *w) { return w->uring ? "io_uring" : "stdio"; }
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+//
+// Buffered sequential file access for the file encryption loops.
+// On Linux, regular files are read and written through io_uring with
+// several large requests kept in flight; anything else (pipes, terminals,
+// append-only files, kernels without io_uring) is read with read() and
+// written through stdio. Setting the environment variable RSA_IO=stdio
+// forces the second path.
+//
+typedef struct Reader Reader;
+typedef struct Writer Writer;
+
+//
+// Starts reading a file from its current position.
+// The FILE must not have buffered input, and must not be read through
+// stdio until reader_close().
+//
+// file: the opened file to read.
+// returns: the new reader.
+//
+Reader *reader_open(FILE *file);
+
+//
+// Reads up to len bytes, waiting for more input like fread() does.
+//
+// r: the reader.
+// buf: where to store the bytes.
+// len: the number of bytes wanted.
+// returns: the number of bytes read, less than len only at end of file.
+//
+size_t reader_read(Reader *r, void *buf, size_t len);
+
+//
+// Reads at least one and up to len bytes, returning as soon as some input
+// is available rather than waiting for all len bytes.
+//
+// r: the reader.
+// buf: where to store the bytes.
+// len: the most bytes wanted.
+// returns: the number of bytes read, 0 only at end of file.
+//
+size_t reader_read_some(Reader *r, void *buf, size_t len);
+
+//
+// Returns the file offset just after the last byte returned; for files
+// that cannot seek, the number of bytes returned so far.
+//
+off_t reader_tell(Reader *r);
+
+//
+// Stops reading and leaves the FILE positioned after the last byte
+// returned, if the file is seekable.
+//
+void reader_close(Reader *r);
+
+//
+// Starts writing a file at its current position.
+// The FILE must not be written through stdio until writer_close().
+//
+// file: the opened file to write.
+// returns: the new writer.
+//
+Writer *writer_open(FILE *file);
+
+//
+// Queues len bytes for writing.
+//
+// w: the writer.
+// buf: the bytes to write.
+// len: the number of bytes.
+//
+void writer_write(Writer *w, const void *buf, size_t len);
+
+//
+// Hands everything queued so far to the kernel without waiting for it to
+// reach the file, so that a reader at the other end of a pipe sees it.
+//
+void writer_flush(Writer *w);
+
+//
+// Writes everything still queued, waits for it to reach the file, and
+// leaves the FILE positioned after the last byte written.
+//
+// returns: false if any of the output couldn't be written.
+//
+bool writer_close(Writer *w);
+
+//
+// Returns the name of the backend the reader or writer is using.
+//
+const char *reader_backend(Reader *r);
+const char *writer_backend(Writer *w);
@@ -0,0 +1,283 @@
+#include "hexcodec.h"
+#include "fileio.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEX_BUFFER (1 << 16) /* Bytes of input scanned at a time */
+
+/* The conversions below work on eight hex digits at a time packed in a
+64-bit word (SIMD within a register): one byte per digit, so the
+digit/letter adjustment is a handful of word-wide adds and masks instead
+of a branch or table lookup per character. */
+#define ONES 0x0101010101010101ull
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define TO_MEMORY_ORDER(x) (x)
+#else
+#define TO_MEMORY_ORDER(x) __builtin_bswap64(x)
+#endif
+
+/* Spreads the eight nibbles of v into the eight bytes of a word, least
+significant nibble in the least significant byte */
+static inline uint64_t spread_nibbles(uint32_t v) {
+  uint64_t x = v;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+  x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+  return x;
+}
+
+/* Turns eight nibble bytes into their ASCII digits '0'-'9', 'a'-'f' */
+static inline uint64_t nibbles_to_ascii(uint64_t x) {
+  uint64_t letters = ((x + 6 * ONES) >> 4) & ONES;
+  return x + '0' * ONES + letters * ('a' - '0' - 10);
+}
+
+/* Writes the 8 digits of v, most significant first */
+static inline void encode8(char *out, uint32_t v) {
+  uint64_t x = TO_MEMORY_ORDER(nibbles_to_ascii(spread_nibbles(v)));
+  memcpy(out, &x, 8);
+}
+
+/* Reads 8 digits, most significant first */
+static inline uint32_t decode8(const char *in) {
+  uint64_t x;
+  memcpy(&x, in, 8);
+  x = TO_MEMORY_ORDER(x);
+  /* '0'-'9' keep their low nibble, 'a'-'f' and 'A'-'F' have bit 6 set
+  and need 9 added to theirs */
+  uint64_t letters = (x >> 6) & ONES;
+  x = (x & 0x0F0F0F0F0F0F0F0Full) + letters * 9;
+  x = (x | (x >> 4)) & 0x00FF00FF00FF00FFull;
+  x = (x | (x >> 8)) & 0x0000FFFF0000FFFFull;
+  x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+  return (uint32_t)x;
+}
+
+/* Returns the value of one hex digit */
+static inline uint32_t digit_value(char c) {
+  return (uint32_t)((c & 0x0F) + ((c >> 6) & 1) * 9);
+}
+
+bool hex_digit(char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+         (c >= 'A' && c <= 'F');
+}
+
+size_t hex_size(const mpz_t x) { return mpz_sizeinbase(x, 16); }
+
+size_t hex_encode(char *out, const mpz_t x) {
+#if GMP_NUMB_BITS == 64 && GMP_NAIL_BITS == 0
+  size_t limbs = mpz_size(x);
+  if (limbs == 0) {
+    out[0] = '0';
+    return 1;
+  }
+
+  /* The top limb is written without its leading zero digits */
+  char first[16];
+  mp_limb_t top = mpz_getlimbn(x, limbs - 1);
+  encode8(first, (uint32_t)(top >> 32));
+  encode8(first + 8, (uint32_t)top);
+  size_t skip = (size_t)__builtin_clzll(top) / 4;
+  size_t length = 16 - skip;
+  memcpy(out, first + skip, length);
+
+  const mp_limb_t *data = mpz_limbs_read(x);
+  for (size_t i = limbs - 1; i-- > 0;) {
+    encode8(out + length, (uint32_t)(data[i] >> 32));
+    encode8(out + length + 8, (uint32_t)data[i]);
+    length += 16;
+  }
+  return length;
+#else
+  char *text = mpz_get_str(NULL, 16, x);
+  size_t length = strlen(text);
+  memcpy(out, text, length);
+  void (*release)(void *, size_t);
+  mp_get_memory_functions(NULL, NULL, &release);
+  release(text, length + 1);
+  return length;
+#endif
+}
+
+void hex_decode(mpz_t x, const char *hex, size_t len) {
+#if GMP_NUMB_BITS == 64 && GMP_NAIL_BITS == 0
+  size_t limbs = (len + 15) / 16;
+  if (limbs == 0) {
+    mpz_set_ui(x, 0);
+    return;
+  }
+
+  mp_limb_t *data = mpz_limbs_write(x, limbs);
+  const char *end = hex + len;
+  for (size_t i = 0; i + 1 < limbs; i++) {
+    end -= 16;
+    data[i] = ((mp_limb_t)decode8(end) << 32) | decode8(end + 8);
+  }
+
+  /* The most significant limb may have fewer than 16 digits */
+  mp_limb_t top = 0;
+  for (const char *c = hex; c < end; c++) {
+    top = (top << 4) | digit_value(*c);
+  }
+  data[limbs - 1] = top;
+  mpz_limbs_finish(x, limbs);
+#else
+  char *text = (char *)malloc(len + 1);
+  memcpy(text, hex, len);
+  text[len] = '\0';
+  mpz_set_str(x, text, 16);
+  free(text);
+#endif
+}
+
+struct HexReader {
+  FILE *file;
+  Reader *reader;
+  char *buffer;
+  size_t pos;    /* Next unread byte in buffer */
+  size_t len;    /* Bytes held in buffer */
+  char *token;   /* Digits of a value that crosses a buffer refill */
+  size_t token_len;
+  size_t max_digits; /* Room in token, and the most digits in a value */
+  bool oversized;    /* A value had more than max_digits digits */
+};
+
+HexReader *hexreader_open(FILE *file, size_t max_digits) {
+  HexReader *h = (HexReader *)calloc(1, sizeof(HexReader));
+  h->file = file;
+  h->reader = reader_open(file);
+  h->buffer = (char *)malloc(HEX_BUFFER);
+  h->max_digits = max_digits;
+  h->token = (char *)malloc(max_digits + 1);
+  return h;
+}
+
+/* Refills the buffer, returns false at end of file */
+static bool hexreader_fill(HexReader *h) {
+  h->pos = 0;
+  h->len = reader_read_some(h->reader, h->buffer, HEX_BUFFER);
+  return h->len > 0;
+}
+
+/* Appends digits to the token being assembled across refills, returns
+false if the value no longer fits */
+static bool token_append(HexReader *h, const char *digits, size_t count) {
+  if (count > h->max_digits - h->token_len) {
+    h->oversized = true;
+    return false;
+  }
+  memcpy(h->token + h->token_len, digits, count);
+  h->token_len += count;
+  return true;
+}
+
+/* Skips whitespace, returns false at end of file */
+static bool hexreader_skip_space(HexReader *h) {
+  while (true) {
+    while (h->pos < h->len && (h->buffer[h->pos] == '\n' ||
+                               h->buffer[h->pos] == ' ' ||
+                               h->buffer[h->pos] == '\t' ||
+                               h->buffer[h->pos] == '\r')) {
+      h->pos++;
+    }
+    if (h->pos < h->len) {
+      return true;
+    }
+    if (!hexreader_fill(h)) {
+      return false;
+    }
+  }
+}
+
+bool hexreader_line(HexReader *h, char marker, char *line, size_t size) {
+  if (!hexreader_skip_space(h) || h->buffer[h->pos] != marker) {
+    return false;
+  }
+  h->pos++;
+
+  size_t length = 0;
+  while (true) {
+    if (h->pos == h->len && !hexreader_fill(h)) {
+      break;
+    }
+    char c = h->buffer[h->pos++];
+    if (c == '\n') {
+      break;
+    }
+    if (length + 1 < size) {
+      line[length++] = c;
+    }
+  }
+  if (size > 0) {
+    line[length] = '\0';
+  }
+  return true;
+}
+
+bool hexreader_next(HexReader *h, mpz_t x) {
+  /* Skips the whitespace before the value */
+  if (!hexreader_skip_space(h)) {
+    return false;
+  }
+
+  if (h->oversized || !hex_digit(h->buffer[h->pos])) {
+    return false;
+  }
+
+  /* A value is given up on as soon as it has too many digits, without
+  scanning the rest of it */
+  h->token_len = 0;
+  while (true) {
+    size_t start = h->pos;
+    size_t stop = h->len - start > h->max_digits - h->token_len + 1
+                      ? start + h->max_digits - h->token_len + 1
+                      : h->len;
+    while (h->pos < stop && hex_digit(h->buffer[h->pos])) {
+      h->pos++;
+    }
+
+    if (h->pos < h->len) {
+      /* The value ends inside the buffer, or is already too long */
+      if (h->token_len == 0 && h->pos - start <= h->max_digits) {
+        hex_decode(x, h->buffer + start, h->pos - start);
+        return true;
+      }
+      if (!token_append(h, h->buffer + start, h->pos - start)) {
+        return false;
+      }
+      hex_decode(x, h->token, h->token_len);
+      return true;
+    }
+
+    if (!token_append(h, h->buffer + start, h->pos - start)) {
+      return false;
+    }
+    if (!hexreader_fill(h)) {
+      hex_decode(x, h->token, h->token_len);
+      return true;
+    }
+  }
+}
+
+bool hexreader_oversized(HexReader *h) { return h->oversized; }
+
+off_t hexreader_tell(HexReader *h) {
+  return reader_tell(h->reader) - (off_t)(h->len - h->pos);
+}
+
+void hexreader_close(HexReader *h) {
+  off_t position = hexreader_tell(h);
+  reader_close(h->reader);
+  if (ftello(h->file) >= 0) {
+    fseeko(h->file, position, SEEK_SET);
+  }
+  free(h->buffer);
+  free(h->token);
+  free(h);
+}
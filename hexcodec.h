@@ -0,0 +1,97 @@
+#pragma once
+
+#include "fileio.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+//
+// Returns the number of characters hex_encode() may write for x,
+// not counting a terminating null.
+//
+size_t hex_size(const mpz_t x);
+
+//
+// Writes x as lowercase hexadecimal without leading zeros, exactly as
+// gmp_printf("%Zx") does. The output is not null terminated.
+//
+// out: where to write, with room for hex_size(x) characters.
+// x: the non-negative value to write.
+// returns: the number of characters written.
+//
+size_t hex_encode(char *out, const mpz_t x);
+
+//
+// Sets x to the value of len hexadecimal digits.
+// The digits are assumed to have been checked with hex_digit().
+//
+// x: will store the value.
+// hex: the digits, most significant first.
+// len: the number of digits.
+//
+void hex_decode(mpz_t x, const char *hex, size_t len);
+
+//
+// Returns true if c is a hexadecimal digit in either case.
+//
+bool hex_digit(char c);
+
+//
+// Reads whitespace-separated hexadecimal values from a file through a
+// buffer, as repeated gmp_fscanf("%Zx\n") calls would, except that a value
+// may have at most a fixed number of digits. The reader's memory is fixed
+// when it is opened, however long the lines of the file are.
+//
+typedef struct HexReader HexReader;
+
+//
+// Starts reading hexadecimal values from a file.
+//
+// file: the opened file to read.
+// max_digits: the most digits a value may have.
+// returns: the new reader.
+//
+HexReader *hexreader_open(FILE *file, size_t max_digits);
+
+//
+// Reads the next value.
+//
+// h: the reader.
+// x: will store the value.
+// returns: true if a value was read, false at end of file, on a
+// character that is not a hexadecimal digit or whitespace, or on a value
+// with more than max_digits digits, after which nothing more is read.
+//
+bool hexreader_next(HexReader *h, mpz_t x);
+
+//
+// Returns true if reading stopped at a value with too many digits.
+//
+bool hexreader_oversized(HexReader *h);
+
+//
+// Reads the next line if it starts with marker, such as the header lines
+// at the start of a cipher file.
+//
+// h: the reader.
+// marker: the character the line must start with.
+// line: will store the rest of the line without its newline, null
+// terminated and cut short to fit.
+// size: the room in line.
+// returns: true if such a line was read, false if the next value is not
+// one, in which case nothing is consumed but whitespace.
+//
+bool hexreader_line(HexReader *h, char marker, char *line, size_t size);
+
+//
+// Returns the file offset just after the data consumed so far, as
+// reader_tell() does for the bytes it has returned.
+//
+off_t hexreader_tell(HexReader *h);
+
+//
+// Frees the reader, leaving the file positioned after the data consumed
+// when it is seekable.
+//
+void hexreader_close(HexReader *h);
@@ -0,0 +1,153 @@
+#include "keycache.h"
+#include "rsa.h"
+#include "sha256.h"
+#include <fcntl.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Bytes in one cache line: digest, two numbers, separators and newline */
+#define LINE_SIZE (2 * SHA256_SIZE + 48)
+
+/* Writes the path of the cache file into path, creating the directories
+of the default location; returns false if the cache is turned off */
+static bool keycache_path(char *path, size_t size) {
+  const char *file = getenv("RSA_KEYCACHE");
+  if (file != NULL) {
+    snprintf(path, size, "%s", file);
+    return file[0] != '\0';
+  }
+
+  const char *base = getenv("XDG_CACHE_HOME");
+  if (base != NULL && base[0] != '\0') {
+    snprintf(path, size, "%s/rsa", base);
+  } else {
+    const char *home = getenv("HOME");
+    if (home == NULL || home[0] == '\0') {
+      return false;
+    }
+    snprintf(path, size, "%s/.cache", home);
+    mkdir(path, 0700);
+    snprintf(path, size, "%s/.cache/rsa", home);
+  }
+  mkdir(path, 0700);
+  size_t len = strlen(path);
+  snprintf(path + len, size - len, "/verified");
+  return true;
+}
+
+/* Writes the cache line for stamp into line */
+static void keycache_line(char *line, size_t size, const KeyStamp *stamp) {
+  snprintf(line, size, "%s %lld %ld\n", stamp->digest,
+           (long long)stamp->seconds, stamp->nanoseconds);
+}
+
+void keycache_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[],
+                       FILE *pbfile, KeyStamp *stamp) {
+  struct stat info;
+  memset(stamp, 0, sizeof(*stamp));
+  if (fstat(fileno(pbfile), &info) == 0 && S_ISREG(info.st_mode)) {
+    stamp->valid = true;
+    stamp->seconds = (int64_t)info.st_mtim.tv_sec;
+    stamp->nanoseconds = info.st_mtim.tv_nsec;
+  }
+
+  /* The key is parsed from the same bytes that are hashed, so the file
+  can't change between the two */
+  size_t capacity = 4096;
+  size_t len = 0;
+  char *text = (char *)malloc(capacity);
+  size_t got;
+  while ((got = fread(text + len, 1, capacity - len, pbfile)) > 0) {
+    len += got;
+    if (len == capacity) {
+      capacity *= 2;
+      text = (char *)realloc(text, capacity);
+    }
+  }
+
+  Sha256 h;
+  uint8_t digest[SHA256_SIZE];
+  sha256_init(&h);
+  sha256_update(&h, text, len);
+  sha256_final(&h, digest);
+  sha256_hex(stamp->digest, digest);
+
+  FILE *copy = len > 0 ? fmemopen(text, len, "r") : NULL;
+  if (copy != NULL) {
+    rsa_read_pub(n, e, s, username, copy);
+    fclose(copy);
+  } else {
+    stamp->valid = false;
+  }
+  free(text);
+}
+
+/* Returns true if the cache file holds the line for stamp */
+static bool keycache_find(const char *path, const KeyStamp *stamp) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  FILE *file = fdopen(fd, "r");
+  char want[LINE_SIZE];
+  char line[LINE_SIZE];
+  keycache_line(want, sizeof(want), stamp);
+
+  flock(fd, LOCK_SH);
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), file) != NULL) {
+    found = strcmp(line, want) == 0;
+  }
+  flock(fd, LOCK_UN);
+  fclose(file);
+  return found;
+}
+
+/* Appends the line for stamp, emptying a full cache first */
+static void keycache_add(const char *path, const KeyStamp *stamp) {
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+  if (fd < 0) {
+    return;
+  }
+  char line[LINE_SIZE];
+  keycache_line(line, sizeof(line), stamp);
+  size_t len = strlen(line);
+
+  /* A torn line never matches, so a failed write only costs a
+  verification next time */
+  flock(fd, LOCK_EX);
+  struct stat info;
+  bool ok = fstat(fd, &info) == 0;
+  if (ok && (size_t)info.st_size >= (size_t)KEYCACHE_ENTRIES * len) {
+    ok = ftruncate(fd, 0) == 0;
+  }
+  if (ok) {
+    ok = write(fd, line, len) == (ssize_t)len;
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+bool keycache_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n, KeyStamp *stamp) {
+  char path[4096];
+  bool cached = stamp->valid && keycache_path(path, sizeof(path));
+  if (cached && keycache_find(path, stamp)) {
+    stamp->hit = true;
+    return true;
+  }
+
+  if (!rsa_verify(m, s, e, n)) {
+    return false;
+  }
+  if (cached) {
+    keycache_add(path, stamp);
+  }
+  return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "sha256.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// A local cache of public key files whose username signature has been
+// verified, so that encrypting with the same key again does not redo the
+// full-width exponentiation of rsa_verify(). An entry is the SHA-256 of
+// the key file's bytes and its modification time, one per line:
+// "<sha256> <seconds> <nanoseconds>". The stamp covers exactly the bytes
+// that were parsed, so any change to n, e, s or the username misses the
+// cache and is verified again.
+//
+// The cache is the file named by the environment variable RSA_KEYCACHE,
+// or rsa/verified under $XDG_CACHE_HOME or ~/.cache. Setting RSA_KEYCACHE
+// to an empty string turns the cache off. Only regular files are cached;
+// keys read from pipes or a keyring are always verified.
+//
+
+// Cache entries kept before the cache is emptied and started again
+#define KEYCACHE_ENTRIES 4096
+
+// What identifies the contents of one public key file
+typedef struct {
+  bool valid; /* False if the key can't be cached */
+  bool hit;   /* Set by keycache_verify() when the cache had the key */
+  char digest[2 * SHA256_SIZE + 1];
+  int64_t seconds;
+  long nanoseconds;
+} KeyStamp;
+
+//
+// Reads a public key file like rsa_read_pub(), and stamps the bytes read.
+// All mpz_t arguments are expected to be initialized.
+//
+// n: will store the public modulus.
+// e: will store the public exponent.
+// s: will store the signature.
+// username: will store the username, as rsa_read_pub() does.
+// pbfile: the open public key file.
+// stamp: will store the stamp; not valid if pbfile is not a regular file.
+//
+void keycache_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[],
+                       FILE *pbfile, KeyStamp *stamp);
+
+//
+// Verifies a username signature like rsa_verify(), skipping the
+// exponentiation if the stamped key file is in the cache, and adding it
+// to the cache when it verifies.
+//
+// m: the expected message, the username read as a base 62 number.
+// s: the signature.
+// e: the public exponent.
+// n: the public modulus.
+// stamp: the stamp from keycache_read_pub(), or one with valid false.
+// returns: true if the signature is valid.
+//
+bool keycache_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n, KeyStamp *stamp);
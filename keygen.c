@@ -1,4 +1,6 @@
 #include "numtheory.h"
+#include "pool.h"
+#include "profile.h"
 #include "randstate.h"
 #include "rsa.h"
 #include <gmp.h>
@@ -8,10 +10,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
-#include <time.h>
 #include <unistd.h>
 
-#define OPTIONS "b:i:n:d:s:vh"
+#define OPTIONS "b:i:n:d:s:P:j:vh"
 
 int main(int argc, char **argv) {
 
@@ -22,7 +23,9 @@ int main(int argc, char **argv) {
   char *public_key_file_name = "rsa.pub";
   char *private_key_file_name = "rsa.priv";
   char *username;
-  uint64_t seed = time(NULL);
+  uint64_t seed = 0;
+  char *pool_dir = NULL; /* Prime pool to draw p and q from, if any */
+  char *profile_file = NULL; /* Where to write the JSON profile, if at all */
 
   FILE *pub_file;
   FILE *pri_file;
@@ -79,6 +82,12 @@ int main(int argc, char **argv) {
       activation_options[4] = 1;
       seed = strtoul(optarg, NULL, 10);
       break;
+    case 'P':
+      pool_dir = optarg;
+      break;
+    case 'j':
+      profile_file = optarg;
+      break;
     case 'v':
       activation_options[5] = 1;
       break;
@@ -92,7 +101,7 @@ int main(int argc, char **argv) {
                       "(n) whose length is specified in\n");
       fprintf(stderr, "  the program options.\n");
       fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
-                      "Default: time()\n");
+                      "Default: system entropy\n");
       fprintf(stderr, "    -b <bits>   : Public modulus n must have at least "
                       "<bits> bits. Default: 1024\n");
       fprintf(stderr, "    -i <iters>  : Run <iters> Miller-Rabin iterations "
@@ -102,6 +111,10 @@ int main(int argc, char **argv) {
           "    -n <pbfile> : Public key file is <pbfile>. Default: rsa.pub\n");
       fprintf(stderr, "    -d <pvfile> : Private key file is <pvfile>. "
                       "Default: rsa.priv\n");
+      fprintf(stderr, "    -P <dir>    : Take p and q from the prime pool in "
+                      "<dir> when it has them.\n");
+      fprintf(stderr, "    -j <file>   : Write a JSON profile of key "
+                      "generation to <file>.\n");
       fprintf(stderr, "    -v          : Enable verbose output.\n");
       fprintf(stderr,
               "    -h          : Display program synopsis and usage.\n");
@@ -126,7 +139,7 @@ int main(int argc, char **argv) {
                     "(n) whose length is specified in\n");
     fprintf(stderr, "  the program options.\n");
     fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
-                    "Default: time()\n");
+                    "Default: system entropy\n");
     fprintf(stderr, "    -b <bits>   : Public modulus n must have at least "
                     "<bits> bits. Default: 1024\n");
     fprintf(stderr, "    -i <iters>  : Run <iters> Miller-Rabin iterations for "
@@ -137,6 +150,10 @@ int main(int argc, char **argv) {
     fprintf(
         stderr,
         "    -d <pvfile> : Private key file is <pvfile>. Default: rsa.priv\n");
+    fprintf(stderr, "    -P <dir>    : Take p and q from the prime pool in "
+                    "<dir> when it has them.\n");
+    fprintf(stderr, "    -j <file>   : Write a JSON profile of key generation "
+                    "to <file>.\n");
     fprintf(stderr, "    -v          : Enable verbose output.\n");
     fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
     return 1;
@@ -163,15 +180,64 @@ int main(int argc, char **argv) {
 
   fchmod(fileno(pri_file), 0600);
 
-  randstate_init(seed);
+  /* Without -s the key comes from the kernel's entropy pool */
+  if (activation_options[4] == 1) {
+    randstate_init(seed);
+  } else if (!randstate_init_entropy()) {
+    fprintf(stderr, "Error: Couldn't read random numbers from the system\n");
+    fclose(pub_file);
+    fclose(pri_file);
+    return 1;
+  }
 
-  rsa_make_pub(p, q, n, e, bits, iterations);
+  if (profile_file != NULL) {
+    profile_start();
+  }
+  double mark = profile_now_us();
+
+  /* Takes p and q from the pool on a split it has primes for, and
+  searches for any that are missing, such as when another keygen took
+  them first */
+  bool pooled_p = false;
+  bool pooled_q = false;
+  uint64_t pbits = pool_dir != NULL ? pool_split(pool_dir, bits) : 0;
+  if (pbits == 0) {
+    pbits = rsa_prime_bits(bits);
+  }
+  pooled_p = pool_dir != NULL && pool_take(pool_dir, pbits, p);
+  if (!pooled_p) {
+    make_prime(p, pbits, iterations);
+  }
+  profile_phase(PROFILE_PRIME_P, &mark);
+  pooled_q = pool_dir != NULL && pool_take(pool_dir, bits - pbits, q) &&
+             mpz_cmp(p, q) != 0;
+  if (!pooled_q) {
+    do {
+      make_prime(q, bits - pbits, iterations);
+    } while (mpz_cmp(p, q) == 0);
+  }
+  profile_phase(PROFILE_PRIME_Q, &mark);
+  rsa_make_pub_from(p, q, n, e, bits);
+  profile_phase(PROFILE_PUBLIC_EXP, &mark);
   rsa_make_priv(d, e, p, q);
+  profile_phase(PROFILE_MOD_INVERSE, &mark);
   username = getenv("USER");
 
   mpz_set_str(signature, username, 62);
 
   rsa_sign(s, signature, d, n);
+  profile_phase(PROFILE_SIGN, &mark);
+
+  if (profile_file != NULL) {
+    FILE *json = fopen(profile_file, "w");
+    if (json == NULL) {
+      fprintf(stderr, "Error: Profile file %s can't be written\n",
+              profile_file);
+    } else {
+      profile_write_json(json, bits, iterations, numtheory_using());
+      fclose(json);
+    }
+  }
 
   fclose(pub_file);
   fclose(pri_file);
@@ -194,12 +260,14 @@ int main(int argc, char **argv) {
 
   pri_file = fopen(private_key_file_name, "w+");
   rsa_write_priv(n, d, pri_file);
+  rsa_write_priv_factors(p, q, pri_file);
   fseek(pri_file, 0, SEEK_END);
   size = ftell(pri_file);
 
   /* Writes private key to its designated file*/
   while (size == 0) {
     rsa_write_priv(n, d, pri_file);
+    rsa_write_priv_factors(p, q, pri_file);
     fseek(pri_file, 0, SEEK_END);
     size = ftell(pri_file);
 
@@ -210,6 +278,10 @@ int main(int argc, char **argv) {
 
   /* Prints verbose output */
   if (activation_options[5] == 1) {
+    if (pool_dir != NULL) {
+      fprintf(stderr, "primes from pool: p %s, q %s\n",
+              pooled_p ? "yes" : "no", pooled_q ? "yes" : "no");
+    }
     fprintf(stderr, "username: %s\n", username);
     fprintf(stderr, "user signature (%zu bits): ", mpz_sizeinbase(s, 2));
     gmp_printf("%Zd\n", s);
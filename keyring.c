@@ -0,0 +1,241 @@
+#include "keystore.h"
+#include "rsa.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define OPTIONS "k:vh"
+#define USERNAME_SIZE 10000
+
+static void usage(char *program) {
+  fprintf(stderr, "Usage: %s [options] <command> [arguments]\n", program);
+  fprintf(stderr, "  %s manages a keyring, a file of many public keys indexed "
+                  "by username\n",
+          program);
+  fprintf(stderr, "  and key id that encrypt -K looks keys up in.\n");
+  fprintf(stderr, "  Commands:\n");
+  fprintf(stderr, "    add <pbfile>...  : Add the keys in the public key "
+                  "files, replacing keys\n");
+  fprintf(stderr, "                       with the same username or id.\n");
+  fprintf(stderr, "    remove <name>... : Remove the keys with these "
+                  "usernames or ids.\n");
+  fprintf(stderr, "    list             : List the id, size and username of "
+                  "every key.\n");
+  fprintf(stderr, "    show <name>      : Print a key as a public key "
+                  "file.\n");
+  fprintf(stderr, "  Options:\n");
+  fprintf(stderr, "    -k <file>   : Keyring is <file>. Default: "
+                  "rsa.keyring\n");
+  fprintf(stderr, "    -v          : Print each key added or removed.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+/* Copies the keys of a keyring, or none if there is no keyring yet, into
+a list that can be changed and saved */
+static KeyringKey *load_keys(Keyring *ring, size_t *count) {
+  *count = 0;
+  size_t total = ring != NULL ? keyring_count(ring) : 0;
+  KeyringKey *keys = (KeyringKey *)malloc((total + 1) * sizeof(KeyringKey));
+  for (size_t i = 0; i < total; i++) {
+    KeyringEntry entry;
+    if (!keyring_at(ring, i, &entry)) {
+      continue;
+    }
+    KeyringKey *key = &keys[(*count)++];
+    key->username = strdup(entry.username);
+    mpz_init_set(key->n, entry.n);
+    mpz_init_set(key->e, entry.e);
+    mpz_init_set(key->s, entry.s);
+  }
+  return keys;
+}
+
+/* Removes the key at index from the list, keeping the others in order */
+static void drop_key(KeyringKey keys[], size_t *count, size_t index) {
+  free(keys[index].username);
+  mpz_clears(keys[index].n, keys[index].e, keys[index].s, NULL);
+  memmove(&keys[index], &keys[index + 1],
+          (*count - index - 1) * sizeof(KeyringKey));
+  *count -= 1;
+}
+
+/* Returns true if name is the username or the start of the id of key */
+static bool key_named(KeyringKey *key, const char *name) {
+  if (strcmp(key->username, name) == 0) {
+    return true;
+  }
+  uint8_t id[SHA256_SIZE];
+  char hex[2 * SHA256_SIZE + 1];
+  rsa_key_id(id, key->n);
+  sha256_hex(hex, id);
+  return strlen(name) >= 16 && strncasecmp(hex, name, strlen(name)) == 0;
+}
+
+/* Reads and verifies a public key file and adds it to the list, dropping
+any key it replaces */
+static bool add_key(KeyringKey **keys, size_t *count, const char *path,
+                    bool verbose) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "keyring: Couldn't open %s to read public key\n", path);
+    return false;
+  }
+
+  KeyringKey key;
+  mpz_inits(key.n, key.e, key.s, NULL);
+  char *username = calloc(USERNAME_SIZE, sizeof(char));
+  rsa_read_pub(key.n, key.e, key.s, username, file);
+  fclose(file);
+  username[strcspn(username, "\r\n")] = '\0';
+
+  mpz_t expected;
+  mpz_init(expected);
+  bool ok = username[0] != '\0' && mpz_sgn(key.n) > 0 &&
+            mpz_set_str(expected, username, 62) == 0 &&
+            rsa_verify(expected, key.s, key.e, key.n);
+  mpz_clear(expected);
+  if (!ok) {
+    fprintf(stderr, "keyring: Couldn't verify user signature in %s\n", path);
+    mpz_clears(key.n, key.e, key.s, NULL);
+    free(username);
+    return false;
+  }
+  key.username = username;
+
+  uint8_t id[SHA256_SIZE];
+  char hex[2 * SHA256_SIZE + 1];
+  rsa_key_id(id, key.n);
+  sha256_hex(hex, id);
+  for (size_t i = *count; i-- > 0;) {
+    if (strcmp((*keys)[i].username, username) == 0 ||
+        mpz_cmp((*keys)[i].n, key.n) == 0) {
+      drop_key(*keys, count, i);
+    }
+  }
+
+  *keys = (KeyringKey *)realloc(*keys, (*count + 1) * sizeof(KeyringKey));
+  (*keys)[(*count)++] = key;
+  if (verbose) {
+    fprintf(stderr, "added %.16s %s\n", hex, username);
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int opt = 0;
+  char *path = "rsa.keyring";
+  bool verbose = false;
+
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 'k':
+      path = optarg;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  char *command = argv[optind++];
+  bool changes = strcmp(command, "add") == 0 || strcmp(command, "remove") == 0;
+  if (!changes && strcmp(command, "list") != 0 &&
+      strcmp(command, "show") != 0) {
+    fprintf(stderr, "keyring: Unknown command %s\n", command);
+    usage(argv[0]);
+    return 1;
+  }
+
+  Keyring *ring = keyring_open(path);
+  if (ring == NULL && (access(path, F_OK) == 0 || !changes)) {
+    fprintf(stderr, "keyring: Couldn't read keyring %s\n", path);
+    return 1;
+  }
+
+  /* Lookups read the mapped keyring directly */
+  if (strcmp(command, "list") == 0) {
+    for (size_t i = 0; i < keyring_count(ring); i++) {
+      KeyringEntry entry;
+      char hex[2 * SHA256_SIZE + 1];
+      if (keyring_at(ring, i, &entry)) {
+        sha256_hex(hex, entry.id);
+        printf("%.16s %5zu %s\n", hex, mpz_sizeinbase(entry.n, 2),
+               entry.username);
+      }
+    }
+    keyring_close(ring);
+    return 0;
+  }
+  if (strcmp(command, "show") == 0) {
+    KeyringEntry entry;
+    if (optind + 1 != argc || !keyring_find(ring, argv[optind], &entry)) {
+      fprintf(stderr, "keyring: No key named %s\n",
+              optind < argc ? argv[optind] : "");
+      keyring_close(ring);
+      return 1;
+    }
+    mpz_t n;
+    mpz_t e;
+    mpz_t s;
+    mpz_init_set(n, entry.n);
+    mpz_init_set(e, entry.e);
+    mpz_init_set(s, entry.s);
+    rsa_write_pub(n, e, s, (char *)entry.username, stdout);
+    mpz_clears(n, e, s, NULL);
+    keyring_close(ring);
+    return 0;
+  }
+
+  /* Changes are made to a copy of the keys, which is saved as a new
+  keyring */
+  size_t count = 0;
+  KeyringKey *keys = load_keys(ring, &count);
+  keyring_close(ring);
+  bool ok = true;
+  for (int i = optind; i < argc; i++) {
+    if (strcmp(command, "add") == 0) {
+      ok = add_key(&keys, &count, argv[i], verbose) && ok;
+      continue;
+    }
+    bool found = false;
+    for (size_t j = count; j-- > 0;) {
+      if (key_named(&keys[j], argv[i])) {
+        if (verbose) {
+          fprintf(stderr, "removed %s\n", keys[j].username);
+        }
+        drop_key(keys, &count, j);
+        found = true;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "keyring: No key named %s\n", argv[i]);
+      ok = false;
+    }
+  }
+
+  if (!keyring_save(path, keys, count)) {
+    fprintf(stderr, "keyring: Couldn't write keyring %s\n", path);
+    ok = false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    free(keys[i].username);
+    mpz_clears(keys[i].n, keys[i].e, keys[i].s, NULL);
+  }
+  free(keys);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,286 @@
+#include "keystore.h"
+#include "hexcodec.h"
+#include "rsa.h"
+#include "sha256.h"
+#include <fcntl.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char keyring_magic[8] = "RSAKEYR";
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t limb_bytes; /* sizeof(mp_limb_t) on the machine that wrote it */
+  uint64_t buckets;    /* Slots in each index, a power of two */
+  uint64_t count;      /* Keys */
+  uint64_t size;       /* Bytes in the file */
+} KeyringHeader;
+
+/* A key, followed by the limbs of n, e and s and then the null terminated
+username, padded to a multiple of 8 bytes */
+typedef struct {
+  uint32_t name_len;
+  uint32_t n_limbs;
+  uint32_t e_limbs;
+  uint32_t s_limbs;
+  uint8_t id[SHA256_SIZE];
+} KeyringRecord;
+
+struct Keyring {
+  const uint8_t *map;
+  size_t size;
+  const KeyringHeader *header;
+  const uint64_t *names; /* Record offsets by username hash, 0 if empty */
+  const uint64_t *ids;   /* Record offsets by key id, 0 if empty */
+  const uint64_t *order; /* Record offsets in the order keys were added */
+};
+
+/* FNV-1a, which is enough to spread usernames over the buckets */
+static uint64_t hash_name(const char *name) {
+  uint64_t h = 14695981039346656037ULL;
+  for (const char *c = name; *c != '\0'; c++) {
+    h = (h ^ (uint8_t)*c) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/* The id is already a hash, so its first 8 bytes index the table */
+static uint64_t hash_id(const uint8_t *id) {
+  uint64_t h = 0;
+  for (int i = 0; i < 8; i++) {
+    h = h << 8 | id[i];
+  }
+  return h;
+}
+
+static size_t record_size(size_t name_len, size_t limbs) {
+  size_t size = sizeof(KeyringRecord) + limbs * sizeof(mp_limb_t) +
+                name_len + 1;
+  return (size + 7) & ~(size_t)7;
+}
+
+/* Fills an entry from the record at offset, returns false if the offset
+or the record does not fit in the file */
+static bool keyring_record(const Keyring *ring, uint64_t offset,
+                           KeyringEntry *entry) {
+  const KeyringHeader *h = ring->header;
+  uint64_t first = sizeof(KeyringHeader) + (2 * h->buckets + h->count) * 8;
+  if (offset < first || offset % 8 != 0 ||
+      offset > ring->size - sizeof(KeyringRecord)) {
+    return false;
+  }
+
+  const KeyringRecord *r = (const KeyringRecord *)(ring->map + offset);
+  uint64_t limbs = (uint64_t)r->n_limbs + r->e_limbs + r->s_limbs;
+  if (r->n_limbs == 0 || r->e_limbs == 0 ||
+      record_size(r->name_len, limbs) > ring->size - offset) {
+    return false;
+  }
+  const mp_limb_t *n = (const mp_limb_t *)(r + 1);
+  const char *name = (const char *)(n + limbs);
+  if (name[r->name_len] != '\0') {
+    return false;
+  }
+
+  entry->username = name;
+  entry->id = r->id;
+  mpz_roinit_n(entry->n, n, r->n_limbs);
+  mpz_roinit_n(entry->e, n + r->n_limbs, r->e_limbs);
+  mpz_roinit_n(entry->s, n + r->n_limbs + r->e_limbs, r->s_limbs);
+  return true;
+}
+
+Keyring *keyring_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(KeyringHeader)) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  /* The tables must fit in the file before any of them is used */
+  const KeyringHeader *h = (const KeyringHeader *)map;
+  size_t size = (size_t)info.st_size;
+  bool ok = memcmp(h->magic, keyring_magic, sizeof(keyring_magic)) == 0 &&
+            h->version == KEYRING_VERSION &&
+            h->limb_bytes == sizeof(mp_limb_t) && h->size == size &&
+            h->buckets > 0 && (h->buckets & (h->buckets - 1)) == 0 &&
+            h->buckets <= size / 16 && h->count < h->buckets &&
+            sizeof(KeyringHeader) + (2 * h->buckets + h->count) * 8 <= size;
+  if (!ok) {
+    munmap(map, size);
+    return NULL;
+  }
+
+  Keyring *ring = (Keyring *)malloc(sizeof(Keyring));
+  ring->map = (const uint8_t *)map;
+  ring->size = size;
+  ring->header = h;
+  ring->names = (const uint64_t *)(ring->map + sizeof(KeyringHeader));
+  ring->ids = ring->names + h->buckets;
+  ring->order = ring->ids + h->buckets;
+  return ring;
+}
+
+void keyring_close(Keyring *ring) {
+  if (ring != NULL) {
+    munmap((void *)ring->map, ring->size);
+    free(ring);
+  }
+}
+
+size_t keyring_count(const Keyring *ring) { return ring->header->count; }
+
+bool keyring_at(const Keyring *ring, size_t index, KeyringEntry *entry) {
+  return index < ring->header->count &&
+         keyring_record(ring, ring->order[index], entry);
+}
+
+bool keyring_find_user(const Keyring *ring, const char *username,
+                       KeyringEntry *entry) {
+  uint64_t mask = ring->header->buckets - 1;
+  for (uint64_t i = hash_name(username) & mask, probes = 0;
+       ring->names[i] != 0 && probes <= mask; i = (i + 1) & mask, probes++) {
+    if (keyring_record(ring, ring->names[i], entry) &&
+        strcmp(entry->username, username) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool keyring_find_id(const Keyring *ring, const char *id,
+                     KeyringEntry *entry) {
+  /* The first 16 digits pick the bucket; the rest only narrow the match */
+  size_t digits = strlen(id);
+  uint8_t prefix[SHA256_SIZE];
+  if (digits < 16 || digits > 2 * SHA256_SIZE) {
+    return false;
+  }
+  for (size_t i = 0; i < digits; i++) {
+    if (!hex_digit(id[i])) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i + 1 < digits; i += 2) {
+    char pair[3] = {id[i], id[i + 1], '\0'};
+    prefix[i / 2] = (uint8_t)strtoul(pair, NULL, 16);
+  }
+
+  uint64_t mask = ring->header->buckets - 1;
+  for (uint64_t i = hash_id(prefix) & mask, probes = 0;
+       ring->ids[i] != 0 && probes <= mask; i = (i + 1) & mask, probes++) {
+    if (!keyring_record(ring, ring->ids[i], entry)) {
+      continue;
+    }
+    char hex[2 * SHA256_SIZE + 1];
+    sha256_hex(hex, entry->id);
+    if (strncasecmp(hex, id, digits) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool keyring_find(const Keyring *ring, const char *name, KeyringEntry *entry) {
+  return keyring_find_user(ring, name, entry) ||
+         keyring_find_id(ring, name, entry);
+}
+
+/* Puts offset in the first free slot from hash on */
+static void keyring_insert(uint64_t *table, uint64_t buckets, uint64_t hash,
+                           uint64_t offset) {
+  uint64_t i = hash & (buckets - 1);
+  while (table[i] != 0) {
+    i = (i + 1) & (buckets - 1);
+  }
+  table[i] = offset;
+}
+
+bool keyring_save(const char *path, KeyringKey keys[], size_t count) {
+  /* Keeps both tables at most half full so probes stay short */
+  uint64_t buckets = 8;
+  while (buckets < 2 * (uint64_t)count) {
+    buckets *= 2;
+  }
+
+  uint64_t first = sizeof(KeyringHeader) + (2 * buckets + count) * 8;
+  uint64_t size = first;
+  for (size_t i = 0; i < count; i++) {
+    size_t limbs = mpz_size(keys[i].n) + mpz_size(keys[i].e) +
+                   mpz_size(keys[i].s);
+    size += record_size(strlen(keys[i].username), limbs);
+  }
+
+  uint8_t *image = (uint8_t *)calloc(size, 1);
+  KeyringHeader *h = (KeyringHeader *)image;
+  memcpy(h->magic, keyring_magic, sizeof(keyring_magic));
+  h->version = KEYRING_VERSION;
+  h->limb_bytes = sizeof(mp_limb_t);
+  h->buckets = buckets;
+  h->count = count;
+  h->size = size;
+  uint64_t *names = (uint64_t *)(image + sizeof(KeyringHeader));
+  uint64_t *ids = names + buckets;
+  uint64_t *order = ids + buckets;
+
+  uint64_t offset = first;
+  for (size_t i = 0; i < count; i++) {
+    KeyringRecord *r = (KeyringRecord *)(image + offset);
+    size_t name_len = strlen(keys[i].username);
+    r->name_len = (uint32_t)name_len;
+    r->n_limbs = (uint32_t)mpz_size(keys[i].n);
+    r->e_limbs = (uint32_t)mpz_size(keys[i].e);
+    r->s_limbs = (uint32_t)mpz_size(keys[i].s);
+    rsa_key_id(r->id, keys[i].n);
+
+    mp_limb_t *limbs = (mp_limb_t *)(r + 1);
+    memcpy(limbs, mpz_limbs_read(keys[i].n), r->n_limbs * sizeof(mp_limb_t));
+    limbs += r->n_limbs;
+    memcpy(limbs, mpz_limbs_read(keys[i].e), r->e_limbs * sizeof(mp_limb_t));
+    limbs += r->e_limbs;
+    memcpy(limbs, mpz_limbs_read(keys[i].s), r->s_limbs * sizeof(mp_limb_t));
+    limbs += r->s_limbs;
+    memcpy(limbs, keys[i].username, name_len + 1);
+
+    keyring_insert(names, buckets, hash_name(keys[i].username), offset);
+    keyring_insert(ids, buckets, hash_id(r->id), offset);
+    order[i] = offset;
+    offset += record_size(name_len, r->n_limbs + r->e_limbs + r->s_limbs);
+  }
+
+  /* Written under a temporary name and renamed, so that a reader never
+  maps half a keyring */
+  char *temp = (char *)malloc(strlen(path) + 32);
+  sprintf(temp, "%s.%ld", path, (long)getpid());
+  FILE *file = fopen(temp, "wb");
+  bool ok = file != NULL;
+  if (ok) {
+    ok = fwrite(image, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temp, path) == 0;
+    if (!ok) {
+      unlink(temp);
+    }
+  }
+  free(temp);
+  free(image);
+  return ok;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "sha256.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// A keyring: many public keys in one binary file that is mapped into
+// memory, with hash indexes on the username and on the key id, the
+// SHA-256 of n in hex. The file is laid out as:
+//
+//   header      magic, format version, limb size, bucket count, key count
+//   names       buckets record offsets, indexed by a hash of the username
+//   ids         buckets record offsets, indexed by the start of the key id
+//   order       count record offsets, in the order the keys were added
+//   records     username, key id, and n, e and s as GMP limbs
+//
+// Both indexes use linear probing in a table at most half full, so a
+// lookup reads a slot or two and one record. n, e and s are stored as the
+// limbs GMP keeps them in, so entries refer to them in the mapping without
+// converting or copying them. Limbs are in the byte order and word size
+// of the machine, and a keyring made with a different limb size is
+// rejected.
+//
+// A keyring is never changed in place: keyring_save() writes a new file
+// and renames it over the old one, so readers see the old or the new
+// keyring, never a mix.
+//
+#define KEYRING_VERSION 1
+
+typedef struct Keyring Keyring;
+
+//
+// A key in a keyring. n, e and s are read-only views of the mapped file,
+// valid until the keyring is closed; they must not be cleared or changed,
+// and should be copied with mpz_set() before being passed to functions
+// that change their arguments.
+//
+typedef struct {
+  const char *username;
+  const uint8_t *id; /* SHA256_SIZE bytes */
+  mpz_t n;
+  mpz_t e;
+  mpz_t s;
+} KeyringEntry;
+
+//
+// A key to be saved, holding its own copies of the values.
+//
+typedef struct {
+  char *username;
+  mpz_t n;
+  mpz_t e;
+  mpz_t s;
+} KeyringKey;
+
+//
+// Maps a keyring file.
+//
+// path: the keyring file.
+// returns: the keyring, or NULL if the file is missing or not a valid
+// keyring.
+//
+Keyring *keyring_open(const char *path);
+
+//
+// Unmaps a keyring. Entries taken from it can no longer be used.
+//
+void keyring_close(Keyring *ring);
+
+//
+// Returns the number of keys in a keyring.
+//
+size_t keyring_count(const Keyring *ring);
+
+//
+// Gets a key by its position in the keyring.
+//
+// ring: the keyring.
+// index: the position, below keyring_count().
+// entry: will refer to the key.
+// returns: false if the index is out of range or the record is corrupt.
+//
+bool keyring_at(const Keyring *ring, size_t index, KeyringEntry *entry);
+
+//
+// Looks up a key by username.
+//
+// returns: false if no key has the username.
+//
+bool keyring_find_user(const Keyring *ring, const char *username,
+                       KeyringEntry *entry);
+
+//
+// Looks up a key by key id.
+//
+// id: the key id in hex, whole or at least its first 16 digits.
+// returns: false if no key has an id starting with those digits.
+//
+bool keyring_find_id(const Keyring *ring, const char *id,
+                     KeyringEntry *entry);
+
+//
+// Looks up a key by username, or failing that by key id.
+//
+bool keyring_find(const Keyring *ring, const char *name, KeyringEntry *entry);
+
+//
+// Writes a keyring holding the given keys, replacing the file atomically.
+//
+// path: the keyring file.
+// keys: the keys, whose usernames and ids should all be different.
+// count: the number of keys.
+// returns: false if the file could not be written.
+//
+bool keyring_save(const char *path, KeyringKey keys[], size_t count);
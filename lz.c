@@ -0,0 +1,156 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define HASH_BITS 13
+#define SKIP_SHIFT 6 /* Step grows by one every 64 bytes without a match */
+
+static inline uint32_t load32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+/* Multiplicative hash of four bytes */
+static inline uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Writes the part of a length that did not fit in its token nibble */
+static uint8_t *put_length(uint8_t *op, size_t n) {
+  while (n >= 255) {
+    *op++ = 255;
+    n -= 255;
+  }
+  *op++ = (uint8_t)n;
+  return op;
+}
+
+/* Writes the literals, then the match if match_len is not zero */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *literals,
+                             size_t lit_len, size_t offset, size_t match_len) {
+  size_t m = match_len == 0 ? 0 : match_len - MIN_MATCH;
+  *op++ = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15));
+  if (lit_len >= 15) {
+    op = put_length(op, lit_len - 15);
+  }
+  memcpy(op, literals, lit_len);
+  op += lit_len;
+
+  if (match_len != 0) {
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    if (m >= 15) {
+      op = put_length(op, m - 15);
+    }
+  }
+  return op;
+}
+
+size_t lz_bound(size_t len) { return len + len / 255 + 16; }
+
+size_t lz_compress(uint8_t *dst, const uint8_t *src, size_t len) {
+  uint32_t table[1 << HASH_BITS]; /* Last position + 1 of each hash */
+  memset(table, 0, sizeof(table));
+
+  uint8_t *op = dst;
+  size_t anchor = 0;
+  size_t ip = 0;
+
+  while (ip + MIN_MATCH <= len) {
+    uint32_t seq = load32(src + ip);
+    uint32_t h = lz_hash(seq);
+    size_t ref = table[h];
+    table[h] = (uint32_t)ip + 1;
+
+    if (ref == 0 || ip - (ref - 1) >= LZ_FRAME ||
+        load32(src + ref - 1) != seq) {
+      ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+      continue;
+    }
+
+    ref--;
+    size_t match_len = MIN_MATCH;
+    while (ip + match_len < len && src[ref + match_len] == src[ip + match_len]) {
+      match_len++;
+    }
+
+    op = put_sequence(op, src + anchor, ip - anchor, ip - ref, match_len);
+    ip += match_len;
+    anchor = ip;
+
+    /* Lets later data match the end of this one */
+    if (ip >= 2 && ip + 2 <= len) {
+      table[lz_hash(load32(src + ip - 2))] = (uint32_t)(ip - 2) + 1;
+    }
+  }
+
+  return (size_t)(put_sequence(op, src + anchor, len - anchor, 0, 0) - dst);
+}
+
+/* Reads the part of a length that did not fit in its token nibble */
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *n) {
+  uint8_t byte;
+  do {
+    if (*ip == end) {
+      return 0;
+    }
+    byte = *(*ip)++;
+    *n += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+size_t lz_decompress(uint8_t *dst, size_t cap, const uint8_t *src,
+                     size_t len) {
+  const uint8_t *ip = src;
+  const uint8_t *end = src + len;
+  size_t op = 0;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && !get_length(&ip, end, &lit_len)) {
+      return SIZE_MAX;
+    }
+    if (lit_len > (size_t)(end - ip) || lit_len > cap - op) {
+      return SIZE_MAX;
+    }
+    memcpy(dst + op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return SIZE_MAX;
+    }
+    size_t offset = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && !get_length(&ip, end, &match_len)) {
+      return SIZE_MAX;
+    }
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > op || match_len > cap - op) {
+      return SIZE_MAX;
+    }
+
+    /* Overlapping copies repeat the last offset bytes, so they go one
+    byte at a time */
+    const uint8_t *from = dst + op - offset;
+    if (offset >= match_len) {
+      memcpy(dst + op, from, match_len);
+    } else {
+      for (size_t i = 0; i < match_len; i++) {
+        dst[op + i] = from[i];
+      }
+    }
+    op += match_len;
+  }
+  return op;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Largest block of input compressed at once. Match offsets are stored in
+// two bytes, so a block never refers back more than LZ_FRAME - 1 bytes.
+//
+#define LZ_FRAME (1 << 16)
+
+//
+// A fast byte-oriented LZ77 codec in the style of LZ4: each sequence is a
+// token byte holding the literal and match lengths, the literals, and a
+// two-byte offset back to the match. The last sequence of a block has
+// literals only.
+//
+
+//
+// Returns the largest size lz_compress() can produce for len bytes.
+//
+size_t lz_bound(size_t len);
+
+//
+// Compresses a block of at most LZ_FRAME bytes.
+//
+// dst: where to write, with room for lz_bound(len) bytes.
+// src: the bytes to compress.
+// len: the number of bytes, at most LZ_FRAME.
+// returns: the compressed size.
+//
+size_t lz_compress(uint8_t *dst, const uint8_t *src, size_t len);
+
+//
+// Decompresses a block made by lz_compress().
+//
+// dst: where to write the decompressed bytes.
+// cap: the room in dst.
+// src: the compressed block.
+// len: the compressed size.
+// returns: the decompressed size, or SIZE_MAX if the block is corrupt or
+// would not fit in cap bytes.
+//
+size_t lz_decompress(uint8_t *dst, size_t cap, const uint8_t *src,
+                     size_t len);
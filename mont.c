@@ -0,0 +1,415 @@
+#include "mont.h"
+#include "numtheory.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define L MONT_LANES
+#define DIGIT_BITS 28
+#define DIGIT_MASK ((1u << DIGIT_BITS) - 1)
+#define NORM_STEPS 64
+#define WINDOW_BITS 4
+#define TABLE_SIZE (1 << WINDOW_BITS)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define FROM_BIG_ENDIAN(x) (x)
+#else
+#define FROM_BIG_ENDIAN(x) __builtin_bswap64(x)
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MONT_X86 1
+#include <immintrin.h>
+
+/* AVX2 kernel: each digit position is two 4-lane vectors */
+#define MK_FN(name) name##_avx2
+#define MK_TARGET __attribute__((target("avx2")))
+#define MK_VEC __m256i
+#define MK_WIDTH 4
+#define MK_ZERO _mm256_setzero_si256()
+#define MK_SET1(x) _mm256_set1_epi64x((long long)(x))
+#define MK_ADD _mm256_add_epi64
+#define MK_SUB _mm256_sub_epi64
+#define MK_AND _mm256_and_si256
+#define MK_XOR _mm256_xor_si256
+#define MK_SRL _mm256_srli_epi64
+#define MK_MUL32 _mm256_mul_epu32
+#include "mont_kernel.h"
+#undef MK_FN
+#undef MK_TARGET
+#undef MK_VEC
+#undef MK_WIDTH
+#undef MK_ZERO
+#undef MK_SET1
+#undef MK_ADD
+#undef MK_SUB
+#undef MK_AND
+#undef MK_XOR
+#undef MK_SRL
+#undef MK_MUL32
+
+/* AVX-512 kernel: each digit position is one 8-lane vector */
+#define MK_FN(name) name##_avx512
+#define MK_TARGET __attribute__((target("avx512f")))
+#define MK_VEC __m512i
+#define MK_WIDTH 8
+#define MK_ZERO _mm512_setzero_si512()
+#define MK_SET1(x) _mm512_set1_epi64((long long)(x))
+#define MK_ADD _mm512_add_epi64
+#define MK_SUB _mm512_sub_epi64
+#define MK_AND _mm512_and_si512
+#define MK_XOR _mm512_xor_si512
+#define MK_SRL _mm512_srli_epi64
+#define MK_MUL32 _mm512_mul_epu32
+#include "mont_kernel.h"
+#undef MK_FN
+#undef MK_TARGET
+#undef MK_VEC
+#undef MK_WIDTH
+#undef MK_ZERO
+#undef MK_SET1
+#undef MK_ADD
+#undef MK_SUB
+#undef MK_AND
+#undef MK_XOR
+#undef MK_SRL
+#undef MK_MUL32
+#endif
+
+typedef void (*mont_kernel_fn)(const MontCtx *ctx, uint64_t *x);
+
+/* Picks the widest kernel the CPU supports. Returns NULL when there is no
+vector unit, in which case blocks go through pow_mod() one at a time. */
+static mont_kernel_fn mont_select(const char **isa) {
+#ifdef MONT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    *isa = "avx512f";
+    return mont_exp_lanes_avx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    *isa = "avx2";
+    return mont_exp_lanes_avx2;
+  }
+#endif
+  *isa = "scalar";
+  return NULL;
+}
+
+/* Allocates count zeroed vectors aligned for the kernel */
+static uint64_t *mont_alloc(size_t count) {
+  size_t bytes = count * L * sizeof(uint64_t);
+  uint64_t *p = (uint64_t *)aligned_alloc(64, bytes);
+  memset(p, 0, bytes);
+  return p;
+}
+
+/* Returns the digit of v starting at bit */
+static uint64_t mont_digit(mpz_t v, uint64_t bit) {
+  uint64_t shift = bit % GMP_NUMB_BITS;
+  uint64_t value = mpz_getlimbn(v, bit / GMP_NUMB_BITS) >> shift;
+  if (shift + DIGIT_BITS > GMP_NUMB_BITS) {
+    value |= (uint64_t)mpz_getlimbn(v, bit / GMP_NUMB_BITS + 1)
+             << (GMP_NUMB_BITS - shift);
+  }
+  return value & DIGIT_MASK;
+}
+
+/* Copies the low DIGIT_BITS * s bits of v into one lane of an SoA array */
+static void mont_load(uint64_t *dst, uint32_t s, size_t lane, mpz_t v) {
+  for (uint32_t i = 0; i < s; i++) {
+    dst[i * L + lane] = mont_digit(v, (uint64_t)i * DIGIT_BITS);
+  }
+}
+
+/* Rebuilds v from one lane of an SoA array */
+static void mont_store(mpz_t v, const uint64_t *src, uint32_t s, size_t lane) {
+  size_t size = ((size_t)s * DIGIT_BITS + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+  mp_limb_t *limbs = mpz_limbs_write(v, size);
+  memset(limbs, 0, size * sizeof(mp_limb_t));
+  for (uint32_t i = 0; i < s; i++) {
+    uint64_t bit = (uint64_t)i * DIGIT_BITS;
+    uint64_t shift = bit % GMP_NUMB_BITS;
+    limbs[bit / GMP_NUMB_BITS] |= (mp_limb_t)src[i * L + lane] << shift;
+    if (shift + DIGIT_BITS > GMP_NUMB_BITS) {
+      limbs[bit / GMP_NUMB_BITS + 1] |=
+          (mp_limb_t)src[i * L + lane] >> (GMP_NUMB_BITS - shift);
+    }
+  }
+  mpz_limbs_finish(v, size);
+}
+
+/* Copies a big-endian byte string into one lane of an SoA array. Seven
+bytes make two digits, so they are fetched with one unaligned load and a
+byte swap; the last few bytes are gathered one at a time. */
+static void mont_load_bytes(uint64_t *dst, uint32_t s, size_t lane,
+                            const uint8_t *bytes, size_t len) {
+  const uint8_t *end = bytes + len;
+  uint32_t i = 0;
+  while (i + 1 < s && end - bytes >= 8) {
+    uint64_t word;
+    memcpy(&word, end - 8, 8);
+    word = FROM_BIG_ENDIAN(word);
+    dst[i * L + lane] = word & DIGIT_MASK;
+    dst[(i + 1) * L + lane] = (word >> DIGIT_BITS) & DIGIT_MASK;
+    end -= 7;
+    i += 2;
+  }
+
+  uint64_t rest = 0;
+  for (const uint8_t *p = bytes; p < end; p++) {
+    rest = (rest << 8) | *p;
+  }
+  for (; i < s; i++) {
+    dst[i * L + lane] = rest & DIGIT_MASK;
+    rest >>= DIGIT_BITS;
+  }
+}
+
+/* Writes one lane of an SoA array as len big-endian bytes, the reverse of
+mont_load_bytes(). Each store of a digit pair also writes a zero into the
+byte below it, which the next pair overwrites. */
+static void mont_store_bytes(uint8_t *bytes, size_t len, const uint64_t *src,
+                             uint32_t s, size_t lane) {
+  uint8_t *end = bytes + len;
+  uint32_t i = 0;
+  while (i + 1 < s && end - bytes >= 8) {
+    uint64_t word = src[i * L + lane] | src[(i + 1) * L + lane] << DIGIT_BITS;
+    word = FROM_BIG_ENDIAN(word);
+    memcpy(end - 8, &word, 8);
+    end -= 7;
+    i += 2;
+  }
+
+  uint64_t rest = 0;
+  uint32_t bits = 0;
+  while (end > bytes) {
+    if (bits < 8 && i < s) {
+      rest |= src[i * L + lane] << bits;
+      bits += DIGIT_BITS;
+      i++;
+    }
+    *--end = (uint8_t)rest;
+    rest >>= 8;
+    bits = bits > 8 ? bits - 8 : 0;
+  }
+}
+
+/* Returns the number of bytes needed for one lane of an SoA array */
+static size_t mont_byte_length(const uint64_t *src, uint32_t s, size_t lane) {
+  for (uint32_t i = s; i-- > 0;) {
+    uint64_t digit = src[i * L + lane];
+    if (digit != 0) {
+      size_t bits = (size_t)i * DIGIT_BITS + 64 - __builtin_clzll(digit);
+      return (bits + 7) / 8;
+    }
+  }
+  return 0;
+}
+
+/* Sets v to a big-endian byte string, filling its limbs directly */
+static void mpz_set_bytes(mpz_t v, const uint8_t *bytes, size_t len) {
+#if GMP_NUMB_BITS == 64 && GMP_NAIL_BITS == 0
+  size_t size = (len + 7) / 8;
+  if (size == 0) {
+    mpz_set_ui(v, 0);
+    return;
+  }
+
+  mp_limb_t *limbs = mpz_limbs_write(v, size);
+  const uint8_t *end = bytes + len;
+  for (size_t i = 0; i + 1 < size; i++) {
+    uint64_t word;
+    end -= 8;
+    memcpy(&word, end, 8);
+    limbs[i] = FROM_BIG_ENDIAN(word);
+  }
+  mp_limb_t top = 0;
+  for (const uint8_t *p = bytes; p < end; p++) {
+    top = (top << 8) | *p;
+  }
+  limbs[size - 1] = top;
+  mpz_limbs_finish(v, size);
+#else
+  mpz_import(v, len, 1, sizeof(uint8_t), 1, 0, bytes);
+#endif
+}
+
+/* Writes the low len bytes of v big-endian, padded with leading zeros.
+Returns the number of bytes v needs. */
+static size_t mpz_get_bytes(uint8_t *bytes, size_t len, mpz_t v) {
+  size_t needed = mpz_sgn(v) == 0 ? 0 : (mpz_sizeinbase(v, 2) + 7) / 8;
+#if GMP_NUMB_BITS == 64 && GMP_NAIL_BITS == 0
+  const mp_limb_t *limbs = mpz_limbs_read(v);
+  size_t size = mpz_size(v);
+  uint8_t *end = bytes + len;
+  size_t i = 0;
+  for (; i < size && end - bytes >= 8; i++) {
+    uint64_t word = FROM_BIG_ENDIAN((uint64_t)limbs[i]);
+    end -= 8;
+    memcpy(end, &word, 8);
+  }
+  mp_limb_t rest = i < size ? limbs[i] : 0;
+  while (end > bytes) {
+    *--end = (uint8_t)rest;
+    rest >>= 8;
+  }
+#else
+  memset(bytes, 0, len);
+  if (needed <= len) {
+    mpz_export(bytes + len - needed, NULL, 1, sizeof(uint8_t), 1, 0, v);
+  }
+#endif
+  return needed;
+}
+
+/* Initializes the Montgomery context for the modulus n and exponent e */
+void mont_init(MontCtx *ctx, mpz_t n, mpz_t e) {
+  memset(ctx, 0, sizeof(*ctx));
+  mpz_init_set(ctx->modulus, n);
+  mpz_init_set(ctx->exponent, e);
+  mpz_init(ctx->reduced);
+  for (int l = 0; l < L; l++) {
+    mpz_init(ctx->values[l]);
+  }
+
+  const char *isa;
+  ctx->kernel = mont_select(&isa);
+  ctx->usable = mpz_odd_p(n) != 0 && mpz_cmp_ui(n, 1) > 0 &&
+                ctx->kernel != NULL;
+  if (!ctx->usable) {
+    return;
+  }
+
+  uint32_t s = (uint32_t)((mpz_sizeinbase(n, 2) + DIGIT_BITS - 1) / DIGIT_BITS);
+  ctx->nlimbs = s;
+  ctx->n = (uint64_t *)calloc(s, sizeof(uint64_t));
+  ctx->r2 = mont_alloc(s);
+  ctx->one = mont_alloc(s);
+  ctx->scratch = mont_alloc((TABLE_SIZE + 2) * s + s + 1);
+  ctx->lanes = mont_alloc(s);
+
+  for (uint32_t i = 0; i < s; i++) {
+    ctx->n[i] = mont_digit(n, (uint64_t)i * DIGIT_BITS);
+  }
+
+  /* Newton iteration for n^-1 mod 2^32, each step doubles the bits */
+  uint32_t n0 = (uint32_t)ctx->n[0];
+  uint32_t inv = n0;
+  for (int i = 0; i < 5; i++) {
+    inv *= 2 - n0 * inv;
+  }
+  ctx->n0inv = (0 - inv) & DIGIT_MASK;
+
+  mpz_t r2;
+  mpz_init_set_ui(r2, 0);
+  mpz_setbit(r2, 2 * DIGIT_BITS * (mp_bitcnt_t)s);
+  mpz_mod(r2, r2, n);
+  for (int l = 0; l < L; l++) {
+    mont_load(ctx->r2, s, l, r2);
+    ctx->one[l] = 1;
+  }
+  mpz_clear(r2);
+
+  size_t ebits = mpz_sizeinbase(e, 2);
+  ctx->nwindows = mpz_sgn(e) == 0 ? 0 : (ebits + WINDOW_BITS - 1) / WINDOW_BITS;
+  ctx->window = (uint8_t *)calloc(ctx->nwindows + 1, sizeof(uint8_t));
+  for (size_t w = 0; w < ctx->nwindows; w++) {
+    size_t low = (ctx->nwindows - 1 - w) * WINDOW_BITS;
+    uint8_t value = 0;
+    for (int b = WINDOW_BITS - 1; b >= 0; b--) {
+      value = (uint8_t)((value << 1) | mpz_tstbit(e, low + b));
+    }
+    ctx->window[w] = value;
+  }
+}
+
+/* Frees memory used by the Montgomery context */
+void mont_clear(MontCtx *ctx) {
+  free(ctx->n);
+  free(ctx->r2);
+  free(ctx->one);
+  free(ctx->window);
+  free(ctx->scratch);
+  free(ctx->lanes);
+  for (int l = 0; l < L; l++) {
+    mpz_clear(ctx->values[l]);
+  }
+  mpz_clears(ctx->reduced, ctx->modulus, ctx->exponent, NULL);
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+/* Loads a big-endian block into one lane */
+void mont_set_bytes(MontCtx *ctx, size_t lane, const uint8_t *bytes,
+                    size_t len) {
+  if (!ctx->usable) {
+    mpz_set_bytes(ctx->values[lane], bytes, len);
+    return;
+  }
+  mont_load_bytes(ctx->lanes, ctx->nlimbs, lane, bytes, len);
+}
+
+/* Loads an mpz_t block into one lane */
+void mont_set_mpz(MontCtx *ctx, size_t lane, mpz_t v) {
+  if (!ctx->usable) {
+    mpz_set(ctx->values[lane], v);
+    return;
+  }
+  if (mpz_cmp(v, ctx->modulus) >= 0) {
+    mpz_mod(ctx->reduced, v, ctx->modulus);
+    mont_load(ctx->lanes, ctx->nlimbs, lane, ctx->reduced);
+  } else {
+    mont_load(ctx->lanes, ctx->nlimbs, lane, v);
+  }
+}
+
+/* Exponentiates the loaded lanes in lockstep */
+void mont_run(MontCtx *ctx, size_t count) {
+  if (!ctx->usable) {
+    for (size_t l = 0; l < count; l++) {
+      pow_mod(ctx->reduced, ctx->values[l], ctx->exponent, ctx->modulus);
+      mpz_swap(ctx->values[l], ctx->reduced);
+    }
+    return;
+  }
+
+  ctx->kernel(ctx, ctx->lanes);
+}
+
+/* Writes one lane as a fixed-width big-endian block */
+size_t mont_get_bytes(MontCtx *ctx, size_t lane, uint8_t *bytes, size_t len) {
+  if (!ctx->usable) {
+    return mpz_get_bytes(bytes, len, ctx->values[lane]);
+  }
+  mont_store_bytes(bytes, len, ctx->lanes, ctx->nlimbs, lane);
+  return mont_byte_length(ctx->lanes, ctx->nlimbs, lane);
+}
+
+/* Copies one lane into v */
+void mont_get_mpz(MontCtx *ctx, size_t lane, mpz_t v) {
+  if (!ctx->usable) {
+    mpz_set(v, ctx->values[lane]);
+    return;
+  }
+  mont_store(v, ctx->lanes, ctx->nlimbs, lane);
+}
+
+/* Exponentiates up to MONT_LANES blocks in lockstep */
+void mont_powm_batch(MontCtx *ctx, mpz_t out[], mpz_t in[], size_t count) {
+  for (size_t l = 0; l < count; l++) {
+    mont_set_mpz(ctx, l, in[l]);
+  }
+  mont_run(ctx, count);
+  for (size_t l = 0; l < count; l++) {
+    mont_get_mpz(ctx, l, out[l]);
+  }
+}
+
+/* Names the kernel selected for this CPU */
+const char *mont_isa(void) {
+  const char *isa;
+  mont_select(&isa);
+  return isa;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <gmp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Number of blocks exponentiated in lockstep by mont_powm_batch().
+//
+#define MONT_LANES 8
+
+//
+// Precomputed state for multi-buffer Montgomery exponentiation.
+// Every lane shares the same modulus and exponent, so the square and
+// multiply schedule is identical across lanes and the limbs of all lanes
+// are stored interleaved (structure of arrays): 28-bit digit i of lane l
+// lives in the 64-bit slot i * MONT_LANES + l.
+//
+typedef struct MontCtx {
+  uint32_t nlimbs;   /* Number of 28-bit digits in the modulus */
+  uint64_t n0inv;    /* -n^-1 mod 2^28 */
+  uint64_t *n;       /* Modulus digits, least significant first */
+  uint64_t *r2;      /* R^2 mod n in SoA form, R = 2^(28 * nlimbs) */
+  uint64_t *one;     /* The integer 1 in SoA form */
+  uint8_t *window;   /* Exponent split into 4-bit windows, most significant
+                        first */
+  size_t nwindows;   /* Number of entries in window */
+  uint64_t *scratch; /* Working space for the exponentiation */
+  uint64_t *lanes;   /* The blocks being exponentiated in SoA form */
+  mpz_t reduced;     /* Holds a block reduced modulo n */
+  mpz_t values[MONT_LANES]; /* The blocks being exponentiated when the
+                               pow_mod() fallback is in use */
+  mpz_t modulus;     /* Copy of n for the pow_mod() fallback */
+  mpz_t exponent;    /* Copy of the exponent for the fallback */
+  int usable;        /* 0 if n is even or the CPU has no vector unit, in
+                        which case pow_mod() is used for every block */
+  void (*kernel)(const struct MontCtx *ctx, uint64_t *x); /* The widest
+                        kernel the CPU supports, picked by mont_init() */
+} MontCtx;
+
+//
+// Initializes a Montgomery context for exponentiating by e modulo n.
+// All mpz_t arguments are expected to be initialized.
+//
+// ctx: the context to initialize.
+// n: the modulus shared by every block.
+// e: the exponent shared by every block.
+//
+void mont_init(MontCtx *ctx, mpz_t n, mpz_t e);
+
+//
+// Frees any memory used by a Montgomery context.
+//
+void mont_clear(MontCtx *ctx);
+
+//
+// Computes out[i] = (in[i]^e)mod(n) for up to MONT_LANES blocks at once.
+// Every in[i] must be less than n.
+// All mpz_t arguments are expected to be initialized.
+//
+// ctx: the context holding n and e.
+// out: will store the results.
+// in: the blocks to exponentiate.
+// count: the number of blocks, at most MONT_LANES.
+//
+void mont_powm_batch(MontCtx *ctx, mpz_t out[], mpz_t in[], size_t count);
+
+//
+// The calls below exponentiate a batch without going through
+// mont_powm_batch(): blocks are loaded into lanes 0 to count - 1 with
+// mont_set_bytes() or mont_set_mpz(), mont_run() exponentiates them in
+// place and mont_get_bytes() or mont_get_mpz() read the results back.
+// Byte strings are converted straight to and from the kernel's digits,
+// so a file block never passes through an mpz_t.
+//
+
+//
+// Loads a big-endian byte string into one lane.
+// The value must be less than n.
+//
+// ctx: the context holding n and e.
+// lane: the lane to load, less than MONT_LANES.
+// bytes: the value, most significant byte first.
+// len: the number of bytes.
+//
+void mont_set_bytes(MontCtx *ctx, size_t lane, const uint8_t *bytes,
+                    size_t len);
+
+//
+// Loads an mpz_t into one lane, reducing it modulo n first if needed.
+//
+// ctx: the context holding n and e.
+// lane: the lane to load, less than MONT_LANES.
+// v: the value to load.
+//
+void mont_set_mpz(MontCtx *ctx, size_t lane, mpz_t v);
+
+//
+// Replaces the values in lanes 0 to count - 1 with (value^e)mod(n).
+//
+// ctx: the context holding the lanes.
+// count: the number of lanes in use, at most MONT_LANES.
+//
+void mont_run(MontCtx *ctx, size_t count);
+
+//
+// Writes the value in one lane as a big-endian byte string of exactly len
+// bytes, padded with leading zeros.
+//
+// ctx: the context holding the lanes.
+// lane: the lane to read.
+// bytes: where to write the len bytes.
+// len: the width of the output.
+// returns: the number of bytes the value needs without leading zeros.
+// If this is more than len only the low len bytes were written.
+//
+size_t mont_get_bytes(MontCtx *ctx, size_t lane, uint8_t *bytes, size_t len);
+
+//
+// Copies the value in one lane into an initialized mpz_t.
+//
+// ctx: the context holding the lanes.
+// lane: the lane to read.
+// v: will store the value.
+//
+void mont_get_mpz(MontCtx *ctx, size_t lane, mpz_t v);
+
+//
+// Returns the name of the instruction set selected at run time for the
+// exponentiation kernel.
+//
+const char *mont_isa(void);
@@ -0,0 +1,123 @@
+/* Lane kernel template for mont.c. It is included once per instruction set
+after defining:
+  MK_FN(name)  : appends the instruction set suffix to name
+  MK_TARGET    : the target attribute for the functions, or nothing
+  MK_VEC       : a vector of 64-bit elements
+  MK_WIDTH     : the number of lanes in MK_VEC
+  MK_ZERO, MK_SET1(x), MK_ADD, MK_SUB, MK_AND, MK_XOR, MK_SRL(v, bits),
+  MK_MUL32     : element-wise operations; MK_MUL32 multiplies the low 32
+                 bits of each element into a 64-bit product.
+Digit j of the MONT_LANES lanes is stored as MONT_LANES / MK_WIDTH vectors,
+so the kernel walks the lanes in MK_STRIDE independent groups. */
+
+#define MK_STRIDE (MONT_LANES / MK_WIDTH)
+
+/* Calculates r = (a * b * R^-1)mod(n) for one group of lanes. Each outer
+step adds a * b[i] + m * n without propagating carries, which removes the
+serial dependency between digit positions; carries are resolved every
+NORM_STEPS steps and at the end. t must hold s + 1 vectors. */
+static inline __attribute__((always_inline)) MK_TARGET void
+MK_FN(mont_mul)(MK_VEC *r, const MK_VEC *a, const MK_VEC *b,
+                const uint64_t *restrict n, uint64_t n0inv, uint32_t s,
+                MK_VEC *restrict t) {
+  const MK_VEC mask = MK_SET1(DIGIT_MASK);
+  const MK_VEC inv = MK_SET1(n0inv);
+  MK_VEC carry;
+  MK_VEC x;
+
+  for (uint32_t j = 0; j <= s; j++) {
+    t[j] = MK_ZERO;
+  }
+
+  for (uint32_t i = 0; i < s; i++) {
+    MK_VEC bi = b[i * MK_STRIDE];
+    x = MK_ADD(t[0], MK_MUL32(a[0], bi));
+    MK_VEC m = MK_AND(MK_MUL32(x, inv), mask);
+    carry = MK_SRL(MK_ADD(x, MK_MUL32(m, MK_SET1(n[0]))), DIGIT_BITS);
+    for (uint32_t j = 1; j < s; j++) {
+      x = MK_ADD(MK_MUL32(a[j * MK_STRIDE], bi), MK_MUL32(m, MK_SET1(n[j])));
+      t[j - 1] = MK_ADD(t[j], x);
+    }
+    t[0] = MK_ADD(t[0], carry);
+    t[s - 1] = t[s];
+    t[s] = MK_ZERO;
+
+    if ((i + 1) % NORM_STEPS == 0) {
+      carry = MK_ZERO;
+      for (uint32_t j = 0; j < s; j++) {
+        x = MK_ADD(t[j], carry);
+        t[j] = MK_AND(x, mask);
+        carry = MK_SRL(x, DIGIT_BITS);
+      }
+      t[s] = carry;
+    }
+  }
+
+  carry = MK_ZERO;
+  for (uint32_t j = 0; j < s; j++) {
+    x = MK_ADD(t[j], carry);
+    t[j] = MK_AND(x, mask);
+    carry = MK_SRL(x, DIGIT_BITS);
+  }
+  t[s] = MK_ADD(t[s], carry);
+
+  /* Subtracts n once if t >= n. The borrow out of the subtraction and the
+  top digit of t form a 0/1 flag that is turned into a selection mask, so
+  there is no branch on the lane contents. */
+  carry = MK_ZERO;
+  for (uint32_t j = 0; j < s; j++) {
+    x = MK_SUB(MK_SUB(t[j], MK_SET1(n[j])), carry);
+    r[j * MK_STRIDE] = MK_AND(x, mask);
+    carry = MK_SRL(x, 63);
+  }
+  MK_VEC keep = MK_SUB(MK_ZERO, MK_AND(carry, MK_XOR(t[s], MK_SET1(1))));
+  for (uint32_t j = 0; j < s; j++) {
+    MK_VEC d = r[j * MK_STRIDE];
+    r[j * MK_STRIDE] = MK_XOR(d, MK_AND(MK_XOR(t[j], d), keep));
+  }
+}
+
+/* Runs the fixed-window exponentiation on every lane of x in place */
+static MK_TARGET void MK_FN(mont_exp_lanes)(const MontCtx *ctx, uint64_t *x) {
+  uint32_t s = ctx->nlimbs;
+  size_t row = (size_t)s * MK_STRIDE; /* Vectors in one number of a group */
+
+  for (size_t g = 0; g < MK_STRIDE; g++) {
+    MK_VEC *xs = (MK_VEC *)x + g;
+    MK_VEC *r2 = (MK_VEC *)ctx->r2 + g;
+    MK_VEC *one = (MK_VEC *)ctx->one + g;
+    MK_VEC *table = (MK_VEC *)ctx->scratch + g;
+    MK_VEC *acc = table + TABLE_SIZE * row;
+    MK_VEC *tmp = acc + row;
+    MK_VEC *t = (MK_VEC *)ctx->scratch + (TABLE_SIZE + 2) * row;
+
+    /* table[0] = R mod n and table[1] = x * R mod n */
+    MK_FN(mont_mul)(table, r2, one, ctx->n, ctx->n0inv, s, t);
+    MK_FN(mont_mul)(table + row, xs, r2, ctx->n, ctx->n0inv, s, t);
+    for (int k = 2; k < TABLE_SIZE; k++) {
+      MK_FN(mont_mul)(table + k * row, table + (k - 1) * row, table + row,
+                      ctx->n, ctx->n0inv, s, t);
+    }
+
+    for (uint32_t j = 0; j < s; j++) {
+      acc[j * MK_STRIDE] = table[j * MK_STRIDE];
+    }
+    for (size_t w = 0; w < ctx->nwindows; w++) {
+      MK_VEC *swap;
+      if (w > 0) {
+        for (int b = 0; b < WINDOW_BITS; b++) {
+          MK_FN(mont_mul)(tmp, acc, acc, ctx->n, ctx->n0inv, s, t);
+          swap = acc, acc = tmp, tmp = swap;
+        }
+      }
+      MK_FN(mont_mul)(tmp, acc, table + ctx->window[w] * row, ctx->n,
+                      ctx->n0inv, s, t);
+      swap = acc, acc = tmp, tmp = swap;
+    }
+
+    /* Leaves Montgomery form */
+    MK_FN(mont_mul)(xs, acc, one, ctx->n, ctx->n0inv, s, t);
+  }
+}
+
+#undef MK_STRIDE
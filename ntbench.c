@@ -0,0 +1,218 @@
+#include "numtheory.h"
+#include "randstate.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "b:c:s:h"
+#define MAX_SIZES 16
+#define PRIME_ITERS 20
+
+enum { OP_GCD, OP_MOD_INVERSE, OP_POW_MOD, OP_IS_PRIME, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = {"gcd", "mod_inverse", "pow_mod",
+                                        "is_prime"};
+
+/* Random operands shared by every backend for one key size */
+typedef struct {
+  size_t count;
+  mpz_t *a;     /* Random values below n */
+  mpz_t *b;     /* Random values below n */
+  mpz_t *d;     /* Random exponents as wide as n */
+  mpz_t *n;     /* Random odd moduli with the top bit set */
+  mpz_t *prime; /* Half primes and half odd composites */
+} Operands;
+
+static void usage(char *program) {
+  fprintf(stderr, "Usage: %s [options]\n", program);
+  fprintf(stderr, "  %s runs gcd, mod_inverse, pow_mod and is_prime under "
+                  "every arithmetic\n",
+          program);
+  fprintf(stderr, "  backend on the same random inputs, checks that the "
+                  "results agree, and\n");
+  fprintf(stderr, "  reports the time per call relative to the textbook "
+                  "backend.\n");
+  fprintf(stderr, "    -b <bits>   : Test <bits>-bit operands; may be "
+                  "repeated. Default: 512, 1024, 2048\n");
+  fprintf(stderr, "    -c <count>  : Make <count> calls per primitive. "
+                  "Default: 20\n");
+  fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
+                  "Default: 1\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+static mpz_t *mpz_array(size_t count) {
+  mpz_t *values = (mpz_t *)malloc(count * sizeof(mpz_t));
+  for (size_t i = 0; i < count; i++) {
+    mpz_init(values[i]);
+  }
+  return values;
+}
+
+static void mpz_array_clear(mpz_t *values, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    mpz_clear(values[i]);
+  }
+  free(values);
+}
+
+static void operands_init(Operands *ops, uint64_t bits, size_t count) {
+  ops->count = count;
+  ops->a = mpz_array(count);
+  ops->b = mpz_array(count);
+  ops->d = mpz_array(count);
+  ops->n = mpz_array(count);
+  ops->prime = mpz_array(count);
+
+  for (size_t i = 0; i < count; i++) {
+    randstate_urandomb(ops->n[i], bits);
+    mpz_setbit(ops->n[i], bits - 1);
+    mpz_setbit(ops->n[i], 0);
+    randstate_urandomm(ops->a[i], ops->n[i]);
+    randstate_urandomm(ops->b[i], ops->n[i]);
+    randstate_urandomb(ops->d[i], bits);
+
+    /* Primes come from GMP so making them does not favour a backend */
+    randstate_urandomb(ops->prime[i], bits);
+    mpz_setbit(ops->prime[i], bits - 1);
+    mpz_nextprime(ops->prime[i], ops->prime[i]);
+    if (i % 2 == 1) {
+      mpz_mul(ops->prime[i], ops->prime[i], ops->prime[i - 1]);
+    }
+  }
+}
+
+static void operands_clear(Operands *ops) {
+  mpz_array_clear(ops->a, ops->count);
+  mpz_array_clear(ops->b, ops->count);
+  mpz_array_clear(ops->d, ops->count);
+  mpz_array_clear(ops->n, ops->count);
+  mpz_array_clear(ops->prime, ops->count);
+}
+
+/* Runs one primitive of a backend over every operand, storing results in
+out, and returns the seconds taken */
+static double run_op(const NumBackend *b, int op, Operands *ops, mpz_t *out) {
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (size_t i = 0; i < ops->count; i++) {
+    switch (op) {
+    case OP_GCD:
+      b->gcd(out[i], ops->a[i], ops->b[i]);
+      break;
+    case OP_MOD_INVERSE:
+      b->mod_inverse(out[i], ops->a[i], ops->n[i]);
+      break;
+    case OP_POW_MOD:
+      b->pow_mod(out[i], ops->a[i], ops->d[i], ops->n[i]);
+      break;
+    default:
+      mpz_set_ui(out[i], b->is_prime(ops->prime[i], PRIME_ITERS));
+      break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+  int opt = 0;
+  uint64_t sizes[MAX_SIZES];
+  size_t nsizes = 0;
+  long count = 20;
+  uint64_t seed = 1;
+
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 'b':
+      if (atoi(optarg) < 16 || atoi(optarg) > 8192) {
+        fprintf(stderr, "Number of bits must be 16-8192, not %d.\n",
+                atoi(optarg));
+        usage(argv[0]);
+        return 1;
+      }
+      if (nsizes < MAX_SIZES) {
+        sizes[nsizes++] = atoi(optarg);
+      }
+      break;
+    case 'c':
+      count = atol(optarg);
+      if (count < 2) {
+        fprintf(stderr, "Number of calls must be at least 2, not %s.\n",
+                optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (nsizes == 0) {
+    sizes[nsizes++] = 512;
+    sizes[nsizes++] = 1024;
+    sizes[nsizes++] = 2048;
+  }
+
+  randstate_init(seed);
+
+  const NumBackend *reference = numtheory_backend_at(0);
+  mpz_t *expected = mpz_array(count);
+  mpz_t *got = mpz_array(count);
+  size_t mismatches = 0;
+
+  printf("%6s %-12s %-10s %12s %9s %11s\n", "bits", "primitive", "backend",
+         "us/call", "speedup", "mismatches");
+
+  for (size_t s = 0; s < nsizes; s++) {
+    Operands ops;
+    operands_init(&ops, sizes[s], count);
+
+    for (int op = 0; op < NUM_OPS; op++) {
+      double base = run_op(reference, op, &ops, expected);
+      printf("%6lu %-12s %-10s %12.1f %8.2fx %11d\n", (unsigned long)sizes[s],
+             op_names[op], reference->name, base * 1e6 / count, 1.0, 0);
+
+      const NumBackend *b;
+      for (size_t i = 1; (b = numtheory_backend_at(i)) != NULL; i++) {
+        double seconds = run_op(b, op, &ops, got);
+        size_t wrong = 0;
+        for (long j = 0; j < count; j++) {
+          wrong += mpz_cmp(expected[j], got[j]) != 0;
+        }
+        mismatches += wrong;
+        printf("%6lu %-12s %-10s %12.1f %8.2fx %11zu\n",
+               (unsigned long)sizes[s], op_names[op], b->name,
+               seconds * 1e6 / count, seconds > 0 ? base / seconds : 0.0,
+               wrong);
+      }
+    }
+    operands_clear(&ops);
+  }
+
+  mpz_array_clear(expected, count);
+  mpz_array_clear(got, count);
+  randstate_clear();
+
+  if (mismatches > 0) {
+    fprintf(stderr, "ntbench: %zu results differ between backends\n",
+            mismatches);
+    return 1;
+  }
+  return 0;
+}
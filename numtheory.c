@@ -1,13 +1,44 @@
 #include "numtheory.h"
+#include "profile.h"
 #include "randstate.h"
 #include <gmp.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Names the backend used for every primitive unless RSA_BACKEND says
+otherwise; set with make BACKEND=<name> */
+#ifndef NUMTHEORY_BACKEND
+#define NUMTHEORY_BACKEND "lehmer"
+#endif
+
+/* Odd primes below SIEVE_LIMIT are used to rule out prime candidates by
+trial division before the Miller-Rabin test */
+#define SIEVE_LIMIT_BITS 11
+#define SIEVE_LIMIT (1 << SIEVE_LIMIT_BITS)
+#define SIEVE_PRIMES 308
+
+static uint32_t sieve_primes[SIEVE_PRIMES];
+static size_t sieve_count;
+
+/* Fills the table of small primes before main() runs */
+__attribute__((constructor)) static void sieve_init(void) {
+  for (uint32_t n = 3; n < SIEVE_LIMIT && sieve_count < SIEVE_PRIMES;
+       n += 2) {
+    bool prime = true;
+    for (size_t i = 0; prime && i < sieve_count; i++) {
+      prime = n % sieve_primes[i] != 0 || sieve_primes[i] == n;
+    }
+    if (prime) {
+      sieve_primes[sieve_count++] = n;
+    }
+  }
+}
 
 /* Calculates o = (a^d)mod(n) */
-void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+static void textbook_pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
   mpz_t v;
   mpz_t p;
   mpz_t original_d;
@@ -32,7 +63,7 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
 }
 
 /* Uses the Miller-Rabin primality test to determine if a number is prime*/
-bool is_prime(mpz_t n, uint64_t iters) {
+static bool textbook_is_prime(mpz_t n, uint64_t iters) {
   if (mpz_cmp_ui(n, 2) < 0) /* n cannot be less than 2*/
   {
     return false;
@@ -106,12 +137,13 @@ bool is_prime(mpz_t n, uint64_t iters) {
 
   /* Start of the actual algorithm */
   for (uint64_t i = 1; i <= iters; i++) {
-    mpz_urandomm(a, state, n);
+    randstate_urandomm(a, n);
     if (mpz_cmp_ui(a, 2) < 0 || mpz_cmp(a, n_minus_2) > 0) {
       i--;
       continue;
     }
 
+    profile.rounds += profile.enabled;
     pow_mod(y, a, r, n);
 
     if (mpz_cmp_ui(y, 1) != 0 && mpz_cmp(y, n_minus_1) != 0) {
@@ -157,23 +189,65 @@ bool is_prime(mpz_t n, uint64_t iters) {
   return true;
 }
 
-/* Makes a prime p with at least bits amount of bits with iters amount
+/* Makes a random prime p of exactly bits bits with iters amount
 of iterations*/
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-  /* Calculates the minimum number with the least required amount of bits*/
-  bits = bits - 1;
-  mpz_ui_pow_ui(p, 2, bits);
-  bits = bits + 1;
+  uint32_t residues[SIEVE_PRIMES];
+  uint64_t candidates = 0;
+
+  /* Only primes below the smallest candidate can rule one out */
+  size_t sieve = 0;
+  while (sieve < sieve_count &&
+         (bits > SIEVE_LIMIT_BITS ||
+          sieve_primes[sieve] < ((uint64_t)1 << (bits - 1)))) {
+    sieve++;
+  }
 
-  /* If the number is not prime, keep adding one to the number until the
-  number is prime */
-  while (is_prime(p, iters) == false) {
-    mpz_add_ui(p, p, 1);
+  /* Starts from a random odd number with the top bit set and steps through
+  the odd numbers after it, starting over if the search runs past bits.
+  The residues of the candidate modulo the small primes are stepped with
+  it, so a candidate with a small factor costs a few word additions
+  instead of a Miller-Rabin round. */
+  bool found = false;
+  do {
+    randstate_urandomb(p, bits);
+    mpz_setbit(p, bits - 1);
+    mpz_setbit(p, 0);
+    for (size_t i = 0; i < sieve; i++) {
+      residues[i] = mpz_fdiv_ui(p, sieve_primes[i]);
+    }
+
+    while (mpz_sizeinbase(p, 2) == bits) {
+      candidates++;
+      bool sieved = false;
+      for (size_t i = 0; i < sieve && !sieved; i++) {
+        sieved = residues[i] == 0;
+      }
+      profile.sieved += profile.enabled && sieved;
+      if (!sieved && is_prime(p, iters)) {
+        found = true;
+        break;
+      }
+
+      mpz_add_ui(p, p, 2);
+      for (size_t i = 0; i < sieve; i++) {
+        residues[i] += 2;
+        if (residues[i] >= sieve_primes[i]) {
+          residues[i] -= sieve_primes[i];
+        }
+      }
+    }
+  } while (!found);
+
+  if (profile.enabled) {
+    profile.primes++;
+    profile.candidates += candidates;
+    profile_record(&profile.candidates_per_prime, candidates);
   }
 }
 
 /* Calculates the modded inverse*/
-void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
+static void textbook_mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
   mpz_t r;
   mpz_t r_inverse;
   mpz_t t;
@@ -222,7 +296,7 @@ void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
 }
 
 /* Caluclates the greatest common denominator between a and b */
-void gcd(mpz_t d, mpz_t a, mpz_t b) {
+static void textbook_gcd(mpz_t d, mpz_t a, mpz_t b) {
   mpz_t original_a;
   mpz_t original_b;
   mpz_t t;
@@ -242,3 +316,304 @@ void gcd(mpz_t d, mpz_t a, mpz_t b) {
   mpz_init_set(b, original_b); /* Returns the original value of b to b */
   mpz_clears(original_b, original_a, NULL);
 }
+
+/* Lehmer's algorithm runs Euclid on the leading LEHMER_BITS bits of x and
+y in machine words, collecting the quotients in a matrix of cofactors, and
+only touches the full numbers once per batch of quotients. The bound keeps
+every leading digit plus cofactor below 2^63. */
+#define LEHMER_BITS 62
+
+/* One batch of Euclid steps: x' = a*x + b*y and y' = c*x + d*y */
+typedef struct {
+  int64_t a, b, c, d;
+} LehmerStep;
+
+/* Returns the LEHMER_BITS bits of v starting at bit */
+static uint64_t lehmer_digit(mpz_t v, uint64_t bit) {
+  uint64_t shift = bit % GMP_NUMB_BITS;
+  uint64_t value = mpz_getlimbn(v, bit / GMP_NUMB_BITS) >> shift;
+  if (shift + LEHMER_BITS > GMP_NUMB_BITS) {
+    value |= (uint64_t)mpz_getlimbn(v, bit / GMP_NUMB_BITS + 1)
+             << (GMP_NUMB_BITS - shift);
+  }
+  return value & (((uint64_t)1 << LEHMER_BITS) - 1);
+}
+
+/* Runs Euclid on the leading digits of x >= y > 2^LEHMER_BITS for as long
+as the quotients are certain to be those of x and y themselves (Knuth,
+Algorithm 4.5.2L). Returns false if not even one quotient is certain. */
+static bool lehmer_step(LehmerStep *m, mpz_t x, mpz_t y) {
+  uint64_t bit = mpz_sizeinbase(x, 2) - LEHMER_BITS;
+  int64_t xh = (int64_t)lehmer_digit(x, bit);
+  int64_t yh = (int64_t)lehmer_digit(y, bit);
+  int64_t a = 1, b = 0, c = 0, d = 1;
+
+  while (yh + c != 0 && yh + d != 0) {
+    int64_t q = (xh + a) / (yh + c);
+    if (q != (xh + b) / (yh + d)) {
+      break;
+    }
+    int64_t t = a - q * c;
+    a = c;
+    c = t;
+    t = b - q * d;
+    b = d;
+    d = t;
+    t = xh - q * yh;
+    xh = yh;
+    yh = t;
+  }
+
+  *m = (LehmerStep){a, b, c, d};
+  return b != 0;
+}
+
+/* Applies a batch of steps to the pair (x, y), using t, u and w as
+scratch space */
+static void lehmer_apply(const LehmerStep *m, mpz_t x, mpz_t y, mpz_t t,
+                         mpz_t u, mpz_t w) {
+  mpz_mul_si(t, x, m->a);
+  mpz_mul_si(w, y, m->b);
+  mpz_add(t, t, w);
+  mpz_mul_si(u, x, m->c);
+  mpz_mul_si(w, y, m->d);
+  mpz_add(u, u, w);
+  mpz_swap(x, t);
+  mpz_swap(y, u);
+}
+
+/* Calculates the greatest common divisor of a and b with Lehmer's
+algorithm, finishing in machine words once b fits in one */
+static void lehmer_gcd(mpz_t d, mpz_t a, mpz_t b) {
+  /* Every temporary is sized up front so the loop never reallocates */
+  size_t bits = mpz_sizeinbase(a, 2) + mpz_sizeinbase(b, 2) + 2 * 64;
+  mpz_t x, y, t, u, w;
+  mpz_init2(x, bits);
+  mpz_init2(y, bits);
+  mpz_init2(t, bits);
+  mpz_init2(u, bits);
+  mpz_init2(w, bits);
+
+  mpz_abs(x, a);
+  mpz_abs(y, b);
+  if (mpz_cmp(x, y) < 0) {
+    mpz_swap(x, y);
+  }
+
+  while (mpz_sizeinbase(y, 2) > LEHMER_BITS) {
+    LehmerStep m;
+    if (lehmer_step(&m, x, y)) {
+      lehmer_apply(&m, x, y, t, u, w);
+    } else {
+      mpz_tdiv_r(t, x, y);
+      mpz_swap(x, y);
+      mpz_swap(y, t);
+    }
+  }
+
+  uint64_t ys = mpz_get_ui(y);
+  if (ys == 0) {
+    mpz_set(d, x);
+  } else {
+    uint64_t xs = mpz_fdiv_ui(x, ys);
+    while (xs != 0) {
+      uint64_t r = ys % xs;
+      ys = xs;
+      xs = r;
+    }
+    mpz_set_ui(d, ys);
+  }
+  mpz_clears(x, y, t, u, w, NULL);
+}
+
+/* Calculates the inverse of a modulo n with Lehmer's algorithm, keeping
+only the cofactors of a. Sets o to 0 if there is no inverse. */
+static void lehmer_mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
+  size_t bits = mpz_sizeinbase(n, 2) + 3 * 64;
+  mpz_t x, y, sx, sy, t, u, w;
+  mpz_init2(x, bits);
+  mpz_init2(y, bits);
+  mpz_init2(sx, bits);
+  mpz_init2(sy, bits);
+  mpz_init2(t, bits);
+  mpz_init2(u, bits);
+  mpz_init2(w, bits);
+
+  /* x = sx * a and y = sy * a, modulo n */
+  mpz_abs(x, n);
+  mpz_mod(y, a, x);
+  mpz_set_ui(sx, 0);
+  mpz_set_ui(sy, 1);
+
+  while (mpz_sizeinbase(y, 2) > LEHMER_BITS) {
+    LehmerStep m;
+    if (lehmer_step(&m, x, y)) {
+      lehmer_apply(&m, x, y, t, u, w);
+      lehmer_apply(&m, sx, sy, t, u, w);
+    } else {
+      mpz_tdiv_qr(t, u, x, y);
+      mpz_swap(x, y);
+      mpz_swap(y, u);
+      mpz_mul(u, t, sy);
+      mpz_sub(u, sx, u);
+      mpz_swap(sx, sy);
+      mpz_swap(sy, u);
+    }
+  }
+
+  /* One division brings x down to a word too, then the rest of Euclid
+  runs on words with only the cofactors kept in mpz_t */
+  uint64_t xs = 0;
+  uint64_t ys = mpz_get_ui(y);
+  if (ys == 0) {
+    xs = mpz_cmp_ui(x, 1) == 0;
+  } else {
+    xs = mpz_tdiv_q_ui(t, x, ys);
+    mpz_set(u, sx);
+    mpz_submul(u, t, sy);
+    mpz_swap(sx, sy);
+    mpz_swap(sy, u);
+    while (xs != 0) {
+      uint64_t q = ys / xs;
+      uint64_t r = ys - q * xs;
+      mpz_set(u, sx);
+      mpz_submul_ui(u, sy, q);
+      mpz_swap(sx, sy);
+      mpz_swap(sy, u);
+      ys = xs;
+      xs = r;
+    }
+    xs = ys;
+  }
+
+  /* xs now holds the gcd, or 1 if it was x itself and x is 1 */
+  if (xs == 1) {
+    mpz_mod(o, sx, n);
+  } else {
+    mpz_set_ui(o, 0);
+  }
+  mpz_clears(x, y, sx, sy, t, u, w, NULL);
+}
+
+/* GMP's own implementations, for comparison and as a faster choice */
+static void gmp_gcd(mpz_t d, mpz_t a, mpz_t b) { mpz_gcd(d, a, b); }
+
+static void gmp_mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
+  if (mpz_invert(o, a, n) == 0) {
+    mpz_set_ui(o, 0);
+  }
+}
+
+static void gmp_pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+  mpz_powm(o, a, d, n);
+}
+
+static bool gmp_is_prime(mpz_t n, uint64_t iters) {
+  return mpz_probab_prime_p(n, (int)iters) > 0;
+}
+
+static const NumBackend backends[] = {
+    {"textbook", textbook_gcd, textbook_mod_inverse, textbook_pow_mod,
+     textbook_is_prime},
+    {"gmp", gmp_gcd, gmp_mod_inverse, gmp_pow_mod, gmp_is_prime},
+    {"lehmer", lehmer_gcd, lehmer_mod_inverse, textbook_pow_mod,
+     textbook_is_prime},
+};
+
+#define NBACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+/* The primitives in use, each of which may come from a different backend */
+static NumBackend active = {"textbook", textbook_gcd, textbook_mod_inverse,
+                            textbook_pow_mod, textbook_is_prime};
+
+const NumBackend *numtheory_backend(const char *name) {
+  for (size_t i = 0; i < NBACKENDS; i++) {
+    if (strcmp(backends[i].name, name) == 0) {
+      return &backends[i];
+    }
+  }
+  return NULL;
+}
+
+const NumBackend *numtheory_backend_at(size_t index) {
+  return index < NBACKENDS ? &backends[index] : NULL;
+}
+
+/* Applies one "name" or "primitive=name" item of a backend spec */
+static bool numtheory_use_item(const char *item, size_t len) {
+  char text[64];
+  if (len == 0 || len >= sizeof(text)) {
+    return len == 0;
+  }
+  memcpy(text, item, len);
+  text[len] = '\0';
+
+  char *equals = strchr(text, '=');
+  const NumBackend *b = numtheory_backend(equals ? equals + 1 : text);
+  if (b == NULL) {
+    return false;
+  }
+  if (equals == NULL) {
+    active = *b;
+    return true;
+  }
+
+  *equals = '\0';
+  if (strcmp(text, "gcd") == 0) {
+    active.gcd = b->gcd;
+  } else if (strcmp(text, "mod_inverse") == 0) {
+    active.mod_inverse = b->mod_inverse;
+  } else if (strcmp(text, "pow_mod") == 0) {
+    active.pow_mod = b->pow_mod;
+  } else if (strcmp(text, "is_prime") == 0) {
+    active.is_prime = b->is_prime;
+  } else {
+    return false;
+  }
+  active.name = "mixed";
+  return true;
+}
+
+bool numtheory_use(const char *spec) {
+  bool ok = true;
+  while (*spec != '\0') {
+    size_t len = strcspn(spec, ",");
+    ok = numtheory_use_item(spec, len) && ok;
+    spec += len + (spec[len] == ',');
+  }
+  return ok;
+}
+
+const char *numtheory_using(void) { return active.name; }
+
+/* Picks the primitives before main() runs, from the build default and
+then the RSA_BACKEND environment variable */
+__attribute__((constructor)) static void numtheory_select(void) {
+  numtheory_use(NUMTHEORY_BACKEND);
+  const char *spec = getenv("RSA_BACKEND");
+  if (spec != NULL && !numtheory_use(spec)) {
+    fprintf(stderr, "Warning: RSA_BACKEND=%s names an unknown backend or "
+                    "primitive\n",
+            spec);
+  }
+}
+
+void gcd(mpz_t d, mpz_t a, mpz_t b) { active.gcd(d, a, b); }
+
+void mod_inverse(mpz_t o, mpz_t a, mpz_t n) { active.mod_inverse(o, a, n); }
+
+void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) { active.pow_mod(o, a, d, n); }
+
+bool is_prime(mpz_t n, uint64_t iters) {
+  if (!profile.enabled) {
+    return active.is_prime(n, iters);
+  }
+
+  uint64_t rounds = profile.rounds;
+  double start = profile_now_us();
+  bool prime = active.is_prime(n, iters);
+  profile.tests++;
+  profile_record(&profile.test_us, profile_now_us() - start);
+  profile_record(&profile.rounds_per_test, profile.rounds - rounds);
+  return prime;
+}
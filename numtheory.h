@@ -2,6 +2,7 @@
 
 #include <gmp.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -14,3 +15,56 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
 bool is_prime(mpz_t n, uint64_t iters);
 
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+//
+// A set of implementations of the primitives above. Each primitive can be
+// taken from a different backend:
+//   textbook: the hand-written implementations in numtheory.c
+//   gmp: GMP's mpz_gcd(), mpz_invert(), mpz_powm() and mpz_probab_prime_p()
+//   lehmer: Lehmer's gcd and extended gcd, which run Euclid on 62-bit
+//     leading digits in machine words, with the textbook pow_mod and
+//     is_prime (default)
+// The build default is set with make BACKEND=<name>, and can be overridden
+// at run time with the environment variable RSA_BACKEND, a comma separated
+// list of "<backend>" (every primitive) or "<primitive>=<backend>" items,
+// for example RSA_BACKEND=textbook,pow_mod=gmp.
+//
+typedef struct {
+  const char *name;
+  void (*gcd)(mpz_t d, mpz_t a, mpz_t b);
+  void (*mod_inverse)(mpz_t o, mpz_t a, mpz_t n);
+  void (*pow_mod)(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
+  bool (*is_prime)(mpz_t n, uint64_t iters);
+} NumBackend;
+
+//
+// Looks up a backend by name.
+//
+// name: the backend name.
+// returns: the backend, or NULL if there is none by that name.
+//
+const NumBackend *numtheory_backend(const char *name);
+
+//
+// Returns the backend at a position in the list of backends, so callers
+// can go through all of them.
+//
+// index: the position, starting at 0.
+// returns: the backend, or NULL past the end of the list.
+//
+const NumBackend *numtheory_backend_at(size_t index);
+
+//
+// Switches primitives to other backends.
+//
+// spec: a list in the format of RSA_BACKEND.
+// returns: false if an item named an unknown backend or primitive; the
+// other items are still applied.
+//
+bool numtheory_use(const char *spec);
+
+//
+// Returns the name of the backend in use, or "mixed" if the primitives
+// come from more than one.
+//
+const char *numtheory_using(void);
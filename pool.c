@@ -0,0 +1,165 @@
+#include "pool.h"
+#include "randstate.h"
+#include <fcntl.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Writes the path of the pool file for bits into path */
+static void pool_path(char *path, size_t size, const char *dir,
+                      uint64_t bits) {
+  snprintf(path, size, "%s/%lu.pool", dir, (unsigned long)bits);
+}
+
+/* Reads the whole locked pool file, returns NULL if it is empty */
+static char *pool_read(int fd, size_t *len) {
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    return NULL;
+  }
+
+  char *text = (char *)malloc((size_t)info.st_size + 1);
+  size_t total = 0;
+  while (total < (size_t)info.st_size) {
+    ssize_t got = pread(fd, text + total, (size_t)info.st_size - total,
+                        (off_t)total);
+    if (got <= 0) {
+      break;
+    }
+    total += (size_t)got;
+  }
+  text[total] = '\0';
+  *len = total;
+  return text;
+}
+
+/* Appends p to the pool file for bits */
+bool pool_put(const char *dir, uint64_t bits, mpz_t p) {
+  char path[4096];
+  mkdir(dir, 0700);
+  pool_path(path, sizeof(path), dir, bits);
+
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+  if (fd < 0) {
+    return false;
+  }
+
+  size_t size = mpz_sizeinbase(p, 16) + 2;
+  char *line = (char *)malloc(size + 1);
+  mpz_get_str(line, 16, p);
+  size_t len = strlen(line);
+  line[len++] = '\n';
+
+  flock(fd, LOCK_EX);
+  bool ok = write(fd, line, len) == (ssize_t)len;
+  flock(fd, LOCK_UN);
+  close(fd);
+  free(line);
+  return ok;
+}
+
+/* Removes the last prime from the pool file for bits */
+bool pool_take(const char *dir, uint64_t bits, mpz_t p) {
+  char path[4096];
+  pool_path(path, sizeof(path), dir, bits);
+
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return false;
+  }
+  flock(fd, LOCK_EX);
+
+  bool found = false;
+  size_t len = 0;
+  char *text = pool_read(fd, &len);
+  while (text != NULL && len > 0 && !found) {
+    /* Drops the trailing newline, then finds the start of the last line */
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+      len--;
+    }
+    size_t start = len;
+    while (start > 0 && text[start - 1] != '\n') {
+      start--;
+    }
+    text[len] = '\0';
+
+    /* A line that does not hold a prime of the right size is dropped */
+    found = len > start && mpz_set_str(p, text + start, 16) == 0 &&
+            mpz_sizeinbase(p, 2) == bits;
+    len = start;
+  }
+  if (text != NULL && ftruncate(fd, (off_t)len) != 0) {
+    found = false;
+  }
+
+  flock(fd, LOCK_UN);
+  close(fd);
+  free(text);
+  return found;
+}
+
+/* Counts the lines in the pool file for bits */
+size_t pool_count(const char *dir, uint64_t bits) {
+  char path[4096];
+  pool_path(path, sizeof(path), dir, bits);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  flock(fd, LOCK_SH);
+
+  size_t count = 0;
+  size_t len = 0;
+  char *text = pool_read(fd, &len);
+  for (size_t i = 0; i < len; i++) {
+    count += text[i] == '\n';
+  }
+
+  flock(fd, LOCK_UN);
+  close(fd);
+  free(text);
+  return count;
+}
+
+/* Each unordered split is counted once, from its smaller size */
+size_t pool_pairs(const char *dir, uint64_t nbits) {
+  size_t pairs = 0;
+  for (uint64_t bits = nbits / 4; 2 * bits <= nbits; bits++) {
+    size_t have = pool_count(dir, bits);
+    if (have == 0) {
+      continue;
+    }
+    if (2 * bits == nbits) {
+      pairs += have / 2;
+    } else {
+      size_t other = pool_count(dir, nbits - bits);
+      pairs += have < other ? have : other;
+    }
+  }
+  return pairs;
+}
+
+/* Collects every split of [nbits/4, (3 * nbits)/4) the pool can fill */
+uint64_t pool_split(const char *dir, uint64_t nbits) {
+  uint64_t low = nbits / 4;
+  uint64_t high = (3 * nbits) / 4;
+  uint64_t *splits = (uint64_t *)malloc((high - low + 1) * sizeof(uint64_t));
+  size_t count = 0;
+  for (uint64_t bits = low; bits < high; bits++) {
+    size_t need = 2 * bits == nbits ? 2 : 1;
+    if (pool_count(dir, bits) >= need &&
+        pool_count(dir, nbits - bits) >= need) {
+      splits[count++] = bits;
+    }
+  }
+  uint64_t bits = count > 0 ? splits[randstate_below(count)] : 0;
+  free(splits);
+  return bits;
+}
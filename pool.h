@@ -0,0 +1,66 @@
+#pragma once
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// An on-disk pool of pre-tested primes, so keys can be made without
+// waiting on a prime search. A pool is a directory holding one file per
+// prime size, "<bits>.pool", with one prime per line in hexadecimal.
+// Every access takes an flock() on the file, so the primepool generator
+// and any number of keygen processes can share a pool.
+//
+// The primes of a key are split between any two sizes rsa_prime_bits()
+// can draw, so a pool for a key size holds pairs of primes whose sizes add
+// up to it, on as many splits as there are pairs.
+//
+
+//
+// Adds a prime to the pool, creating the directory and file if needed.
+//
+// dir: the pool directory.
+// bits: the number of bits of p.
+// p: the prime to add.
+// returns: false if the pool file couldn't be written.
+//
+bool pool_put(const char *dir, uint64_t bits, mpz_t p);
+
+//
+// Removes a prime from the pool.
+//
+// dir: the pool directory.
+// bits: the number of bits wanted.
+// p: will store the prime.
+// returns: false if the pool has no prime of that size.
+//
+bool pool_take(const char *dir, uint64_t bits, mpz_t p);
+
+//
+// Returns the number of primes of a size held in the pool.
+//
+// dir: the pool directory.
+// bits: the number of bits.
+//
+size_t pool_count(const char *dir, uint64_t bits);
+
+//
+// Returns the number of keys of a size that the primes in the pool can
+// make, counting each prime once.
+//
+// dir: the pool directory.
+// nbits: the number of bits of the modulus.
+//
+size_t pool_pairs(const char *dir, uint64_t nbits);
+
+//
+// Picks at random, from the sizes rsa_prime_bits() can draw, a number of
+// bits for p such that the pool holds primes of that size and of nbits
+// minus it. The random state must be initialized.
+//
+// dir: the pool directory.
+// nbits: the number of bits of the modulus.
+// returns: the number of bits for p, or 0 if the pool has no such pair.
+//
+uint64_t pool_split(const char *dir, uint64_t nbits);
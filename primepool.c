@@ -0,0 +1,236 @@
+#include "numtheory.h"
+#include "pool.h"
+#include "randstate.h"
+#include "rsa.h"
+#include <gmp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define OPTIONS "d:b:c:i:s:t:wvh"
+#define MAX_SIZES 64
+#define MAX_THREADS 256
+
+/* The share of the missing primes made by one worker thread */
+typedef struct {
+  const uint64_t *bits; /* Size of each prime */
+  uint64_t iters;
+  uint64_t stream; /* Random stream the worker seeds itself with */
+  size_t first;    /* Index of the worker's first prime */
+  size_t step;     /* Number of workers */
+  size_t count;    /* Number of primes being made by all workers */
+  mpz_t *primes;
+} FillJob;
+
+static void usage(char *program) {
+  fprintf(stderr, "Usage: %s [options]\n", program);
+  fprintf(stderr, "  %s fills a pool of pre-tested primes that keygen -P "
+                  "draws from,\n",
+          program);
+  fprintf(stderr, "  holding pairs of primes for keys of each size, split "
+                  "at random as keygen splits them.\n");
+  fprintf(stderr, "    -d <dir>    : Pool directory is <dir>. Default: "
+                  "primes\n");
+  fprintf(stderr, "    -b <bits>   : Fill primes for <bits>-bit keys; may be "
+                  "repeated. Default: 1024\n");
+  fprintf(stderr, "    -c <count>  : Keep primes for <count> keys of each "
+                  "size. Default: 16\n");
+  fprintf(stderr, "    -i <iters>  : Run <iters> Miller-Rabin iterations "
+                  "for primality testing. Default: 50\n");
+  fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
+                  "Default: system entropy\n");
+  fprintf(stderr, "    -t <threads>: Search with <threads> threads. Default: "
+                  "number of CPUs.\n");
+  fprintf(stderr, "    -w          : Keep running, refilling the pool as "
+                  "keygen uses it.\n");
+  fprintf(stderr, "    -v          : Print the number of primes added to "
+                  "each size.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+/* Adds bits to the list of key sizes unless it is already there */
+static void add_size(uint64_t sizes[], size_t *count, uint64_t bits) {
+  for (size_t i = 0; i < *count; i++) {
+    if (sizes[i] == bits) {
+      return;
+    }
+  }
+  if (*count < MAX_SIZES) {
+    sizes[(*count)++] = bits;
+  }
+}
+
+/* Thread body: makes every step-th prime of the job */
+static void *fill_worker(void *arg) {
+  FillJob *job = (FillJob *)arg;
+  randstate_init_stream(job->stream);
+  for (size_t i = job->first; i < job->count; i += job->step) {
+    make_prime(job->primes[i], job->bits[i], job->iters);
+  }
+  randstate_clear();
+  return NULL;
+}
+
+/* Makes count primes of the given sizes on the worker threads and adds
+them to the pool in a fixed order. Each worker uses its own random stream,
+numbered from *stream on, so the pool gets the same primes for the same
+seed and thread count. Returns false if the pool couldn't be written. */
+static bool fill(const char *dir, const uint64_t bits[], uint64_t iters,
+                 size_t count, long threads, uint64_t *stream) {
+  mpz_t *primes = (mpz_t *)malloc(count * sizeof(mpz_t));
+  for (size_t i = 0; i < count; i++) {
+    mpz_init(primes[i]);
+  }
+
+  FillJob jobs[MAX_THREADS];
+  pthread_t workers[MAX_THREADS];
+  for (long t = 0; t < threads; t++) {
+    jobs[t] = (FillJob){bits, iters, (*stream)++, (size_t)t, (size_t)threads,
+                        count, primes};
+    pthread_create(&workers[t], NULL, fill_worker, &jobs[t]);
+  }
+  for (long t = 0; t < threads; t++) {
+    pthread_join(workers[t], NULL);
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < count; i++) {
+    ok = ok && pool_put(dir, bits[i], primes[i]);
+    mpz_clear(primes[i]);
+  }
+  free(primes);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  int opt = 0;
+  char *dir = "primes";
+  uint64_t sizes[MAX_SIZES];
+  size_t nsizes = 0;
+  long target = 16;
+  uint64_t iterations = 50;
+  uint64_t seed = 0;
+  bool seeded = false;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool watch = false;
+  bool verbose = false;
+
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'b':
+      if (atoi(optarg) < 50 || atoi(optarg) > 4096) {
+        fprintf(stderr, "Number of bits must be 50-4096, not %d.\n",
+                atoi(optarg));
+        usage(argv[0]);
+        return 1;
+      }
+      add_size(sizes, &nsizes, atoi(optarg));
+      break;
+    case 'c':
+      target = atol(optarg);
+      if (target < 1) {
+        fprintf(stderr, "Number of primes must be positive, not %s.\n",
+                optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'i':
+      if (atoi(optarg) < 1 || atoi(optarg) > 500) {
+        fprintf(stderr, "Number of iterations must be 1-500, not %d.\n",
+                atoi(optarg));
+        usage(argv[0]);
+        return 1;
+      }
+      iterations = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      seeded = true;
+      break;
+    case 't':
+      threads = atol(optarg);
+      if (threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "Number of threads must be 1-%d, not %s.\n",
+                MAX_THREADS, optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'w':
+      watch = true;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (nsizes == 0) {
+    add_size(sizes, &nsizes, 1024);
+  }
+
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (seeded) {
+    randstate_init(seed);
+  } else if (!randstate_init_entropy()) {
+    fprintf(stderr, "primepool: Couldn't read random numbers from the "
+                    "system\n");
+    return 1;
+  }
+  uint64_t stream = 0;
+
+  /* Tops up every key size with pairs on fresh random splits, then in -w
+  mode checks again every second */
+  while (true) {
+    for (size_t i = 0; i < nsizes; i++) {
+      size_t have = pool_pairs(dir, sizes[i]);
+      if (have >= (size_t)target) {
+        continue;
+      }
+      size_t missing = target - have;
+      uint64_t *bits = (uint64_t *)malloc(2 * missing * sizeof(uint64_t));
+      for (size_t j = 0; j < missing; j++) {
+        bits[2 * j] = rsa_prime_bits(sizes[i]);
+        bits[2 * j + 1] = sizes[i] - bits[2 * j];
+      }
+      bool ok = fill(dir, bits, iterations, 2 * missing, threads, &stream);
+      free(bits);
+      if (!ok) {
+        fprintf(stderr, "primepool: Couldn't write to pool %s\n", dir);
+        randstate_clear();
+        return 1;
+      }
+      if (verbose) {
+        fprintf(stderr, "%lu-bit keys: added %zu\n",
+                (unsigned long)sizes[i], missing);
+      }
+    }
+    if (!watch) {
+      break;
+    }
+    sleep(1);
+  }
+
+  for (size_t i = 0; i < nsizes; i++) {
+    printf("%lu-bit keys: %zu\n", (unsigned long)sizes[i],
+           pool_pairs(dir, sizes[i]));
+  }
+
+  randstate_clear();
+  return 0;
+}
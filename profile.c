@@ -0,0 +1,108 @@
+#include "profile.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+_Thread_local Profile profile;
+
+static const char *phase_names[PROFILE_PHASES] = {
+    "prime_p", "prime_q", "public_exponent", "mod_inverse", "sign"};
+
+void profile_start(void) {
+  memset(&profile, 0, sizeof(profile));
+  profile.enabled = true;
+}
+
+double profile_now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+void profile_phase(ProfilePhase phase, double *mark) {
+  double now = profile_now_us();
+  profile.phase_us[phase] += now - *mark;
+  *mark = now;
+}
+
+void profile_record(ProfileHistogram *h, double value) {
+  int bucket = 0;
+  if (value >= 1) {
+    bucket = ilogb(value) + 1;
+    if (bucket >= PROFILE_BUCKETS) {
+      bucket = PROFILE_BUCKETS - 1;
+    }
+  }
+  h->buckets[bucket]++;
+  if (h->count == 0 || value < h->min) {
+    h->min = value;
+  }
+  if (h->count == 0 || value > h->max) {
+    h->max = value;
+  }
+  h->count++;
+  h->sum += value;
+}
+
+/* Writes a histogram with its non-empty buckets, each as the range of
+values it holds */
+static void write_histogram(FILE *out, const char *name,
+                            const ProfileHistogram *h, bool last) {
+  fprintf(out, "    \"%s\": {\"count\": %llu, \"min\": %.1f, \"max\": %.1f, "
+               "\"mean\": %.1f, \"buckets\": [",
+          name, (unsigned long long)h->count, h->min, h->max,
+          h->count ? h->sum / h->count : 0.0);
+  bool first = true;
+  for (int i = 0; i < PROFILE_BUCKETS; i++) {
+    if (h->buckets[i] == 0) {
+      continue;
+    }
+    double low = i == 0 ? 0 : ldexp(1, i - 1);
+    fprintf(out, "%s{\"from\": %.0f, \"to\": ", first ? "" : ", ", low);
+    if (i == PROFILE_BUCKETS - 1) {
+      fprintf(out, "null");
+    } else {
+      fprintf(out, "%.0f", ldexp(1, i));
+    }
+    fprintf(out, ", \"count\": %llu}", (unsigned long long)h->buckets[i]);
+    first = false;
+  }
+  fprintf(out, "]}%s\n", last ? "" : ",");
+}
+
+void profile_write_json(FILE *out, uint64_t bits, uint64_t iters,
+                        const char *backend) {
+  double total = 0;
+  for (int i = 0; i < PROFILE_PHASES; i++) {
+    total += profile.phase_us[i];
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"bits\": %llu,\n", (unsigned long long)bits);
+  fprintf(out, "  \"iterations\": %llu,\n", (unsigned long long)iters);
+  fprintf(out, "  \"backend\": \"%s\",\n", backend);
+  fprintf(out, "  \"phases_us\": {");
+  for (int i = 0; i < PROFILE_PHASES; i++) {
+    fprintf(out, "\"%s\": %.1f, ", phase_names[i], profile.phase_us[i]);
+  }
+  fprintf(out, "\"total\": %.1f},\n", total);
+  fprintf(out, "  \"counters\": {\"primes\": %llu, \"candidates\": %llu, "
+               "\"sieved\": %llu, \"tests\": %llu, \"rounds\": %llu, "
+               "\"e_attempts\": %llu},\n",
+          (unsigned long long)profile.primes,
+          (unsigned long long)profile.candidates,
+          (unsigned long long)profile.sieved,
+          (unsigned long long)profile.tests,
+          (unsigned long long)profile.rounds,
+          (unsigned long long)profile.e_attempts);
+  fprintf(out, "  \"histograms\": {\n");
+  write_histogram(out, "candidates_per_prime", &profile.candidates_per_prime,
+                  false);
+  write_histogram(out, "rounds_per_test", &profile.rounds_per_test, false);
+  write_histogram(out, "test_us", &profile.test_us, true);
+  fprintf(out, "  }\n");
+  fprintf(out, "}\n");
+}
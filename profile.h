@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Phases of key generation whose wall time is kept in the profile.
+//
+typedef enum {
+  PROFILE_PRIME_P,     /* Finding p */
+  PROFILE_PRIME_Q,     /* Finding q */
+  PROFILE_PUBLIC_EXP,  /* Choosing e coprime with lambda(n) */
+  PROFILE_MOD_INVERSE, /* Computing d, the inverse of e mod lambda(n) */
+  PROFILE_SIGN,        /* Signing the username */
+  PROFILE_PHASES
+} ProfilePhase;
+
+//
+// Number of buckets in a histogram. Bucket 0 counts values below 1 and
+// bucket i values in [2^(i-1), 2^i); larger values go in the last bucket.
+//
+#define PROFILE_BUCKETS 40
+
+typedef struct {
+  uint64_t count;
+  double sum;
+  double min;
+  double max;
+  uint64_t buckets[PROFILE_BUCKETS];
+} ProfileHistogram;
+
+//
+// Counters of the work done by key generation. make_prime(), is_prime()
+// and rsa_make_pub_from() add to the profile of the calling thread, so
+// threads that make primes at the same time don't share counters.
+// Counting and timing are only done while enabled is set.
+//
+// The Miller-Rabin rounds are counted by the textbook test, which the
+// textbook and lehmer backends use; GMP's test only counts as a call.
+//
+typedef struct {
+  bool enabled;
+  uint64_t primes;     /* Primes made by make_prime() */
+  uint64_t candidates; /* Odd numbers make_prime() looked at */
+  uint64_t sieved;     /* Candidates ruled out by a small prime factor */
+  uint64_t tests;      /* Calls to is_prime() */
+  uint64_t rounds;     /* Miller-Rabin rounds run by is_prime() */
+  uint64_t e_attempts; /* Random values tried as e */
+  double phase_us[PROFILE_PHASES];
+  ProfileHistogram candidates_per_prime;
+  ProfileHistogram rounds_per_test;
+  ProfileHistogram test_us; /* Wall time of each is_prime() call */
+} Profile;
+
+extern _Thread_local Profile profile;
+
+//
+// Clears the profile of the calling thread and starts counting.
+//
+void profile_start(void);
+
+//
+// Returns the time in microseconds on a monotonic clock.
+//
+double profile_now_us(void);
+
+//
+// Adds the time since a mark to a phase and moves the mark to now, so
+// phases that run one after another can be timed with one mark.
+//
+// phase: the phase that just ended.
+// mark: the time the phase started, set to the time it ended.
+//
+void profile_phase(ProfilePhase phase, double *mark);
+
+//
+// Adds a value to a histogram.
+//
+// h: the histogram.
+// value: the value, at least 0.
+//
+void profile_record(ProfileHistogram *h, double value);
+
+//
+// Writes the profile of the calling thread as a JSON object.
+//
+// out: the stream to write to.
+// bits: the requested size of n.
+// iters: the number of Miller-Rabin iterations asked for.
+// backend: the name of the arithmetic backend in use.
+//
+void profile_write_json(FILE *out, uint64_t bits, uint64_t iters,
+                        const char *backend);
@@ -1,16 +1,116 @@
 #include "randstate.h"
+#include "chacha.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <gmp.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
 
-gmp_randstate_t state; /* Global random state */
+static _Thread_local ChaCha stream; /* Keystream of each thread */
 
-/* Initializes the global random state with Mersenne Twister*/
+static uint8_t master_key[32]; /* Set once by the init functions */
+
+/* Starts this thread's keystream */
+static void randstate_start(uint64_t index) {
+  chacha_init(&stream, master_key, index);
+}
+
+/* Uses the seed, least significant byte first, as the key */
 void randstate_init(uint64_t seed) {
-  gmp_randinit_mt(state);
-  gmp_randseed_ui(state, seed);
+  memset(master_key, 0, sizeof(master_key));
+  for (int i = 0; i < 8; i++) {
+    master_key[i] = (uint8_t)(seed >> (8 * i));
+  }
+  randstate_start(0);
+}
+
+/* Reads the key from getrandom(), or /dev/urandom on kernels without it */
+bool randstate_init_entropy(void) {
+  size_t got = 0;
+  while (got < sizeof(master_key)) {
+    ssize_t n = getrandom(master_key + got, sizeof(master_key) - got, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    got += (size_t)n;
+  }
+
+  if (got < sizeof(master_key)) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    got = 0;
+    while (fd >= 0 && got < sizeof(master_key)) {
+      ssize_t n = read(fd, master_key + got, sizeof(master_key) - got);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      got += (size_t)n;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (got < sizeof(master_key)) {
+      return false;
+    }
+  }
+
+  randstate_start(0);
+  return true;
+}
+
+/* Stream 0 belongs to the thread that chose the key */
+void randstate_init_stream(uint64_t index) { randstate_start(index + 1); }
+
+/* Frees memory used by this thread's random state*/
+void randstate_clear(void) { chacha_clear(&stream); }
+
+void randstate_bytes(void *out, size_t len) { chacha_bytes(&stream, out, len); }
+
+/* Rejects the top values that would make some results more likely */
+uint64_t randstate_below(uint64_t n) {
+  if (n == 0) {
+    return 0;
+  }
+  uint64_t limit = UINT64_MAX - UINT64_MAX % n;
+  uint64_t x;
+  do {
+    x = chacha_u64(&stream);
+  } while (x >= limit);
+  return x % n;
 }
 
-/* Frees memory used by the global random state*/
-void randstate_clear(void) { gmp_randclear(state); }
+/* Fills the limbs of r straight from the keystream */
+void randstate_urandomb(mpz_t r, uint64_t bits) {
+  size_t limbs = (bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+  if (limbs == 0) {
+    mpz_set_ui(r, 0);
+    return;
+  }
+
+  mp_limb_t *data = mpz_limbs_write(r, limbs);
+  chacha_bytes(&stream, data, limbs * sizeof(mp_limb_t));
+  for (size_t i = 0; i < limbs; i++) {
+    data[i] &= GMP_NUMB_MASK;
+  }
+  if (bits % GMP_NUMB_BITS != 0) {
+    data[limbs - 1] &= ((mp_limb_t)1 << (bits % GMP_NUMB_BITS)) - 1;
+  }
+  mpz_limbs_finish(r, limbs);
+}
+
+/* Draws numbers as wide as n until one is below it */
+void randstate_urandomm(mpz_t r, const mpz_t n) {
+  size_t bits = mpz_sizeinbase(n, 2);
+  do {
+    randstate_urandomb(r, bits);
+  } while (mpz_cmp(r, n) >= 0);
+}
@@ -1,21 +1,85 @@
 #pragma once
 
 #include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-extern gmp_randstate_t state;
+//
+// The random state used by key generation and the number theory functions.
+// Random numbers come from a ChaCha20 keystream, keyed from the kernel's
+// entropy pool by randstate_init_entropy() or from a seed by
+// randstate_init() for reproducible runs.
+//
+// Every thread has its own state: the thread that calls one of the init
+// functions gets stream 0 of the key, and each other thread that needs
+// random numbers starts its own stream with randstate_init_stream().
+// Nothing is shared between threads, so results depend only on the key and
+// on which stream each piece of work is given.
+//
 
 //
-// Initializes the random state needed for RSA key generation operations.
-// Must be called before any key generation or number theory operations are
-// used.
+// Initializes the random state needed for RSA key generation operations
+// from a seed, so the same seed always gives the same numbers.
+// One of the init functions must be called before any key generation or
+// number theory operations are used.
 //
 // seed: the seed to seed the random state with.
 //
 void randstate_init(uint64_t seed);
 
 //
-// Frees any memory used by the initialized random state.
+// Initializes the random state with a key read from the kernel's entropy
+// pool with getrandom().
+//
+// returns: false if no entropy could be read.
+//
+bool randstate_init_entropy(void);
+
+//
+// Initializes the calling thread's random state as one stream of the key
+// chosen by randstate_init() or randstate_init_entropy(). The same key and
+// index always give the same stream, and different indexes give unrelated
+// streams. The state must be freed with randstate_clear() by the same
+// thread.
+//
+// index: the stream number, such as a worker number.
+//
+void randstate_init_stream(uint64_t index);
+
+//
+// Frees any memory used by the calling thread's random state.
 // Must be called after all key generation or number theory operations are used.
 //
 void randstate_clear(void);
+
+//
+// Fills a buffer with random bytes.
+//
+// out: where to write.
+// len: the number of bytes.
+//
+void randstate_bytes(void *out, size_t len);
+
+//
+// Returns a random number in the range [0, n), or 0 if n is 0.
+//
+uint64_t randstate_below(uint64_t n);
+
+//
+// Sets r to a random number in the range [0, 2^bits).
+// r must be initialized.
+//
+// r: will store the number.
+// bits: the number of random bits.
+//
+void randstate_urandomb(mpz_t r, uint64_t bits);
+
+//
+// Sets r to a random number in the range [0, n).
+// r and n must be initialized, distinct, and n must be positive.
+//
+// r: will store the number.
+// n: the exclusive upper bound.
+//
+void randstate_urandomm(mpz_t r, const mpz_t n);
@@ -1,17 +1,46 @@
 #include "rsa.h"
+#include "cdc.h"
+#include "chacha.h"
+#include "crt.h"
+#include "fileio.h"
+#include "hexcodec.h"
+#include "lz.h"
+#include "mont.h"
 #include "numtheory.h"
+#include "profile.h"
 #include "randstate.h"
+#include "sha256.h"
 #include <stdio.h>
+#include <errno.h>
 #include <gmp.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Picks the number of bits for p, the rest go to q */
+uint64_t rsa_prime_bits(uint64_t nbits) {
+  /* Draws the bits for p from the range [nbits/4, (3 * nbits)/4), so no
+  two keys need share the same split */
+  return nbits / 4 + randstate_below((3 * nbits) / 4 - nbits / 4);
+}
 
 /* Makes the public key*/
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits,
                   uint64_t iters) {
+  uint64_t rand_num = rsa_prime_bits(nbits);
+
+  make_prime(p, rand_num, iters);
+  make_prime(q, nbits - rand_num, iters);
+  rsa_make_pub_from(p, q, n, e, nbits);
+}
 
+/* Makes the public key from primes that were already chosen */
+void rsa_make_pub_from(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits) {
   mpz_t totient_p;
   mpz_t totient_q;
   mpz_t totient;
@@ -30,18 +59,6 @@ void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits,
   mpz_init_set_ui(gcd_value, 1);
   mpz_init_set_ui(lambda, 0);
 
-  /* Generates a random number of bits for p in the range
-  [nbits/4, (3 * nbits)/4]*/
-  /* The left over bits go over to q*/
-  srandom(3);
-  uint64_t rand_num = random() % ((3 * nbits) / 4);
-
-  while (rand_num < (nbits / 4) || rand_num >= ((3 * nbits) / 4)) {
-    rand_num = random() % ((3 * nbits) / 4);
-  }
-
-  make_prime(p, rand_num, iters);
-  make_prime(q, nbits - rand_num, iters);
   mpz_mul(n, p, q);
 
   /* Calculates the lambda value */
@@ -53,14 +70,16 @@ void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits,
 
   /* Keeps generating the gcd() of each random number until a number
   coprime with lambda is founded. That value is e. */
-  mpz_urandomb(e1, state, nbits);
+  randstate_urandomb(e1, nbits);
   gcd(e_mod, e1, lambda);
   mpz_init_set(e, e1);
+  profile.e_attempts += profile.enabled;
 
   while (mpz_cmp_ui(e1, 2) <= 0 || mpz_cmp(e1, n) >= 0 ||
          mpz_cmp_ui(e_mod, 1) != 0) {
-    mpz_urandomb(e1, state, nbits);
+    randstate_urandomb(e1, nbits);
     gcd(e_mod, e1, lambda);
+    profile.e_attempts += profile.enabled;
 
     if (mpz_cmp_ui(e1, 2) > 0 && mpz_cmp(e1, n) < 0 &&
         mpz_cmp_ui(e_mod, 1) == 0) {
@@ -128,16 +147,484 @@ void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
   gmp_fscanf(pvfile, "%Zx\n", d);
 }
 
+/* Writes the prime factors of n after the private key */
+void rsa_write_priv_factors(mpz_t p, mpz_t q, FILE *pvfile) {
+  gmp_fprintf(pvfile, "%Zx\n", p);
+  gmp_fprintf(pvfile, "%Zx\n", q);
+}
+
+/* Reads the prime factors following the private key, if there are any */
+bool rsa_read_priv_factors(mpz_t n, mpz_t p, mpz_t q, FILE *pvfile) {
+  if (gmp_fscanf(pvfile, "%Zx\n", p) != 1 ||
+      gmp_fscanf(pvfile, "%Zx\n", q) != 1) {
+    return false;
+  }
+  mpz_t product;
+  mpz_init(product);
+  mpz_mul(product, p, q);
+  bool ok = mpz_cmp(product, n) == 0;
+  mpz_clear(product);
+  return ok;
+}
+
 /* Encrypts message m to ciphertext c */
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) { pow_mod(c, m, e, n); }
 
+/* Writes each value as a line of hex, the same text as gmp_fprintf("%Zx\n").
+line must have room for the longest value plus the newline. */
+static void write_hex_lines(Writer *writer, char *line, mpz_t values[],
+                            size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    size_t length = hex_encode(line, values[i]);
+    line[length++] = '\n';
+    writer_write(writer, line, length);
+  }
+}
+
+/* Exponentiates the loaded lanes and writes them as lines of hex */
+static void write_batch(MontCtx *ctx, Writer *writer, char *line,
+                        mpz_t cipher[], size_t count) {
+  mont_run(ctx, count);
+  for (size_t i = 0; i < count; i++) {
+    mont_get_mpz(ctx, i, cipher[i]);
+  }
+  write_hex_lines(writer, line, cipher, count);
+}
+
+/* A compressed frame starts with its raw length and its stored length,
+4 bytes each, least significant first. A frame that did not shrink is
+stored as is, with both lengths equal. */
+#define FRAME_HEADER 8
+
+static void put32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (uint8_t)(v >> (8 * i));
+  }
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+/* The plaintext handed to the block packer: the input file itself, or the
+input file compressed one frame at a time */
+typedef struct {
+  Reader *reader;
+  bool compress;
+  uint64_t left;  /* Bytes of input that may still be read */
+  uint8_t *raw;   /* Input of the frame being built */
+  uint8_t *frame; /* Header and stored bytes of the current frame */
+  size_t pos;     /* Next byte of frame to hand out */
+  size_t len;     /* Bytes in frame */
+} Source;
+
+static void source_open(Source *src, FILE *file, uint32_t flags,
+                        uint64_t length) {
+  memset(src, 0, sizeof(*src));
+  src->reader = reader_open(file);
+  src->compress = (flags & RSA_COMPRESS) != 0;
+  src->left = length;
+  if (src->compress) {
+    src->raw = (uint8_t *)malloc(LZ_FRAME);
+    src->frame = (uint8_t *)malloc(FRAME_HEADER + lz_bound(LZ_FRAME));
+  }
+}
+
+/* Reads up to len bytes of input, stopping at the length limit */
+static size_t source_input(Source *src, uint8_t *buf, size_t len) {
+  if (len > src->left) {
+    len = (size_t)src->left;
+  }
+  size_t got = reader_read(src->reader, buf, len);
+  src->left -= got;
+  return got;
+}
+
+/* Compresses the next frame of input, returns false at end of file */
+static bool source_fill(Source *src) {
+  size_t raw_len = source_input(src, src->raw, LZ_FRAME);
+  if (raw_len == 0) {
+    return false;
+  }
+
+  size_t stored = lz_compress(src->frame + FRAME_HEADER, src->raw, raw_len);
+  if (stored >= raw_len) {
+    memcpy(src->frame + FRAME_HEADER, src->raw, raw_len);
+    stored = raw_len;
+  }
+  put32(src->frame, (uint32_t)raw_len);
+  put32(src->frame + 4, (uint32_t)stored);
+  src->pos = 0;
+  src->len = FRAME_HEADER + stored;
+  return true;
+}
+
+/* Reads up to len bytes, less only at end of file, like reader_read() */
+static size_t source_read(Source *src, uint8_t *buf, size_t len) {
+  if (!src->compress) {
+    return source_input(src, buf, len);
+  }
+
+  size_t total = 0;
+  while (total < len) {
+    if (src->pos == src->len && !source_fill(src)) {
+      break;
+    }
+    size_t take = src->len - src->pos;
+    if (take > len - total) {
+      take = len - total;
+    }
+    memcpy(buf + total, src->frame + src->pos, take);
+    src->pos += take;
+    total += take;
+  }
+  return total;
+}
+
+static void source_close(Source *src) {
+  reader_close(src->reader);
+  free(src->raw);
+  free(src->frame);
+}
+
+/* Where decrypted blocks go: the output file itself, or a frame buffer
+that is decompressed into the output file each time a frame completes */
+typedef struct {
+  Writer *writer;
+  bool decompress;
+  bool corrupt;   /* Set once a frame fails to decode */
+  uint8_t *frame; /* The frame being assembled */
+  uint8_t *raw;   /* Output of the last frame */
+  size_t have;    /* Bytes of the frame received so far */
+  size_t need;    /* Bytes of the frame expected */
+} Sink;
+
+static void sink_open(Sink *sink, FILE *file, uint32_t flags) {
+  memset(sink, 0, sizeof(*sink));
+  sink->writer = writer_open(file);
+  sink->decompress = (flags & RSA_COMPRESS) != 0;
+  sink->need = FRAME_HEADER;
+  if (sink->decompress) {
+    sink->frame = (uint8_t *)malloc(FRAME_HEADER + lz_bound(LZ_FRAME));
+    sink->raw = (uint8_t *)malloc(LZ_FRAME);
+  }
+}
+
+/* Decodes the complete frame in the buffer and writes it out */
+static void sink_frame(Sink *sink) {
+  size_t raw_len = get32(sink->frame);
+  size_t stored = sink->need - FRAME_HEADER;
+  const uint8_t *data = sink->frame + FRAME_HEADER;
+
+  if (stored == raw_len) {
+    writer_write(sink->writer, data, raw_len);
+  } else if (lz_decompress(sink->raw, LZ_FRAME, data, stored) == raw_len) {
+    writer_write(sink->writer, sink->raw, raw_len);
+  } else {
+    sink->corrupt = true;
+  }
+  sink->have = 0;
+  sink->need = FRAME_HEADER;
+}
+
+static void sink_write(Sink *sink, const uint8_t *buf, size_t len) {
+  if (!sink->decompress) {
+    writer_write(sink->writer, buf, len);
+    return;
+  }
+
+  while (len > 0 && !sink->corrupt) {
+    size_t take = sink->need - sink->have;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(sink->frame + sink->have, buf, take);
+    sink->have += take;
+    buf += take;
+    len -= take;
+    if (sink->have < sink->need) {
+      break;
+    }
+
+    if (sink->need == FRAME_HEADER) {
+      size_t raw_len = get32(sink->frame);
+      size_t stored = get32(sink->frame + 4);
+      if (raw_len > LZ_FRAME || stored > raw_len) {
+        sink->corrupt = true;
+        break;
+      }
+      sink->need = FRAME_HEADER + stored;
+      if (stored > 0) {
+        continue;
+      }
+    }
+    sink_frame(sink);
+  }
+}
+
+/* Returns false if the decompressed data was corrupt or cut short, or
+couldn't be written */
+static bool sink_close(Sink *sink) {
+  bool ok = !sink->corrupt && sink->have == 0;
+  ok = writer_close(sink->writer) && ok;
+  free(sink->frame);
+  free(sink->raw);
+  return ok;
+}
+
+static double now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/* Length of the key id in a "#to" line, in hex digits */
+#define KEY_ID 16
+
+void rsa_key_id(uint8_t id[SHA256_SIZE], mpz_t n) {
+  char *text = (char *)malloc(hex_size(n) + 1);
+  size_t len = hex_encode(text, n);
+  Sha256 h;
+  sha256_init(&h);
+  sha256_update(&h, text, len);
+  sha256_final(&h, id);
+  free(text);
+}
+
+/* Writes the first KEY_ID hex digits of the id of the key with modulus n
+as a null terminated string */
+static void key_id(char id[KEY_ID + 1], mpz_t n) {
+  uint8_t digest[SHA256_SIZE];
+  char hex[2 * SHA256_SIZE + 1];
+  rsa_key_id(digest, n);
+  sha256_hex(hex, digest);
+  memcpy(id, hex, KEY_ID);
+  id[KEY_ID] = '\0';
+}
+
+/* Progress of an encryption or decryption as recorded in its checkpoint
+sidecar: everything before in has been turned into everything before out */
+typedef struct {
+  char mode[16];
+  unsigned flags;
+  char key[KEY_ID + 1];
+  uint64_t size;   /* Size of the input file */
+  int64_t mtime;   /* Modification time of the input file, in seconds */
+  long mtime_ns;   /* and nanoseconds */
+  char prefix[2 * SHA256_SIZE + 1]; /* SHA-256 of the input before in */
+  Sha256 hash;     /* The input hashed so far, up to hashed */
+  uint64_t hashed;
+  int in_fd;
+  uint64_t in;     /* Input offset of the next block */
+  uint64_t out;    /* Output offset of the next block */
+  uint64_t blocks; /* Blocks done */
+  uint64_t tail;   /* Input bytes in the last dense block encrypted */
+  bool enabled;    /* Checkpoints are written */
+  bool failed;     /* Output before a checkpoint couldn't be written */
+  double saved;    /* When the last checkpoint was written, in us */
+} Progress;
+
+static bool progress_read(const char *path, Progress *p) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return false;
+  }
+  int version = 0;
+  unsigned long long size = 0;
+  long long mtime = 0;
+  long mtime_ns = 0;
+  unsigned long long in = 0;
+  unsigned long long out = 0;
+  unsigned long long blocks = 0;
+  unsigned long long tail = 0;
+  bool ok = fscanf(file,
+                   "#rsack %d mode %15s flags %x key %16s size %llu mtime "
+                   "%lld.%ld prefix %64s in %llu out %llu blocks %llu "
+                   "tail %llu",
+                   &version, p->mode, &p->flags, p->key, &size, &mtime,
+                   &mtime_ns, p->prefix, &in, &out, &blocks, &tail) == 12 &&
+            version == RSA_CHECKPOINT_VERSION;
+  fclose(file);
+  p->size = size;
+  p->mtime = mtime;
+  p->mtime_ns = mtime_ns;
+  p->in = in;
+  p->out = out;
+  p->blocks = blocks;
+  p->tail = tail;
+  return ok;
+}
+
+/* Replaces the sidecar with a new one, so that a crash while it is being
+written leaves the previous checkpoint */
+static void progress_write(const char *path, Progress *p) {
+  char *temp = (char *)malloc(strlen(path) + 5);
+  sprintf(temp, "%s.tmp", path);
+  FILE *file = fopen(temp, "w");
+  if (file == NULL) {
+    free(temp);
+    return;
+  }
+  fprintf(file,
+          "#rsack %d\nmode %s\nflags %x\nkey %s\nsize %llu\n"
+          "mtime %lld.%09ld\nprefix %s\nin %llu\nout %llu\nblocks %llu\n"
+          "tail %llu\n",
+          RSA_CHECKPOINT_VERSION, p->mode, p->flags, p->key,
+          (unsigned long long)p->size, (long long)p->mtime, p->mtime_ns,
+          p->prefix, (unsigned long long)p->in,
+          (unsigned long long)p->out, (unsigned long long)p->blocks,
+          (unsigned long long)p->tail);
+  fflush(file);
+  fsync(fileno(file));
+  fclose(file);
+  rename(temp, path);
+  free(temp);
+}
+
+/* Extends the hash of the input up to offset end and writes its digest
+to prefix, returns false if the input couldn't be read that far */
+static bool progress_hash(Progress *p, uint64_t end) {
+  uint8_t *buffer = (uint8_t *)malloc(1 << 20);
+  while (p->hashed < end) {
+    size_t want = end - p->hashed < (1 << 20) ? end - p->hashed : (1 << 20);
+    ssize_t got = pread(p->in_fd, buffer, want, (off_t)p->hashed);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    sha256_update(&p->hash, buffer, (size_t)got);
+    p->hashed += (uint64_t)got;
+  }
+  free(buffer);
+
+  Sha256 copy = p->hash;
+  uint8_t digest[SHA256_SIZE];
+  sha256_final(&copy, digest);
+  sha256_hex(p->prefix, digest);
+  return p->hashed == end;
+}
+
+/* Sets up checkpoints for a run that starts at the current positions of
+infile and outfile, which must both be regular files. When resuming from a
+sidecar that matches the run, moves both files to where it left off and
+returns true in *resumed. Returns false if resuming was asked for and the
+sidecar is for other files, another key or another format, or the input
+has been modified since: its size and modification time must be the same,
+and so must the SHA-256 of everything before the offset resumed from. */
+static bool progress_begin(Progress *p, RsaCheckpoint *ckpt, const char *mode,
+                           unsigned flags, mpz_t n, FILE *infile,
+                           FILE *outfile, bool *resumed) {
+  memset(p, 0, sizeof(*p));
+  *resumed = false;
+  if (ckpt == NULL) {
+    return true;
+  }
+  ckpt->blocks = 0;
+  ckpt->offset = 0;
+  ckpt->rejected = false;
+
+  struct stat in_info;
+  struct stat out_info;
+  p->enabled = fstat(fileno(infile), &in_info) == 0 &&
+               S_ISREG(in_info.st_mode) &&
+               fstat(fileno(outfile), &out_info) == 0 &&
+               S_ISREG(out_info.st_mode) && ftello(infile) >= 0 &&
+               ftello(outfile) >= 0;
+  snprintf(p->mode, sizeof(p->mode), "%s", mode);
+  p->flags = flags;
+  key_id(p->key, n);
+  p->size = p->enabled ? (uint64_t)in_info.st_size : 0;
+  p->mtime = p->enabled ? (int64_t)in_info.st_mtim.tv_sec : 0;
+  p->mtime_ns = p->enabled ? in_info.st_mtim.tv_nsec : 0;
+  p->in_fd = fileno(infile);
+  sha256_init(&p->hash);
+  p->in = p->enabled ? (uint64_t)ftello(infile) : 0;
+  p->out = p->enabled ? (uint64_t)ftello(outfile) : 0;
+  p->saved = now_us();
+
+  Progress saved;
+  if (!ckpt->resume || !progress_read(ckpt->path, &saved)) {
+    if (p->enabled && ftruncate(fileno(outfile), (off_t)p->out) != 0) {
+      p->enabled = false;
+    }
+    return true;
+  }
+  if (!p->enabled || strcmp(saved.mode, p->mode) != 0 ||
+      (strcmp(mode, "encrypt") == 0 && saved.flags != p->flags) ||
+      strcmp(saved.key, p->key) != 0 || saved.size != p->size ||
+      saved.mtime != p->mtime || saved.mtime_ns != p->mtime_ns ||
+      saved.in > saved.size || saved.out > (uint64_t)out_info.st_size ||
+      !progress_hash(p, saved.in) || strcmp(saved.prefix, p->prefix) != 0 ||
+      fseeko(infile, (off_t)saved.in, SEEK_SET) != 0 ||
+      ftruncate(fileno(outfile), (off_t)saved.out) != 0 ||
+      fseeko(outfile, (off_t)saved.out, SEEK_SET) != 0) {
+    ckpt->rejected = true;
+    return false;
+  }
+  saved.enabled = true;
+  saved.saved = p->saved;
+  saved.hash = p->hash;
+  saved.hashed = p->hashed;
+  saved.in_fd = p->in_fd;
+  *p = saved;
+  ckpt->blocks = saved.blocks;
+  ckpt->offset = saved.in;
+  *resumed = true;
+  return true;
+}
+
+/* Writes a checkpoint if the interval has passed since the last one. Every
+block before in has been written, so the writer is drained and the output
+synced before the sidecar says so. Returns the writer to carry on with. */
+static Writer *progress_save(Progress *p, RsaCheckpoint *ckpt, Writer *writer,
+                             FILE *outfile) {
+  if (!p->enabled || now_us() - p->saved < ckpt->interval * 1e6) {
+    return writer;
+  }
+  p->failed = !writer_close(writer) || p->failed;
+  p->out = (uint64_t)ftello(outfile);
+  fdatasync(fileno(outfile));
+  if (!p->failed && progress_hash(p, p->in)) {
+    progress_write(ckpt->path, p);
+  }
+  p->saved = now_us();
+  return writer_open(outfile);
+}
+
+/* Removes the sidecar once the whole file is done */
+static void progress_end(Progress *p, RsaCheckpoint *ckpt) {
+  if (p->enabled) {
+    remove(ckpt->path);
+  }
+}
+
 /* Encrypts the contents of infile to outfile */
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
-  mpz_t m;
-  mpz_t c;
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+  return rsa_encrypt_file_with(infile, outfile, n, e, 0);
+}
+
+/* Encrypts the contents of infile to outfile in the format given by flags */
+bool rsa_encrypt_file_with(FILE *infile, FILE *outfile, mpz_t n, mpz_t e,
+                           uint32_t flags) {
+  return rsa_encrypt_part(infile, UINT64_MAX, outfile, n, e, flags);
+}
+
+/* Encrypts up to length bytes of infile to outfile, with checkpoints if
+ckpt is not NULL */
+static bool encrypt_blocks(FILE *infile, uint64_t length, FILE *outfile,
+                           mpz_t n, mpz_t e, uint32_t flags,
+                           RsaCheckpoint *ckpt) {
+  Progress progress;
+  bool resumed = false;
+  if (!progress_begin(&progress, ckpt, "encrypt", flags, n, infile, outfile,
+                      &resumed)) {
+    return false;
+  }
+
   mpz_t n1;
-  mpz_init_set_ui(c, 0);
-  mpz_init_set_ui(m, 0);
   mpz_init_set(n1, n);
 
   uint64_t k = -1;
@@ -151,44 +638,828 @@ void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
   k = (k - 1) / 8;
 
   size_t bytes_read = 0; /* Variable that holds the bytes read from file*/
+  size_t tail = (size_t)progress.tail; /* Bytes of input in the last block */
 
-  /* Allocates k amount of bytes to block */
-  uint8_t *block = (uint8_t *)calloc(k, sizeof(uint8_t));
+  /* A dense block is every byte below the top bit of n, with no 0xFF
+  prefix; the length of the last block is written after it instead */
+  bool dense = (flags & RSA_DENSE) != 0;
+  size_t width = dense ? (mpz_sizeinbase(n, 2) - 1) / 8 : k - 1;
+
+  /* Allocates k amount of bytes to block, plus one for a dense block */
+  uint8_t *block = (uint8_t *)calloc(k + 1, sizeof(uint8_t));
+  uint8_t *payload = dense ? block : block + 1;
   block[0] = 255;
 
+  /* Every block shares n and e, so up to MONT_LANES blocks are gathered
+  and exponentiated together. Blocks are loaded into the lanes straight
+  from their bytes. */
+  MontCtx ctx;
+  mont_init(&ctx, n, e);
+  mpz_t cipher[MONT_LANES];
+  for (int i = 0; i < MONT_LANES; i++) {
+    mpz_init(cipher[i]);
+  }
+  size_t count = 0;
+  Source source;
+  source_open(&source, infile, flags, length);
+  Writer *writer = writer_open(outfile);
+  char *line = (char *)malloc(hex_size(n) + 2);
+
+  if (flags != 0 && !resumed) {
+    char header[32];
+    int length = snprintf(header, sizeof(header), "#rsaf %d %x\n",
+                          RSA_FILE_VERSION, (unsigned)flags);
+    writer_write(writer, header, (size_t)length);
+  }
+
   /* Reads k - 1 bytes or less from infile and writes
   k - 1 bytes or less to outfile */
-  while ((bytes_read = fread(block + 1, 1, k - 1, infile)) > 0) {
-
-    if (bytes_read == k - 1) {
-      mpz_import(m, k, 1, sizeof(block[0]), 1, 0, block);
-      rsa_encrypt(c, m, e, n);
-      gmp_fprintf(outfile, "%Zx\n", c);
+  while ((bytes_read = source_read(&source, payload, width)) > 0) {
+    tail = bytes_read;
+    if (dense) {
+      memset(block + bytes_read, 0, width - bytes_read);
+      mont_set_bytes(&ctx, count, block, width);
     } else {
-      bytes_read++;
-      mpz_import(m, bytes_read, 1, sizeof(block[0]), 1, 0, block);
-      rsa_encrypt(c, m, e, n);
-      gmp_fprintf(outfile, "%Zx", c);
-      gmp_fprintf(outfile, "\n");
+      mont_set_bytes(&ctx, count, block, bytes_read + 1);
+    }
+    count++;
+
+    if (count == MONT_LANES) {
+      write_batch(&ctx, writer, line, cipher, count);
+      progress.blocks += count;
+      progress.in = (uint64_t)reader_tell(source.reader);
+      progress.tail = tail;
+      count = 0;
+      writer = progress_save(&progress, ckpt, writer, outfile);
     }
   }
 
+  /* Writes the partial batch left at the end of the file */
+  if (count > 0) {
+    write_batch(&ctx, writer, line, cipher, count);
+  }
+
+  if (dense) {
+    char trailer[32];
+    int length = snprintf(trailer, sizeof(trailer), "#tail %zu\n", tail);
+    writer_write(writer, trailer, (size_t)length);
+  }
+
+  source_close(&source);
+  bool ok = writer_close(writer) && !progress.failed;
+  if (ok) {
+    progress_end(&progress, ckpt);
+  }
+  free(line);
+  for (int i = 0; i < MONT_LANES; i++) {
+    mpz_clear(cipher[i]);
+  }
+  mont_clear(&ctx);
   free(block);
-  mpz_clear(c);
-  mpz_clear(m);
   mpz_clear(n1);
+  return ok;
+}
+
+/* Encrypts the contents of infile to outfile with checkpoints */
+bool rsa_encrypt_file_resumable(FILE *infile, FILE *outfile, mpz_t n,
+                                mpz_t e, uint32_t flags, RsaCheckpoint *ckpt) {
+  return encrypt_blocks(infile, UINT64_MAX, outfile, n, e, flags,
+                        (flags & ~RSA_DENSE) == 0 ? ckpt : NULL);
+}
+
+/* Encrypts up to length bytes of infile to outfile */
+bool rsa_encrypt_part(FILE *infile, uint64_t length, FILE *outfile, mpz_t n,
+                      mpz_t e, uint32_t flags) {
+  return encrypt_blocks(infile, length, outfile, n, e, flags, NULL);
+}
+
+/* Input is read in pieces of this size in stream mode, taking whatever
+has arrived rather than waiting for the whole piece */
+#define STREAM_BUFFER (1 << 16)
+
+/* Latencies of the messages of a stream, in microseconds */
+typedef struct {
+  double *us;
+  size_t count;
+  size_t cap;
+} Latencies;
+
+static void latencies_add(Latencies *l, double us) {
+  if (l->count == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 256;
+    l->us = (double *)realloc(l->us, l->cap * sizeof(double));
+  }
+  l->us[l->count++] = us;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Fills in stats, if wanted, and frees the latencies */
+static void latencies_report(Latencies *l, RsaStreamStats *stats) {
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(*stats));
+    stats->messages = l->count;
+    if (l->count > 0) {
+      qsort(l->us, l->count, sizeof(double), compare_double);
+      double total = 0;
+      for (size_t i = 0; i < l->count; i++) {
+        total += l->us[i];
+      }
+      stats->mean_us = total / l->count;
+      stats->p50_us = l->us[l->count / 2];
+      stats->p99_us = l->us[(l->count * 99) / 100];
+      stats->max_us = l->us[l->count - 1];
+    }
+  }
+  free(l->us);
+}
+
+/* Returns k, the width of a block in the original format: a 0xFF prefix
+and k - 1 bytes of input */
+static size_t block_width(mpz_t n) { return (mpz_sizeinbase(n, 2) - 2) / 8; }
+
+/* The blocks of the message being encrypted in stream mode */
+typedef struct {
+  MontCtx ctx;
+  mpz_t cipher[MONT_LANES];
+  size_t count;   /* Lanes loaded */
+  uint8_t *block; /* 0xFF prefix and input of the block being filled */
+  size_t k;
+  size_t fill;    /* Bytes of input in block */
+  Writer *writer;
+  char *line;
+} StreamEncoder;
+
+/* Loads the block being filled into a lane, exponentiating and writing
+the lanes once they are all loaded */
+static void stream_load(StreamEncoder *s) {
+  mont_set_bytes(&s->ctx, s->count++, s->block, s->fill + 1);
+  s->fill = 0;
+  if (s->count == MONT_LANES) {
+    write_batch(&s->ctx, s->writer, s->line, s->cipher, s->count);
+    s->count = 0;
+  }
+}
+
+/* Adds input to the message being encrypted */
+static void stream_add(StreamEncoder *s, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    size_t take = s->k - 1 - s->fill;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(s->block + 1 + s->fill, buf, take);
+    s->fill += take;
+    buf += take;
+    len -= take;
+    if (s->fill == s->k - 1) {
+      stream_load(s);
+    }
+  }
+}
+
+/* Writes the rest of the message and its end marker, and flushes them */
+static void stream_end(StreamEncoder *s) {
+  if (s->fill > 0) {
+    stream_load(s);
+  }
+  if (s->count > 0) {
+    write_batch(&s->ctx, s->writer, s->line, s->cipher, s->count);
+    s->count = 0;
+  }
+  writer_write(s->writer, "#end\n", 5);
+  writer_flush(s->writer);
+}
+
+/* Encrypts each message of infile to outfile as soon as it arrives */
+bool rsa_encrypt_stream(FILE *infile, FILE *outfile, mpz_t n, mpz_t e,
+                        uint32_t flags, RsaStreamStats *stats) {
+  bool framed = (flags & RSA_FRAMED) != 0;
+  StreamEncoder s;
+  memset(&s, 0, sizeof(s));
+  mont_init(&s.ctx, n, e);
+  for (int i = 0; i < MONT_LANES; i++) {
+    mpz_init(s.cipher[i]);
+  }
+  s.k = block_width(n);
+  s.block = (uint8_t *)calloc(s.k, sizeof(uint8_t));
+  s.block[0] = 255;
+  s.writer = writer_open(outfile);
+  s.line = (char *)malloc(hex_size(n) + 2);
+
+  Reader *reader = reader_open(infile);
+  uint8_t *input = (uint8_t *)malloc(STREAM_BUFFER);
+  Latencies latencies = {NULL, 0, 0};
+
+  char header[32];
+  int length = snprintf(header, sizeof(header), "#rsaf %d %x\n",
+                        RSA_FILE_VERSION,
+                        (unsigned)(RSA_STREAM | (flags & RSA_FRAMED)));
+  writer_write(s.writer, header, (size_t)length);
+  writer_flush(s.writer);
+
+  bool pending = false; /* A message has started but not ended */
+  uint8_t prefix[4];    /* Length of the next framed message */
+  size_t prefix_len = 0;
+  size_t remaining = 0; /* Bytes of the framed message still to come */
+  size_t got;
+
+  while ((got = reader_read_some(reader, input, STREAM_BUFFER)) > 0) {
+    double arrived = now_us();
+    size_t i = 0;
+    while (i < got) {
+      size_t take = got - i;
+      bool ends = false;
+
+      if (framed && !pending) {
+        prefix[prefix_len++] = input[i++];
+        if (prefix_len < sizeof(prefix)) {
+          continue;
+        }
+        prefix_len = 0;
+        remaining = get32(prefix);
+        pending = true;
+        take = 0;
+        ends = remaining == 0;
+      } else if (framed) {
+        if (take >= remaining) {
+          take = remaining;
+          ends = true;
+        }
+        remaining -= take;
+      } else {
+        uint8_t *newline = (uint8_t *)memchr(input + i, '\n', take);
+        if (newline != NULL) {
+          take = (size_t)(newline - (input + i)) + 1;
+          ends = true;
+        }
+        pending = true;
+      }
+
+      stream_add(&s, input + i, take);
+      i += take;
+      if (ends) {
+        stream_end(&s);
+        latencies_add(&latencies, now_us() - arrived);
+        pending = false;
+      }
+    }
+  }
+
+  /* A last line without a newline is still a message, but a framed
+  message cut short is not */
+  bool ok = !framed || (!pending && prefix_len == 0);
+  if (pending && !framed) {
+    stream_end(&s);
+    latencies_add(&latencies, 0);
+  }
+
+  latencies_report(&latencies, stats);
+  reader_close(reader);
+  ok = writer_close(s.writer) && ok;
+  free(input);
+  free(s.line);
+  free(s.block);
+  for (int i = 0; i < MONT_LANES; i++) {
+    mpz_clear(s.cipher[i]);
+  }
+  mont_clear(&s.ctx);
+  return ok;
+}
+
+/* Encrypts one chunk into text as lines of hex, one block per line in the
+original format, and returns the length of the text. Lines are at most
+line_size characters long. */
+static size_t encrypt_chunk(MontCtx *ctx, mpz_t cipher[], uint8_t *block,
+                            size_t k, size_t line_size, const uint8_t *chunk,
+                            size_t len, char **text, size_t *cap) {
+  size_t blocks = (len + k - 2) / (k - 1);
+  size_t need = blocks * line_size;
+  if (need > *cap) {
+    *cap = need;
+    *text = (char *)realloc(*text, need);
+  }
+
+  size_t used = 0;
+  size_t count = 0;
+  for (size_t offset = 0; offset < len; offset += k - 1) {
+    size_t take = len - offset < k - 1 ? len - offset : k - 1;
+    memcpy(block + 1, chunk + offset, take);
+    mont_set_bytes(ctx, count++, block, take + 1);
+    if (count == MONT_LANES || offset + take == len) {
+      mont_run(ctx, count);
+      for (size_t i = 0; i < count; i++) {
+        mont_get_mpz(ctx, i, cipher[i]);
+        used += hex_encode(*text + used, cipher[i]);
+        (*text)[used++] = '\n';
+      }
+      count = 0;
+    }
+  }
+  return used;
+}
+
+/* Writes the path of a chunk's cache entry, <cache>/<2 digits>/<the rest>,
+into path */
+static void cache_path(char *path, size_t size, const char *cache,
+                       const char *hex) {
+  snprintf(path, size, "%s/%.2s/%s", cache, hex, hex + 2);
+}
+
+/* Reads a cache entry, returns NULL unless it is there and holds exactly
+blocks lines of hex */
+static char *cache_load(const char *path, size_t blocks, size_t *len) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  struct stat info;
+  char *text = NULL;
+  if (fstat(fileno(file), &info) == 0 && info.st_size > 0) {
+    text = (char *)malloc((size_t)info.st_size);
+    *len = fread(text, 1, (size_t)info.st_size, file);
+  }
+  fclose(file);
+
+  size_t lines = 0;
+  bool ok = text != NULL && *len == (size_t)info.st_size &&
+            text[*len - 1] == '\n';
+  for (size_t i = 0; ok && i < *len; i++) {
+    lines += text[i] == '\n';
+    ok = text[i] == '\n' || hex_digit(text[i]);
+  }
+  if (!ok || lines != blocks) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/* Adds a cache entry, writing it under a temporary name first so that a
+reader never sees half of it */
+static void cache_store(const char *path, const char *text, size_t len) {
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char *slash = strrchr(dir, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+    mkdir(dir, 0700);
+  }
+
+  char temp[4096];
+  snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+  FILE *file = fopen(temp, "wb");
+  if (file == NULL) {
+    return;
+  }
+  bool ok = fwrite(text, 1, len, file) == len;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temp, path) != 0) {
+    unlink(temp);
+  }
+}
+
+/* Encrypts the chunks of infile that are not in the cache */
+bool rsa_encrypt_incremental(FILE *infile, FILE *outfile, mpz_t n, mpz_t e,
+                             const char *cache, RsaChunkStats *stats) {
+  size_t k = block_width(n);
+  uint8_t *block = (uint8_t *)calloc(k, sizeof(uint8_t));
+  block[0] = 255;
+  MontCtx ctx;
+  mont_init(&ctx, n, e);
+  mpz_t cipher[MONT_LANES];
+  for (int i = 0; i < MONT_LANES; i++) {
+    mpz_init(cipher[i]);
+  }
+
+  /* Chunks are named by a hash that starts with the public key, so one
+  cache can serve several keys */
+  Sha256 keyed;
+  sha256_init(&keyed);
+  char *key = (char *)malloc(hex_size(n) + hex_size(e) + 2);
+  size_t key_len = hex_encode(key, n);
+  key[key_len++] = '\n';
+  key_len += hex_encode(key + key_len, e);
+  key[key_len++] = '\n';
+  sha256_update(&keyed, key, key_len);
+  free(key);
+
+  Reader *reader = reader_open(infile);
+  Writer *writer = writer_open(outfile);
+  uint8_t *input = (uint8_t *)malloc(2 * CDC_MAX);
+  size_t have = 0;
+  bool eof = false;
+  char *text = NULL;
+  size_t cap = 0;
+  size_t path_size = strlen(cache) + 2 * SHA256_SIZE + 32;
+  char *path = (char *)malloc(path_size);
+  RsaChunkStats totals = {0, 0, 0, 0};
+  mkdir(cache, 0700);
+
+  char header[32];
+  int length = snprintf(header, sizeof(header), "#rsaf %d %x\n",
+                        RSA_FILE_VERSION, (unsigned)RSA_CHUNKED);
+  writer_write(writer, header, (size_t)length);
+
+  while (true) {
+    /* Keeps at least CDC_MAX bytes ahead so every cut can be found */
+    if (!eof && have < CDC_MAX) {
+      size_t want = 2 * CDC_MAX - have;
+      size_t got = reader_read(reader, input + have, want);
+      eof = got < want;
+      have += got;
+    }
+    if (have == 0) {
+      break;
+    }
+
+    size_t len = cdc_cut(input, have);
+    Sha256 h = keyed;
+    uint8_t digest[SHA256_SIZE];
+    char hex[2 * SHA256_SIZE + 1];
+    sha256_update(&h, input, len);
+    sha256_final(&h, digest);
+    sha256_hex(hex, digest);
+    writer_write(writer, "@", 1);
+    writer_write(writer, hex, 2 * SHA256_SIZE);
+    writer_write(writer, "\n", 1);
+
+    cache_path(path, path_size, cache, hex);
+    size_t text_len = 0;
+    char *cached = cache_load(path, (len + k - 2) / (k - 1), &text_len);
+    if (cached != NULL) {
+      writer_write(writer, cached, text_len);
+      free(cached);
+      totals.reused++;
+      totals.reused_bytes += len;
+    } else {
+      text_len = encrypt_chunk(&ctx, cipher, block, k, hex_size(n) + 1, input,
+                               len, &text, &cap);
+      writer_write(writer, text, text_len);
+      cache_store(path, text, text_len);
+    }
+    totals.chunks++;
+    totals.bytes += len;
+
+    memmove(input, input + len, have - len);
+    have -= len;
+  }
+
+  if (stats != NULL) {
+    *stats = totals;
+  }
+  reader_close(reader);
+  bool ok = writer_close(writer);
+  free(path);
+  free(text);
+  free(input);
+  for (int i = 0; i < MONT_LANES; i++) {
+    mpz_clear(cipher[i]);
+  }
+  mont_clear(&ctx);
+  free(block);
+  return ok;
+}
+
+/* Bytes of payload on each line of a file for several recipients, and the
+length of the session key the payload is encrypted with */
+#define SHARED_LINE 512
+#define SESSION_KEY 32
+
+/* Returns the most hex digits a value in a cipher file for modulus n can
+have: a block is less than n, and a line of payload for several
+recipients is a 0xFF byte and up to SHARED_LINE bytes */
+static size_t block_digits(mpz_t n) {
+  size_t digits = mpz_sizeinbase(n, 16);
+  return digits > 2 * SHARED_LINE + 2 ? digits : 2 * SHARED_LINE + 2;
+}
+
+/* Writes the "#to" line giving the session key to one recipient. The key
+is split into blocks in the original format, encrypted with the
+recipient's key and written as hex values separated by commas. */
+static void write_recipient(Writer *writer, const uint8_t key[SESSION_KEY],
+                            mpz_t n, mpz_t e, const char *username) {
+  size_t k = block_width(n);
+  uint8_t *block = (uint8_t *)malloc(k);
+  char *line = (char *)malloc(hex_size(n) + 1);
+  char id[KEY_ID + 1];
+  mpz_t m;
+  mpz_t c;
+  mpz_inits(m, c, NULL);
+
+  key_id(id, n);
+  writer_write(writer, "#to ", 4);
+  writer_write(writer, id, KEY_ID);
+  block[0] = 255;
+  for (size_t offset = 0; offset < SESSION_KEY; offset += k - 1) {
+    size_t take = SESSION_KEY - offset < k - 1 ? SESSION_KEY - offset : k - 1;
+    memcpy(block + 1, key + offset, take);
+    mpz_import(m, take + 1, 1, 1, 1, 0, block);
+    rsa_encrypt(c, m, e, n);
+    writer_write(writer, offset == 0 ? " " : ",", 1);
+    writer_write(writer, line, hex_encode(line, c));
+  }
+  writer_write(writer, " ", 1);
+  writer_write(writer, username, strcspn(username, "\r\n"));
+  writer_write(writer, "\n", 1);
+
+  mpz_clears(m, c, NULL);
+  memset(block, 0, k);
+  free(block);
+  free(line);
+}
+
+/* Encrypts infile once under a session key given to every recipient */
+bool rsa_encrypt_shared(FILE *infile, FILE *outfile, size_t count, mpz_t n[],
+                        mpz_t e[], char *usernames[], uint32_t flags) {
+  static const char digits[] = "0123456789abcdef";
+  uint8_t key[SESSION_KEY];
+  randstate_bytes(key, sizeof(key));
+
+  Writer *writer = writer_open(outfile);
+  char header[32];
+  int length = snprintf(header, sizeof(header), "#rsaf %d %x\n",
+                        RSA_FILE_VERSION, (unsigned)(flags | RSA_RECIPIENTS));
+  writer_write(writer, header, (size_t)length);
+  for (size_t i = 0; i < count; i++) {
+    write_recipient(writer, key, n[i], e[i], usernames[i]);
+  }
+
+  /* Each line of payload is a 0xFF byte followed by up to SHARED_LINE
+  bytes of keystream-encrypted plaintext, so that it reads back as a hex
+  value with its leading zero bytes intact */
+  ChaCha cipher;
+  chacha_init(&cipher, key, 0);
+  Source source;
+  source_open(&source, infile, flags, UINT64_MAX);
+  uint8_t data[SHARED_LINE];
+  uint8_t stream[SHARED_LINE];
+  char text[2 * SHARED_LINE + 3];
+  size_t got = 0;
+  while ((got = source_read(&source, data, SHARED_LINE)) > 0) {
+    chacha_bytes(&cipher, stream, got);
+    text[0] = 'f';
+    text[1] = 'f';
+    for (size_t i = 0; i < got; i++) {
+      uint8_t byte = data[i] ^ stream[i];
+      text[2 + 2 * i] = digits[byte >> 4];
+      text[3 + 2 * i] = digits[byte & 15];
+    }
+    text[2 + 2 * got] = '\n';
+    writer_write(writer, text, 3 + 2 * got);
+  }
+
+  source_close(&source);
+  bool ok = writer_close(writer);
+  chacha_clear(&cipher);
+  memset(key, 0, sizeof(key));
+  return ok;
 }
 
 /* Decrypts ciphertext to plaintext m*/
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) { pow_mod(m, c, d, n); }
 
-/* Decrypts the contents of infile to outfile */
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+/* The private key operation of a decryption: blocks are gathered into the
+Montgomery lanes and exponentiated together, or with a CRT context each one
+is exponentiated as soon as it is read, which is what a single small
+ciphertext waits on */
+typedef struct {
+  MontCtx mont;
+  CrtCtx *crt;
+  size_t lanes; /* Blocks gathered before they are exponentiated */
+  mpz_t m;
+} Decryptor;
+
+static void decryptor_init(Decryptor *dec, mpz_t n, mpz_t d, CrtCtx *crt) {
+  dec->crt = crt;
+  dec->lanes = crt != NULL ? 1 : MONT_LANES;
+  mpz_init(dec->m);
+  if (crt == NULL) {
+    mont_init(&dec->mont, n, d);
+  }
+}
+
+static void decryptor_clear(Decryptor *dec) {
+  if (dec->crt == NULL) {
+    mont_clear(&dec->mont);
+  }
+  mpz_clear(dec->m);
+}
+
+static void decryptor_set(Decryptor *dec, size_t lane, mpz_t c) {
+  if (dec->crt != NULL) {
+    crt_powm(dec->crt, dec->m, c);
+  } else {
+    mont_set_mpz(&dec->mont, lane, c);
+  }
+}
+
+static void decryptor_run(Decryptor *dec, size_t count) {
+  if (dec->crt == NULL) {
+    mont_run(&dec->mont, count);
+  }
+}
+
+/* As mont_get_bytes(), except that with CRT nothing is written when the
+value is wider than len */
+static size_t decryptor_get_bytes(Decryptor *dec, size_t lane, uint8_t *bytes,
+                                  size_t len) {
+  if (dec->crt == NULL) {
+    return mont_get_bytes(&dec->mont, lane, bytes, len);
+  }
+  size_t needed = mpz_sgn(dec->m) == 0 ? 0 : mpz_sizeinbase(dec->m, 256);
+  memset(bytes, 0, len);
+  if (needed <= len) {
+    mpz_export(bytes + len - needed, NULL, 1, 1, 1, 0, dec->m);
+  }
+  return needed;
+}
+
+/* Decrypts the messages of a stream, writing and flushing each one when
+its "#end" line arrives. Returns false if the stream has anything but
+blocks and "#end" lines, or ends in the middle of a message. */
+static bool decrypt_stream(HexReader *hex, Writer *writer, Decryptor *dec,
+                           mpz_t n, bool framed, RsaStreamStats *stats) {
+  size_t k = block_width(n);
+  uint8_t *block = (uint8_t *)calloc(k, sizeof(uint8_t));
+  size_t start = framed ? 4 : 0; /* Room for the length in front */
+  size_t cap = 4096;
+  uint8_t *message = (uint8_t *)malloc(cap);
+  size_t len = start;
+  size_t count = 0;
+  bool ok = true;
+  Latencies latencies = {NULL, 0, 0};
+  char line[64];
+  mpz_t c;
+  mpz_init(c);
+
+  while (true) {
+    bool value = hexreader_next(hex, c);
+    if (value) {
+      decryptor_set(dec, count++, c);
+    }
+
+    /* Decrypts the loaded lanes into the message buffer */
+    if (count == dec->lanes || (!value && count > 0)) {
+      decryptor_run(dec, count);
+      for (size_t i = 0; i < count; i++) {
+        if (len + k > cap) {
+          cap = (len + k) * 2;
+          message = (uint8_t *)realloc(message, cap);
+        }
+        size_t j = decryptor_get_bytes(dec, i, block, k);
+        if (j > 0 && j <= k) {
+          memcpy(message + len, block + (k - j) + 1, j - 1);
+          len += j - 1;
+        }
+      }
+      count = 0;
+    }
+    if (value) {
+      continue;
+    }
+
+    double arrived = now_us();
+    if (!hexreader_line(hex, '#', line, sizeof(line))) {
+      ok = len == start;
+      break;
+    }
+    if (strcmp(line, "end") != 0) {
+      ok = false;
+      break;
+    }
+
+    if (framed) {
+      put32(message, (uint32_t)(len - start));
+    }
+    writer_write(writer, message, len);
+    writer_flush(writer);
+    latencies_add(&latencies, now_us() - arrived);
+    len = start;
+  }
+
+  latencies_report(&latencies, stats);
+  mpz_clear(c);
+  free(message);
+  free(block);
+  return ok;
+}
+
+/* Recovers the session key from the wrapped blocks of a "#to" line,
+returns false if they don't decrypt to a key */
+static bool unwrap_key(uint8_t key[SESSION_KEY], char *wrapped, mpz_t n,
+                       mpz_t d, CrtCtx *crt) {
+  size_t k = block_width(n);
+  uint8_t *block = (uint8_t *)malloc(k + 1);
+  size_t have = 0;
+  bool ok = true;
+  mpz_t c;
   mpz_t m;
+  mpz_inits(c, m, NULL);
+
+  char *save = NULL;
+  for (char *value = strtok_r(wrapped, ",", &save); ok && value != NULL;
+       value = strtok_r(NULL, ",", &save)) {
+    size_t len = 0;
+    ok = mpz_set_str(c, value, 16) == 0 && mpz_cmp(c, n) < 0;
+    if (ok && crt != NULL) {
+      crt_powm(crt, m, c);
+    } else if (ok) {
+      rsa_decrypt(m, c, d, n);
+    }
+    if (ok) {
+      ok = mpz_sizeinbase(m, 256) <= k;
+    }
+    if (ok) {
+      mpz_export(block, &len, 1, 1, 1, 0, m);
+      ok = len > 1 && block[0] == 255 && have + len - 1 <= SESSION_KEY;
+    }
+    if (ok) {
+      memcpy(key + have, block + 1, len - 1);
+      have += len - 1;
+    }
+  }
+
+  mpz_clears(c, m, NULL);
+  memset(block, 0, k + 1);
+  free(block);
+  return ok && have == SESSION_KEY;
+}
+
+/* Decrypts a file for several recipients: finds the "#to" line for the
+key with modulus n, recovers the session key from it alone, and decrypts
+the payload. Returns false if no line is for this key or the payload is
+not in the expected form. */
+static bool decrypt_shared(HexReader *hex, Sink *sink, mpz_t n, mpz_t d,
+                           CrtCtx *crt) {
+  char id[KEY_ID + 1];
+  key_id(id, n);
+
+  /* Room for the id and the wrapped key of this key; lines for larger
+  keys are cut short, which only loses their username */
+  size_t size = 2 * KEY_ID + (SESSION_KEY + 1) * (hex_size(n) + 1);
+  char *line = (char *)malloc(size);
+  uint8_t key[SESSION_KEY];
+  bool found = false;
+  bool ok = true;
+  while (hexreader_line(hex, '#', line, size)) {
+    ok = ok && strncmp(line, "to ", 3) == 0;
+    if (ok && !found && strncmp(line + 3, id, KEY_ID) == 0 &&
+        line[3 + KEY_ID] == ' ') {
+      char *wrapped = line + 4 + KEY_ID;
+      wrapped[strcspn(wrapped, " ")] = '\0';
+      found = unwrap_key(key, wrapped, n, d, crt);
+    }
+  }
+  free(line);
+  if (!ok || !found) {
+    return false;
+  }
+
+  ChaCha cipher;
+  chacha_init(&cipher, key, 0);
+  memset(key, 0, sizeof(key));
+  uint8_t data[SHARED_LINE + 1];
+  uint8_t stream[SHARED_LINE];
   mpz_t c;
+  mpz_init(c);
+  while (ok && hexreader_next(hex, c)) {
+    size_t len = 0;
+    ok = mpz_sizeinbase(c, 256) <= sizeof(data);
+    if (ok) {
+      mpz_export(data, &len, 1, 1, 1, 0, c);
+      ok = len > 0 && data[0] == 255;
+    }
+    if (ok) {
+      chacha_bytes(&cipher, stream, len - 1);
+      for (size_t i = 1; i < len; i++) {
+        data[i] ^= stream[i - 1];
+      }
+      sink_write(sink, data + 1, len - 1);
+    }
+  }
+  mpz_clear(c);
+  chacha_clear(&cipher);
+  return ok;
+}
+
+/* Decrypts the contents of infile to outfile, with crt and checkpoints if
+they aren't NULL */
+static bool decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d,
+                         CrtCtx *crt, RsaStreamStats *stats,
+                         RsaCheckpoint *ckpt) {
+  Progress progress;
+  bool resumed = false;
+  if (!progress_begin(&progress, ckpt, "decrypt", 0, n, infile, outfile,
+                      &resumed)) {
+    return false;
+  }
+
   mpz_t n1;
-  mpz_init_set_ui(c, 0);
-  mpz_init_set_ui(m, 0);
   mpz_init_set(n1, n);
 
   uint64_t k = -1;
@@ -201,24 +1472,171 @@ void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
   }
   k = (k - 1) / 8;
 
-  /* Allocates k amount of bytes to block */
-  uint8_t *block = (uint8_t *)calloc(k, sizeof(uint8_t));
+  /* Gathers up to dec.lanes ciphertext blocks to decrypt together */
+  Decryptor dec;
+  decryptor_init(&dec, n, d, crt);
+  mpz_t c;
+  mpz_init(c);
+  size_t count = 0;
+  bool more = true;
+  HexReader *hex = hexreader_open(infile, block_digits(n));
 
-  int j = 0; /* Variable that holds the bytes read from file*/
+  /* Reads the format flags from the header, if there is one; a resumed
+  file starts past it, with its flags in the checkpoint */
+  char header[64];
+  unsigned version = 0;
+  unsigned flags = progress.flags;
+  if (!resumed && hexreader_line(hex, '#', header, sizeof(header)) &&
+      (sscanf(header, "rsaf %u %x", &version, &flags) != 2 ||
+       version > RSA_FILE_VERSION ||
+       (flags & ~(RSA_COMPRESS | RSA_DENSE | RSA_STREAM | RSA_FRAMED |
+                  RSA_CHUNKED | RSA_RECIPIENTS)) != 0 ||
+       ((flags & RSA_CHUNKED) != 0 && flags != RSA_CHUNKED) ||
+       ((flags & RSA_RECIPIENTS) != 0 &&
+        (flags & ~RSA_COMPRESS) != RSA_RECIPIENTS) ||
+       ((flags & RSA_STREAM) != 0 &&
+        (flags & (RSA_COMPRESS | RSA_DENSE)) != 0) ||
+       (flags & (RSA_STREAM | RSA_FRAMED)) == RSA_FRAMED)) {
+    more = false;
+    flags = 0;
+  }
+  bool intact = more;
+  progress.flags = flags;
+  progress.enabled = progress.enabled && (flags & ~RSA_DENSE) == 0;
+  Sink sink;
+  sink_open(&sink, outfile, flags);
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(*stats));
+  }
+
+  /* A stream is a series of messages in the original block format */
+  if (more && (flags & RSA_STREAM) != 0) {
+    intact = decrypt_stream(hex, sink.writer, &dec, n,
+                            (flags & RSA_FRAMED) != 0, stats);
+    more = false;
+  }
+
+  /* A file for several recipients carries its own session key */
+  if (more && (flags & RSA_RECIPIENTS) != 0) {
+    intact = decrypt_shared(hex, &sink, n, d, crt);
+    more = false;
+  }
+
+  /* Dense blocks are all width bytes long except the last, whose length
+  follows it, so each one is held back until the next one arrives */
+  bool dense = (flags & RSA_DENSE) != 0;
+  bool chunked = (flags & RSA_CHUNKED) != 0;
+  size_t width = dense ? (mpz_sizeinbase(n, 2) - 1) / 8 : k;
+  uint8_t *block = (uint8_t *)calloc(width, sizeof(uint8_t));
+  uint8_t *held = dense ? (uint8_t *)calloc(width, sizeof(uint8_t)) : NULL;
+  bool holding = false;
+  off_t starts[MONT_LANES]; /* Input offset of each block in the lanes */
+  off_t held_start = 0;
 
   /* Scans a block of bytes from infile with a hex string and writes
   k - 1 bytes to outfile */
-  while ((j = gmp_fscanf(infile, "%Zx\n", c)) > 0) {
-    rsa_decrypt(m, c, d, n);
-    mpz_export(block, &k, 1, sizeof(uint8_t), 1, 0, m);
-    j = k;
-    fwrite(block + 1, 1, j - 1, outfile);
+  while (more) {
+    starts[count] = hexreader_tell(hex);
+    more = hexreader_next(hex, c);
+
+    /* The "@<sha256>" line in front of each chunk is only a name */
+    while (!more && chunked &&
+           hexreader_line(hex, '@', header, sizeof(header))) {
+      more = hexreader_next(hex, c);
+    }
+    if (more) {
+      decryptor_set(&dec, count, c);
+      count++;
+    }
+
+    if (count == dec.lanes || (!more && count > 0)) {
+      decryptor_run(&dec, count);
+      for (size_t i = 0; i < count; i++) {
+        size_t j = decryptor_get_bytes(&dec, i, block, width);
+        if (dense) {
+          if (j > width) {
+            intact = false;
+            continue;
+          }
+          if (holding) {
+            sink_write(&sink, held, width);
+            progress.blocks++;
+          }
+          uint8_t *swap = held;
+          held = block;
+          block = swap;
+          holding = true;
+          held_start = starts[i];
+          continue;
+        }
+
+        /* Each block is stored k bytes wide; the 0xFF prefix is the first
+        significant byte. A block with no prefix, or wider than k bytes,
+        was not made by rsa_encrypt_file() and is skipped. */
+        if (j > 0 && j <= k) {
+          sink_write(&sink, block + (k - j) + 1, j - 1);
+        }
+        progress.blocks++;
+      }
+      count = 0;
+
+      /* A held dense block is done again after resuming, since whether it
+      is the last one is not known yet */
+      progress.in = (uint64_t)(holding ? held_start : hexreader_tell(hex));
+      sink.writer = progress_save(&progress, ckpt, sink.writer, outfile);
+    }
   }
 
-  free(block);
+  /* Writes as much of the last dense block as the trailer says it holds */
+  if (dense && intact) {
+    size_t tail = 0;
+    if (hexreader_line(hex, '#', header, sizeof(header)) &&
+        sscanf(header, "tail %zu", &tail) == 1 && tail <= width &&
+        (holding || tail == 0)) {
+      if (holding) {
+        sink_write(&sink, held, tail);
+      }
+    } else {
+      intact = false;
+    }
+  }
+
+  intact = intact && !hexreader_oversized(hex);
+  hexreader_close(hex);
+  bool ok = sink_close(&sink) && intact && !progress.failed;
+  if (ok) {
+    progress_end(&progress, ckpt);
+  }
   mpz_clear(c);
-  mpz_clear(m);
+  decryptor_clear(&dec);
+  free(block);
+  free(held);
   mpz_clear(n1);
+  return ok;
+}
+
+/* Decrypts the contents of infile to outfile */
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+  return rsa_decrypt_file_with(infile, outfile, n, d, NULL);
+}
+
+/* Decrypts the contents of infile to outfile, timing stream messages */
+bool rsa_decrypt_file_with(FILE *infile, FILE *outfile, mpz_t n, mpz_t d,
+                           RsaStreamStats *stats) {
+  return decrypt_file(infile, outfile, n, d, NULL, stats, NULL);
+}
+
+/* Decrypts the contents of infile to outfile a block at a time with CRT */
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t d,
+                          CrtCtx *crt, RsaStreamStats *stats) {
+  return decrypt_file(infile, outfile, n, d, crt, stats, NULL);
+}
+
+/* Decrypts the contents of infile to outfile with checkpoints */
+bool rsa_decrypt_file_resumable(FILE *infile, FILE *outfile, mpz_t n,
+                                mpz_t d, CrtCtx *crt, RsaStreamStats *stats,
+                                RsaCheckpoint *ckpt) {
+  return decrypt_file(infile, outfile, n, d, crt, stats, ckpt);
 }
 
 /* Calculates signature */
@@ -229,7 +1647,13 @@ bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
   mpz_t t;
   mpz_init_set_ui(t, 0);
 
-  pow_mod(t, s, e, n);
+  /* A public exponent that fits in a machine word only needs a handful of
+  squarings, which GMP does without the generic exponent loop */
+  if (mpz_fits_ulong_p(e)) {
+    mpz_powm_ui(t, s, mpz_get_ui(e), n);
+  } else {
+    pow_mod(t, s, e, n);
+  }
 
   if (mpz_cmp(t, m) == 0) {
     mpz_clear(t);
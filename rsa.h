@@ -1,4 +1,6 @@
 #pragma once
+#include "crt.h"
+#include "sha256.h"
 #include <stdio.h>
 #include <gmp.h>
 #include <math.h>
@@ -21,6 +23,29 @@
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits,
                   uint64_t iters);
 
+//
+// Draws the number of bits rsa_make_pub() gives p for a modulus of nbits
+// bits, at random from the range [nbits / 4, 3 * nbits / 4). q gets the
+// remaining nbits minus that many bits.
+// The random state must be initialized.
+//
+// nbits: the number of bits of the modulus.
+//
+uint64_t rsa_prime_bits(uint64_t nbits);
+
+//
+// Generates the rest of a public RSA key from primes chosen beforehand,
+// such as primes drawn from a prime pool.
+// All mpz_t arguments are expected to be initialized.
+//
+// p: the first large prime.
+// q: the second large prime.
+// n: will store the product of p and q.
+// e: will store the public exponent.
+// nbits: the number of bits of random numbers tried for e.
+//
+void rsa_make_pub_from(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits);
+
 //
 // Writes a public RSA key to a file.
 // Public key contents: n, e, signature, username.
@@ -46,6 +71,16 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 //
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
+//
+// Writes the id of a public key, the SHA-256 of n in lowercase hex.
+// Keyrings use all of it; "#to" lines of shared files use its first
+// 16 hex digits.
+//
+// id: will store the SHA256_SIZE bytes of the id.
+// n: the public modulus.
+//
+void rsa_key_id(uint8_t id[SHA256_SIZE], mpz_t n);
+
 //
 // Generates the components for a new private RSA key.
 // Requires an accompanying RSA public key to complete the pair.
@@ -78,6 +113,31 @@ void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
 // d: will store the private key.
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
+//
+// Writes the prime factors of n to a private key file, after the lines
+// written by rsa_write_priv(). rsa_read_priv() ignores them; they let
+// rsa_decrypt_file_crt() decrypt by the Chinese remainder theorem.
+// All mpz_t arguments are expected to be initialized.
+//
+// p: the first large prime.
+// q: the second large prime.
+// pvfile: the file to write the factors to.
+//
+void rsa_write_priv_factors(mpz_t p, mpz_t q, FILE *pvfile);
+
+//
+// Reads the prime factors of n following a private key read by
+// rsa_read_priv(). Keys made before the factors were written have none.
+// All mpz_t arguments are expected to be initialized.
+//
+// n: the public modulus.
+// p: will store the first large prime.
+// q: will store the second large prime.
+// pvfile: the file to read, positioned after the private key.
+// returns: false if there are no factors or their product is not n.
+//
+bool rsa_read_priv_factors(mpz_t n, mpz_t p, mpz_t q, FILE *pvfile);
+
 //
 // Encrypts a message given an RSA public exponent and modulus.
 // All mpz_t arguments are expected to be initialized.
@@ -98,8 +158,207 @@ void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 // outfile: the output file to write the encrypted input to.
 // n: the public modulus.
 // e: the public exponent.
+// returns: false if the output couldn't be written.
+//
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+
+//
+// Format flags for rsa_encrypt_file_with(). They are recorded in a header
+// line "#rsaf <version> <flags>" at the start of the ciphertext, which
+// rsa_decrypt_file() reads to undo them. Without flags no header is
+// written and the output is in the original format.
+//
+#define RSA_FILE_VERSION 5
+#define RSA_COMPRESS 0x1 /* Plaintext is compressed in frames before it is
+                            split into blocks */
+#define RSA_DENSE 0x2    /* Blocks use every byte below the top bit of n,
+                            with the length of the last one in a trailer */
+#define RSA_STREAM 0x4   /* Plaintext is a series of messages, each one's
+                            blocks followed by an "#end" line */
+#define RSA_FRAMED 0x8   /* With RSA_STREAM, each message is preceded by
+                            its length instead of ending in a newline */
+#define RSA_CHUNKED 0x10 /* Plaintext is cut into content-defined chunks,
+                            each one's blocks after an "@<sha256>" line */
+#define RSA_RECIPIENTS 0x20 /* Plaintext is encrypted once with a random
+                               session key, which follows the header in a
+                               "#to" line for each recipient */
+
+//
+// Encrypts an entire file like rsa_encrypt_file(), with format flags.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// n: the public modulus.
+// e: the public exponent.
+// flags: any of RSA_COMPRESS and RSA_DENSE, or 0.
+// returns: false if the output couldn't be written.
+//
+bool rsa_encrypt_file_with(FILE *infile, FILE *outfile, mpz_t n, mpz_t e,
+                           uint32_t flags);
+
+//
+// Encrypts part of a file, from its current position, like
+// rsa_encrypt_file_with(). The file is left positioned after the part if
+// it is seekable.
+//
+// infile: the input file to encrypt.
+// length: the most bytes to encrypt; fewer are encrypted at end of file.
+// outfile: the output file to write the encrypted part to.
+// n: the public modulus.
+// e: the public exponent.
+// flags: any of RSA_COMPRESS and RSA_DENSE, or 0.
+// returns: false if the output couldn't be written.
 //
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+bool rsa_encrypt_part(FILE *infile, uint64_t length, FILE *outfile, mpz_t n,
+                      mpz_t e, uint32_t flags);
+
+//
+// Latency of the messages of a stream: the time from the arrival of the
+// input that completes a message to the flush of its output.
+//
+typedef struct {
+  size_t messages;
+  double mean_us;
+  double p50_us;
+  double p99_us;
+  double max_us;
+} RsaStreamStats;
+
+//
+// Encrypts a stream of messages as they arrive, flushing the ciphertext of
+// each one as soon as it is complete instead of waiting for whole blocks.
+// Messages end with a newline, which is part of the message, or with
+// RSA_FRAMED each one is a 4-byte length, least significant byte first,
+// followed by that many bytes. The output has a header with RSA_STREAM set.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input to encrypt, such as a pipe.
+// outfile: the output file to write the encrypted messages to.
+// n: the public modulus.
+// e: the public exponent.
+// flags: RSA_FRAMED or 0.
+// stats: will store the latency of the messages, or NULL.
+// returns: false if the input ended in the middle of a framed message,
+// which is left without its "#end" line, or the output couldn't be
+// written.
+//
+bool rsa_encrypt_stream(FILE *infile, FILE *outfile, mpz_t n, mpz_t e,
+                        uint32_t flags, RsaStreamStats *stats);
+
+//
+// What rsa_encrypt_incremental() did with the chunks of its input.
+//
+typedef struct {
+  size_t chunks;
+  size_t reused;         /* Chunks copied from the cache */
+  uint64_t bytes;        /* Bytes of plaintext */
+  uint64_t reused_bytes; /* Bytes of plaintext in reused chunks */
+} RsaChunkStats;
+
+//
+// Checkpoints for encrypting or decrypting very large files. Every
+// interval seconds, at the end of a batch of blocks, the output is synced
+// and a sidecar file records how far the input and output have got:
+//
+//   #rsack 2
+//   mode <encrypt|decrypt>
+//   flags <format flags in hex>
+//   key <key id of n>
+//   size <input size>
+//   mtime <input modification time, seconds.nanoseconds>
+//   prefix <SHA-256 of the input before the input offset>
+//   in <input offset>
+//   out <output offset>
+//   blocks <blocks done>
+//   tail <input bytes in the last dense block>
+//
+// A sidecar is only resumed from if the input still has the same size,
+// modification time and prefix hash, so a file changed or replaced since
+// is refused rather than joined to output made from the old one.
+// A run that resumes from the sidecar seeks the input to its input offset,
+// cuts the output back to its output offset and carries on from there.
+// The sidecar is removed once the whole file is done. Only the original
+// and RSA_DENSE formats are checkpointed, and only when both the input and
+// output are regular files.
+//
+#define RSA_CHECKPOINT_VERSION 2
+#define RSA_CHECKPOINT_SECONDS 10
+
+typedef struct {
+  const char *path; /* The sidecar file */
+  bool resume;      /* Continue from the sidecar, if there is one */
+  double interval;  /* Seconds between checkpoints */
+  uint64_t blocks;  /* Will store the blocks done before this run */
+  uint64_t offset;  /* Will store the input offset this run started at */
+  bool rejected;    /* Will store whether the sidecar didn't match the run */
+} RsaCheckpoint;
+
+//
+// Encrypts an entire file like rsa_encrypt_file_with(), writing
+// checkpoints to ckpt->path, or resuming from it when ckpt->resume is set
+// and it exists. outfile must be open for reading and writing, and is cut
+// to the point the encryption starts from.
+//
+// flags: the format flags; with any but RSA_DENSE there are no checkpoints.
+// ckpt: the checkpoint settings.
+// returns: false if the output couldn't be written, or if the sidecar is
+// for another input, key or format, or the files are not regular files,
+// when resuming.
+//
+bool rsa_encrypt_file_resumable(FILE *infile, FILE *outfile, mpz_t n,
+                                mpz_t e, uint32_t flags, RsaCheckpoint *ckpt);
+
+//
+// Encrypts an entire file in chunks, reusing the ciphertext of chunks that
+// were encrypted before. The plaintext is cut with content-defined
+// chunking, and each chunk is looked up in a cache directory by the
+// SHA-256 of the public key and the chunk. Only chunks that are not there
+// are encrypted, and they are added to the cache, so encrypting a file
+// again after a small edit costs RSA work only for the chunks around the
+// edit. The output has a header with RSA_CHUNKED set and holds the blocks
+// of every chunk, so it decrypts without the cache.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// n: the public modulus.
+// e: the public exponent.
+// cache: the cache directory, created if missing.
+// stats: will store the number of chunks and how many were reused, or
+// NULL.
+// returns: false if the output couldn't be written.
+//
+bool rsa_encrypt_incremental(FILE *infile, FILE *outfile, mpz_t n, mpz_t e,
+                             const char *cache, RsaChunkStats *stats);
+
+//
+// Encrypts an entire file once for several recipients. The plaintext is
+// encrypted with ChaCha20 under a random session key, and only the
+// session key is encrypted with each recipient's public key, so the RSA
+// work and the size of the output barely grow with the number of
+// recipients. The output has a header with RSA_RECIPIENTS set, followed by
+// a line "#to <key id> <wrapped key> <username>" for each recipient, where
+// the key id is the start of the SHA-256 of the recipient's n in hex;
+// rsa_decrypt_file() uses it to pick out the line for its own key.
+// The random state must be initialized.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// count: the number of recipients.
+// n: the public modulus of each recipient.
+// e: the public exponent of each recipient.
+// usernames: the username of each recipient, as read by rsa_read_pub().
+// flags: RSA_COMPRESS or 0.
+// returns: false if the output couldn't be written.
+//
+bool rsa_encrypt_shared(FILE *infile, FILE *outfile, size_t count, mpz_t n[],
+                        mpz_t e[], char *usernames[], uint32_t flags);
 
 //
 // Decrypts some ciphertext given an RSA private key and public modulus.
@@ -114,6 +373,7 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
 //
 // Decrypts an entire file given an RSA public modulus and private key.
+// Files with a "#rsaf" header are decoded according to its flags.
 // All mpz_t arguments are expected to be initialized.
 // All FILE * arguments are expected to be properly opened.
 //
@@ -121,8 +381,50 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 // outfile: the output file to write the decrypted input to.
 // n: the public modulus.
 // d: the private key.
+// returns: false if the header names an unsupported format, the
+// compressed data or dense blocks are corrupt, or the output couldn't be
+// written.
+//
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+
+//
+// Decrypts an entire file like rsa_decrypt_file(). When the header has
+// RSA_STREAM set, each message is written and flushed as soon as its
+// "#end" line arrives, with its length in front when RSA_FRAMED is set.
+//
+// stats: will store the latency of the messages of a stream, timed from
+// reading each "#end" line, or NULL.
+// returns: as rsa_decrypt_file(), and false if a stream ends in the
+// middle of a message.
+//
+bool rsa_decrypt_file_with(FILE *infile, FILE *outfile, mpz_t n, mpz_t d,
+                           RsaStreamStats *stats);
+
+//
+// Decrypts an entire file like rsa_decrypt_file_with(), for latency rather
+// than throughput: each block is decrypted by crt_powm() as soon as it is
+// read, instead of waiting for a batch of blocks to fill the lanes.
+//
+// crt: a context made by crt_init() for the same key, or NULL to decrypt
+// as rsa_decrypt_file_with() does.
+// returns: as rsa_decrypt_file_with().
+//
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t d,
+                          CrtCtx *crt, RsaStreamStats *stats);
+
+//
+// Decrypts an entire file like rsa_decrypt_file_crt(), writing checkpoints
+// to ckpt->path, or resuming from it when ckpt->resume is set and it
+// exists. outfile must be open for reading and writing. Files in formats
+// other than the original and RSA_DENSE are decrypted without checkpoints.
+//
+// ckpt: the checkpoint settings.
+// returns: as rsa_decrypt_file(), and false if the sidecar is for another
+// input or key, or the files are not regular files, when resuming.
 //
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+bool rsa_decrypt_file_resumable(FILE *infile, FILE *outfile, mpz_t n,
+                                mpz_t d, CrtCtx *crt, RsaStreamStats *stats,
+                                RsaCheckpoint *ckpt);
 
 //
 // Signs some message given an RSA private key and public modulus.
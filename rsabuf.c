@@ -0,0 +1,198 @@
+#include "rsabuf.h"
+#include "mont.h"
+#include "workqueue.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* What the blocks of a job hold on the way in and out */
+typedef enum { BLOCKS, ENCRYPT_BUFFER, DECRYPT_BUFFER } JobKind;
+
+/* Blocks shared by the threads of one call, handed out a batch of
+MONT_LANES at a time */
+typedef struct {
+  JobKind kind;
+  const uint8_t *in;
+  size_t len; /* Bytes of plaintext, for ENCRYPT_BUFFER */
+  uint8_t *out;
+  size_t *lens; /* Plaintext bytes of each block, for DECRYPT_BUFFER */
+  size_t count;
+  mpz_ptr n;
+  mpz_ptr exp;
+  size_t cipher; /* Bytes in a ciphertext block */
+  size_t plain;  /* Bytes of plaintext in a block */
+  WorkQueue queue; /* One item per block, MONT_LANES at a time */
+} BlockJob;
+
+size_t rsa_cipher_width(mpz_t n) { return (mpz_sizeinbase(n, 2) + 7) / 8; }
+
+size_t rsa_plain_width(mpz_t n) { return (mpz_sizeinbase(n, 2) - 2) / 8 - 1; }
+
+size_t rsa_encrypt_buffer_size(mpz_t n, size_t len) {
+  size_t plain = rsa_plain_width(n);
+  return (len + plain - 1) / plain * rsa_cipher_width(n);
+}
+
+size_t rsa_decrypt_buffer_size(mpz_t n, size_t len) {
+  return len / rsa_cipher_width(n) * rsa_plain_width(n);
+}
+
+/* Loads block i into a lane, returns false if it is not less than n */
+static bool job_load(BlockJob *job, MontCtx *ctx, size_t lane, size_t i,
+                     uint8_t *block, mpz_t value) {
+  if (job->kind == ENCRYPT_BUFFER) {
+    size_t offset = i * job->plain;
+    size_t take = job->len - offset < job->plain ? job->len - offset
+                                                 : job->plain;
+    block[0] = 255;
+    memcpy(block + 1, job->in + offset, take);
+    mont_set_bytes(ctx, lane, block, take + 1);
+    return true;
+  }
+
+  mpz_import(value, job->cipher, 1, 1, 1, 0, job->in + i * job->cipher);
+  if (mpz_cmp(value, job->n) >= 0) {
+    return false;
+  }
+  mont_set_mpz(ctx, lane, value);
+  return true;
+}
+
+/* Stores the result in a lane as block i, returns false if a decrypted
+block is not in the original format */
+static bool job_store(BlockJob *job, MontCtx *ctx, size_t lane, size_t i,
+                      uint8_t *block) {
+  if (job->kind != DECRYPT_BUFFER) {
+    mont_get_bytes(ctx, lane, job->out + i * job->cipher, job->cipher);
+    return true;
+  }
+
+  /* The 0xFF prefix is the first significant byte of the block */
+  size_t k = job->plain + 1;
+  size_t j = mont_get_bytes(ctx, lane, block, k);
+  if (j == 0 || j > k || block[k - j] != 255) {
+    return false;
+  }
+  memcpy(job->out + i * job->plain, block + (k - j) + 1, j - 1);
+  job->lens[i] = j - 1;
+  return true;
+}
+
+/* Thread body: exponentiates batches of blocks until none are left */
+static void *job_worker(void *arg) {
+  BlockJob *job = (BlockJob *)arg;
+  MontCtx ctx;
+  mont_init(&ctx, job->n, job->exp);
+  uint8_t *block = (uint8_t *)malloc(job->cipher + 1);
+  mpz_t value;
+  mpz_init(value);
+  bool ok = true;
+
+  size_t first;
+  size_t count;
+  while (workqueue_take(&job->queue, &first, &count)) {
+    size_t loaded = 0;
+    for (size_t l = 0; l < count; l++) {
+      if (job_load(job, &ctx, loaded, first + l, block, value)) {
+        loaded++;
+      } else {
+        ok = false;
+      }
+    }
+    if (loaded < count) {
+      continue;
+    }
+    mont_run(&ctx, count);
+    for (size_t l = 0; l < count; l++) {
+      ok = job_store(job, &ctx, l, first + l, block) && ok;
+    }
+  }
+
+  if (!ok) {
+    workqueue_fail(&job->queue);
+  }
+  mpz_clear(value);
+  free(block);
+  mont_clear(&ctx);
+  return NULL;
+}
+
+/* Runs a job on up to threads threads, no more than there are batches */
+static bool job_run(BlockJob *job, size_t threads) {
+  workqueue_init(&job->queue, job->count, MONT_LANES);
+  bool ok = workqueue_run(&job->queue, job_worker, job, threads);
+  workqueue_clear(&job->queue);
+  return ok;
+}
+
+static void job_init(BlockJob *job, JobKind kind, mpz_t n, mpz_t exp) {
+  memset(job, 0, sizeof(*job));
+  job->kind = kind;
+  job->n = n;
+  job->exp = exp;
+  job->cipher = rsa_cipher_width(n);
+  job->plain = rsa_plain_width(n);
+}
+
+bool rsa_encrypt_buffer(uint8_t *out, size_t size, size_t *written,
+                        const uint8_t *in, size_t len, mpz_t n, mpz_t e,
+                        size_t threads) {
+  *written = 0;
+  size_t need = rsa_encrypt_buffer_size(n, len);
+  if (size < need) {
+    return false;
+  }
+  BlockJob job;
+  job_init(&job, ENCRYPT_BUFFER, n, e);
+  job.in = in;
+  job.len = len;
+  job.out = out;
+  job.count = (len + job.plain - 1) / job.plain;
+  job_run(&job, threads);
+  *written = need;
+  return true;
+}
+
+bool rsa_decrypt_buffer(uint8_t *out, size_t size, size_t *written,
+                        const uint8_t *in, size_t len, mpz_t n, mpz_t d,
+                        size_t threads) {
+  *written = 0;
+  BlockJob job;
+  job_init(&job, DECRYPT_BUFFER, n, d);
+  if (len % job.cipher != 0 || size < rsa_decrypt_buffer_size(n, len)) {
+    return false;
+  }
+  job.in = in;
+  job.out = out;
+  job.count = len / job.cipher;
+  job.lens = (size_t *)calloc(job.count + 1, sizeof(size_t));
+  bool ok = job_run(&job, threads);
+
+  /* Blocks were written plain bytes apart; a short block closes the gap */
+  size_t total = 0;
+  for (size_t i = 0; ok && i < job.count; i++) {
+    memmove(out + total, out + i * job.plain, job.lens[i]);
+    total += job.lens[i];
+  }
+  free(job.lens);
+  *written = ok ? total : 0;
+  return ok;
+}
+
+bool rsa_encrypt_blocks(uint8_t *out, const uint8_t *in, size_t count,
+                        mpz_t n, mpz_t e, size_t threads) {
+  BlockJob job;
+  job_init(&job, BLOCKS, n, e);
+  job.in = in;
+  job.out = out;
+  job.count = count;
+  return job_run(&job, threads);
+}
+
+bool rsa_decrypt_blocks(uint8_t *out, const uint8_t *in, size_t count,
+                        mpz_t n, mpz_t d, size_t threads) {
+  return rsa_encrypt_blocks(out, in, count, n, d, threads);
+}
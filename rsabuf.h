@@ -0,0 +1,108 @@
+#pragma once
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// In-memory encryption for programs that link librsa instead of running
+// encrypt and decrypt. Nothing is read from or written to files, and every
+// output goes to a buffer the caller provides.
+//
+// A ciphertext block is rsa_cipher_width(n) bytes, most significant byte
+// first. A buffer is encrypted as in the original file format: it is cut
+// into pieces of rsa_plain_width(n) bytes (the last may be shorter), and
+// each piece with a 0xFF byte in front is one block. The ciphertext of a
+// buffer is its blocks one after the other, without the hex and newlines
+// of a cipher file.
+//
+// Blocks are spread over threads, MONT_LANES at a time; a thread count of
+// 0 means one thread per CPU. Every call is independent, so several
+// threads may call these at once.
+//
+
+//
+// Returns the number of bytes in a ciphertext block for modulus n.
+//
+size_t rsa_cipher_width(mpz_t n);
+
+//
+// Returns the number of plaintext bytes carried by each block for
+// modulus n.
+//
+size_t rsa_plain_width(mpz_t n);
+
+//
+// Returns the room needed for the ciphertext of len bytes of plaintext.
+//
+size_t rsa_encrypt_buffer_size(mpz_t n, size_t len);
+
+//
+// Returns the room needed for the plaintext of len bytes of ciphertext.
+//
+size_t rsa_decrypt_buffer_size(mpz_t n, size_t len);
+
+//
+// Encrypts a buffer.
+// All mpz_t arguments are expected to be initialized.
+//
+// out: will store the ciphertext.
+// size: the room in out.
+// written: will store the number of bytes of ciphertext.
+// in: the plaintext.
+// len: the number of bytes of plaintext.
+// n: the public modulus.
+// e: the public exponent.
+// threads: the number of threads to use, or 0 for one per CPU.
+// returns: false, writing nothing, if size is less than
+// rsa_encrypt_buffer_size().
+//
+bool rsa_encrypt_buffer(uint8_t *out, size_t size, size_t *written,
+                        const uint8_t *in, size_t len, mpz_t n, mpz_t e,
+                        size_t threads);
+
+//
+// Decrypts a buffer made by rsa_encrypt_buffer().
+// All mpz_t arguments are expected to be initialized.
+//
+// out: will store the plaintext.
+// size: the room in out.
+// written: will store the number of bytes of plaintext.
+// in: the ciphertext.
+// len: the number of bytes of ciphertext.
+// n: the public modulus.
+// d: the private key.
+// threads: the number of threads to use, or 0 for one per CPU.
+// returns: false if size is less than rsa_decrypt_buffer_size(), len is
+// not a whole number of blocks, or a block does not decrypt to a block in
+// the original format.
+//
+bool rsa_decrypt_buffer(uint8_t *out, size_t size, size_t *written,
+                        const uint8_t *in, size_t len, mpz_t n, mpz_t d,
+                        size_t threads);
+
+//
+// Encrypts an array of blocks, each rsa_cipher_width(n) bytes and less
+// than n, into an array of blocks of the same width.
+// All mpz_t arguments are expected to be initialized.
+//
+// out: will store count blocks; may be the same buffer as in.
+// in: count blocks.
+// count: the number of blocks.
+// n: the public modulus.
+// e: the public exponent.
+// threads: the number of threads to use, or 0 for one per CPU.
+// returns: false if a block is not less than n.
+//
+bool rsa_encrypt_blocks(uint8_t *out, const uint8_t *in, size_t count,
+                        mpz_t n, mpz_t e, size_t threads);
+
+//
+// Decrypts an array of blocks like rsa_encrypt_blocks() encrypts them.
+//
+// d: the private key.
+// returns: false if a block is not less than n.
+//
+bool rsa_decrypt_blocks(uint8_t *out, const uint8_t *in, size_t count,
+                        mpz_t n, mpz_t d, size_t threads);
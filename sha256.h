@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+//
+// An incremental SHA-256 hash (FIPS 180-4).
+//
+typedef struct {
+  uint32_t state[8];
+  uint8_t block[64]; /* Input waiting for a full block */
+  size_t fill;       /* Bytes in block */
+  uint64_t length;   /* Bytes hashed so far */
+} Sha256;
+
+//
+// Starts a new hash.
+//
+void sha256_init(Sha256 *h);
+
+//
+// Adds bytes to the hash.
+//
+// h: the hash.
+// data: the bytes.
+// len: the number of bytes.
+//
+void sha256_update(Sha256 *h, const void *data, size_t len);
+
+//
+// Finishes the hash.
+//
+// h: the hash, which must be started again before it is reused.
+// digest: will store the SHA256_SIZE-byte digest.
+//
+void sha256_final(Sha256 *h, uint8_t digest[SHA256_SIZE]);
+
+//
+// Writes a digest as 64 lowercase hexadecimal digits and a null.
+//
+// hex: room for 2 * SHA256_SIZE + 1 characters.
+// digest: the digest.
+//
+void sha256_hex(char *hex, const uint8_t digest[SHA256_SIZE]);
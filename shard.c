@@ -0,0 +1,287 @@
+#include "shard.h"
+#include "rsa.h"
+#include "sha256.h"
+#include "workqueue.h"
+#include <fcntl.h>
+#include <gmp.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define COPY_BUFFER (1 << 16)
+
+/* Hashes a whole file, returns false if it cannot be read */
+static bool hash_file(const char *path, uint8_t digest[SHA256_SIZE]) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return false;
+  }
+
+  uint8_t *buffer = (uint8_t *)malloc(COPY_BUFFER);
+  Sha256 h;
+  sha256_init(&h);
+  size_t got;
+  while ((got = fread(buffer, 1, COPY_BUFFER, file)) > 0) {
+    sha256_update(&h, buffer, got);
+  }
+  bool ok = ferror(file) == 0;
+  sha256_final(&h, digest);
+  fclose(file);
+  free(buffer);
+  return ok;
+}
+
+/* Copies the rest of a file that cannot seek into a temporary file, and
+returns it positioned at the start */
+static FILE *spool(FILE *infile) {
+  FILE *copy = tmpfile();
+  if (copy == NULL) {
+    return NULL;
+  }
+  uint8_t *buffer = (uint8_t *)malloc(COPY_BUFFER);
+  size_t got;
+  while ((got = fread(buffer, 1, COPY_BUFFER, infile)) > 0) {
+    fwrite(buffer, 1, got, copy);
+  }
+  free(buffer);
+  rewind(copy);
+  return copy;
+}
+
+/* Returns the part of path after its last slash */
+static const char *base_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash != NULL ? slash + 1 : path;
+}
+
+bool shard_encrypt(FILE *infile, const char *manifest, size_t shards, mpz_t n,
+                   mpz_t e, uint32_t flags) {
+  FILE *copy = NULL;
+  off_t start = ftello(infile);
+  if (start < 0 || fseeko(infile, 0, SEEK_END) != 0) {
+    copy = spool(infile);
+    if (copy == NULL) {
+      return false;
+    }
+    infile = copy;
+    start = 0;
+    fseeko(infile, 0, SEEK_END);
+  }
+  uint64_t total = (uint64_t)(ftello(infile) - start);
+  uint64_t part = (total + shards - 1) / shards;
+
+  FILE *list = fopen(manifest, "w");
+  bool ok = list != NULL;
+  if (ok) {
+    fprintf(list, "#rsam %d\nplaintext %" PRIu64 "\n", SHARD_MANIFEST_VERSION,
+            total);
+  }
+
+  size_t size = strlen(manifest) + 32;
+  char *path = (char *)malloc(size);
+  uint64_t offset = 0;
+  for (size_t i = 0; ok && i < shards; i++) {
+    uint64_t length = total - offset < part ? total - offset : part;
+    snprintf(path, size, "%s.%zu", manifest, i);
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+      ok = false;
+      break;
+    }
+    fseeko(infile, start + (off_t)offset, SEEK_SET);
+    ok = rsa_encrypt_part(infile, length, out, n, e, flags);
+    ok = fclose(out) == 0 && ok;
+
+    uint8_t digest[SHA256_SIZE];
+    char hex[2 * SHA256_SIZE + 1];
+    ok = ok && hash_file(path, digest);
+    sha256_hex(hex, digest);
+    fprintf(list, "shard %" PRIu64 " %" PRIu64 " %s %s\n", offset, length,
+            hex, base_name(path));
+    offset += length;
+  }
+
+  if (list != NULL && fclose(list) != 0) {
+    ok = false;
+  }
+  if (copy != NULL) {
+    fclose(copy);
+  }
+  free(path);
+  return ok;
+}
+
+/* Reads the two hex digits at hex as a byte, returns -1 if they are not */
+static int hex_byte(const char *hex) {
+  int value = 0;
+  for (int i = 0; i < 2; i++) {
+    char c = hex[i];
+    int digit = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                       : -1;
+    if (digit < 0) {
+      return -1;
+    }
+    value = value * 16 + digit;
+  }
+  return value;
+}
+
+bool manifest_read(const char *path, Manifest *m) {
+  memset(m, 0, sizeof(*m));
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return false;
+  }
+
+  /* Shard names are relative to the manifest's directory */
+  size_t dir_len = (size_t)(base_name(path) - path);
+  char *line = NULL;
+  size_t cap = 0;
+  unsigned version = 0;
+  bool ok = getline(&line, &cap, file) > 0 &&
+            sscanf(line, "#rsam %u", &version) == 1 &&
+            version <= SHARD_MANIFEST_VERSION &&
+            getline(&line, &cap, file) > 0 &&
+            sscanf(line, "plaintext %" SCNu64, &m->plaintext) == 1;
+  m->shards = (Shard *)calloc(MAX_SHARDS, sizeof(Shard));
+
+  uint64_t offset = 0;
+  while (ok && getline(&line, &cap, file) > 0) {
+    Shard *s = &m->shards[m->count];
+    char hex[2 * SHA256_SIZE + 1];
+    int name = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (m->count == MAX_SHARDS ||
+        sscanf(line, "shard %" SCNu64 " %" SCNu64 " %64s %n", &s->offset,
+               &s->length, hex, &name) != 3 ||
+        name == 0 || line[name] == '\0' || strlen(hex) != 2 * SHA256_SIZE ||
+        s->offset != offset) {
+      ok = false;
+      break;
+    }
+    for (int i = 0; i < SHA256_SIZE && ok; i++) {
+      int byte = hex_byte(hex + 2 * i);
+      ok = byte >= 0;
+      s->digest[i] = (uint8_t)byte;
+    }
+
+    size_t name_len = strlen(line + name);
+    s->path = (char *)malloc(dir_len + name_len + 1);
+    memcpy(s->path, path, dir_len);
+    memcpy(s->path + dir_len, line + name, name_len + 1);
+    offset += s->length;
+    m->count++;
+  }
+
+  /* The shards must cover the plaintext exactly */
+  ok = ok && m->count > 0 && offset == m->plaintext;
+  free(line);
+  fclose(file);
+  if (!ok) {
+    manifest_clear(m);
+  }
+  return ok;
+}
+
+void manifest_clear(Manifest *m) {
+  for (size_t i = 0; i < m->count; i++) {
+    free(m->shards[i].path);
+  }
+  free(m->shards);
+  memset(m, 0, sizeof(*m));
+}
+
+/* Returns true if a shard file matches its checksum */
+static bool shard_intact(const Shard *s) {
+  uint8_t digest[SHA256_SIZE];
+  return hash_file(s->path, digest) &&
+         memcmp(digest, s->digest, SHA256_SIZE) == 0;
+}
+
+bool shard_decrypt(const Manifest *m, size_t index, const char *outpath,
+                   mpz_t n, mpz_t d) {
+  if (index >= m->count || !shard_intact(&m->shards[index])) {
+    return false;
+  }
+  const Shard *s = &m->shards[index];
+
+  FILE *in = fopen(s->path, "r");
+  int fd = open(outpath, O_RDWR | O_CREAT, 0666);
+  FILE *out = fd >= 0 ? fdopen(fd, "r+") : NULL;
+  bool ok = in != NULL && out != NULL &&
+            fseeko(out, (off_t)s->offset, SEEK_SET) == 0 &&
+            rsa_decrypt_file(in, out, n, d) &&
+            ftello(out) == (off_t)(s->offset + s->length);
+
+  if (in != NULL) {
+    fclose(in);
+  }
+  if (out != NULL) {
+    ok = fclose(out) == 0 && ok;
+  } else if (fd >= 0) {
+    close(fd);
+  }
+  return ok;
+}
+
+/* Shards shared out among the decrypt threads */
+typedef struct {
+  const Manifest *m;
+  const char *outpath;
+  mpz_ptr n;
+  mpz_ptr d;
+  WorkQueue queue; /* One item per shard */
+} ShardQueue;
+
+/* Thread body: decrypts shards until there are none left */
+static void *shard_worker(void *arg) {
+  ShardQueue *q = (ShardQueue *)arg;
+  size_t index;
+  size_t taken;
+  while (workqueue_take(&q->queue, &index, &taken)) {
+    if (!shard_decrypt(q->m, index, q->outpath, q->n, q->d)) {
+      workqueue_fail(&q->queue);
+    }
+  }
+  return NULL;
+}
+
+bool shard_decrypt_all(const Manifest *m, FILE *outfile, const char *outpath,
+                       mpz_t n, mpz_t d, size_t threads) {
+  /* Output that cannot be written at offsets gets the shards in order */
+  if (outpath == NULL) {
+    bool ok = true;
+    for (size_t i = 0; ok && i < m->count; i++) {
+      FILE *in = shard_intact(&m->shards[i]) ? fopen(m->shards[i].path, "r")
+                                             : NULL;
+      ok = in != NULL && rsa_decrypt_file(in, outfile, n, d);
+      if (in != NULL) {
+        fclose(in);
+      }
+    }
+    return ok;
+  }
+
+  fflush(outfile);
+  if (ftruncate(fileno(outfile), (off_t)m->plaintext) != 0) {
+    return false;
+  }
+
+  ShardQueue q;
+  q.m = m;
+  q.outpath = outpath;
+  q.n = n;
+  q.d = d;
+  workqueue_init(&q.queue, m->count, 1);
+  bool ok =
+      workqueue_run(&q.queue, shard_worker, &q, threads > 0 ? threads : 1);
+  workqueue_clear(&q.queue);
+  return ok;
+}
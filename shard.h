@@ -0,0 +1,102 @@
+#pragma once
+
+#include "sha256.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Sharded ciphertext: the plaintext is cut into contiguous ranges and each
+// range is encrypted to its own shard file, an ordinary cipher file that
+// decrypt can read on its own. A manifest lists the shards:
+//
+//   #rsam 1
+//   plaintext <bytes>
+//   shard <offset> <length> <sha256 of the shard file> <shard file>
+//   ...
+//
+// Offsets and lengths are plaintext byte counts in decimal, and shard file
+// names are relative to the directory of the manifest.
+//
+#define SHARD_MANIFEST_VERSION 1
+#define MAX_SHARDS 4096
+
+typedef struct {
+  char *path;     /* Shard file, resolved against the manifest's directory */
+  uint64_t offset; /* Where its plaintext starts */
+  uint64_t length; /* Bytes of plaintext */
+  uint8_t digest[SHA256_SIZE];
+} Shard;
+
+typedef struct {
+  uint64_t plaintext; /* Total bytes of plaintext */
+  size_t count;
+  Shard *shards;
+} Manifest;
+
+//
+// Encrypts a file into shards, written to <manifest>.<index>, and writes
+// the manifest. Input that cannot seek, such as a pipe, is first copied to
+// a temporary file to find its length.
+// All mpz_t arguments are expected to be initialized.
+//
+// infile: the input file to encrypt, from its current position.
+// manifest: the path of the manifest to write.
+// shards: the number of shards, 1 to MAX_SHARDS.
+// n: the public modulus.
+// e: the public exponent.
+// flags: the format flags for every shard, as for rsa_encrypt_file_with().
+// returns: false if a shard or the manifest could not be written.
+//
+bool shard_encrypt(FILE *infile, const char *manifest, size_t shards, mpz_t n,
+                   mpz_t e, uint32_t flags);
+
+//
+// Reads a manifest.
+//
+// path: the manifest file.
+// m: will store the manifest, to be freed with manifest_clear().
+// returns: false if the file cannot be read or is not a valid manifest.
+//
+bool manifest_read(const char *path, Manifest *m);
+
+//
+// Frees a manifest read with manifest_read().
+//
+void manifest_clear(Manifest *m);
+
+//
+// Checks one shard file against its checksum, then decrypts it into the
+// output file at the shard's offset. Other processes may be writing other
+// shards into the same file at the same time.
+// All mpz_t arguments are expected to be initialized.
+//
+// m: the manifest.
+// index: the shard to decrypt.
+// outpath: the output file, created if missing and never truncated.
+// n: the public modulus.
+// d: the private key.
+// returns: false if the shard is missing, does not match its checksum, or
+// does not decrypt to the length the manifest gives.
+//
+bool shard_decrypt(const Manifest *m, size_t index, const char *outpath,
+                   mpz_t n, mpz_t d);
+
+//
+// Decrypts every shard of a manifest. A regular output file is filled in
+// by up to threads shards at a time; any other output, such as a pipe,
+// gets the shards one after another in order.
+// All mpz_t arguments are expected to be initialized.
+//
+// m: the manifest.
+// outfile: the opened output file.
+// outpath: the path of outfile if it is a regular file, or NULL.
+// n: the public modulus.
+// d: the private key.
+// threads: the most shards to decrypt at once.
+// returns: false if any shard failed, as for shard_decrypt().
+//
+bool shard_decrypt_all(const Manifest *m, FILE *outfile, const char *outpath,
+                       mpz_t n, mpz_t d, size_t threads);
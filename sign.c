@@ -0,0 +1,158 @@
+#include "rsa.h"
+#include "treehash.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "i:o:n:t:vh"
+#define MAX_THREADS 256
+
+static void usage(char *program) {
+  fprintf(stderr, "Usage: %s [options]\n", program);
+  fprintf(stderr, "  %s signs a file with the specified private key file, "
+                  "hashing it with a\n",
+          program);
+  fprintf(stderr, "  tree hash whose leaves are hashed in parallel and "
+                  "signing the root.\n");
+  fprintf(stderr, "    -i <infile> : Sign <infile>. Default: standard "
+                  "input.\n");
+  fprintf(stderr, "    -o <sigfile>: Write the signature to <sigfile>. "
+                  "Default: <infile>.sig,\n");
+  fprintf(stderr, "                  or standard output with standard "
+                  "input.\n");
+  fprintf(stderr, "    -n <pvfile> : Private key is in <pvfile>. Default: "
+                  "rsa.priv.\n");
+  fprintf(stderr, "    -t <threads>: Hash with <threads> threads. Default: "
+                  "number of CPUs.\n");
+  fprintf(stderr, "    -v          : Print the root hash and the hashing "
+                  "rate.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+int main(int argc, char **argv) {
+  int opt = 0;
+  char *input_file = NULL;
+  char *output_file = NULL;
+  char *private_key_file = "rsa.priv";
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool verbose = false;
+
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 'i':
+      input_file = optarg;
+      break;
+    case 'o':
+      output_file = optarg;
+      break;
+    case 'n':
+      private_key_file = optarg;
+      break;
+    case 't':
+      threads = atol(optarg);
+      if (threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "Number of threads must be 1-%d, not %s.\n",
+                MAX_THREADS, optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  /* The signature goes next to the file, where verify looks for it */
+  char *default_signature = NULL;
+  if (output_file == NULL && input_file != NULL) {
+    default_signature = (char *)malloc(strlen(input_file) + 5);
+    sprintf(default_signature, "%s.sig", input_file);
+    output_file = default_signature;
+  }
+
+  FILE *in_file = input_file != NULL ? fopen(input_file, "rb") : stdin;
+  if (in_file == NULL) {
+    fprintf(stderr, "sign: Couldn't open %s to read\n", input_file);
+    return 1;
+  }
+  FILE *pri_file = fopen(private_key_file, "r");
+  if (pri_file == NULL) {
+    fprintf(stderr, "sign: Couldn't open %s to read private key\n",
+            private_key_file);
+    return 1;
+  }
+
+  mpz_t n;
+  mpz_t d;
+  mpz_t m;
+  mpz_t s;
+  mpz_inits(n, d, m, s, NULL);
+  rsa_read_priv(n, d, pri_file);
+  fclose(pri_file);
+  if (!tree_root_fits(n)) {
+    fprintf(stderr, "sign: A %zu-bit key is too small to sign a %d-bit "
+                    "root\n",
+            mpz_sizeinbase(n, 2), 8 * SHA256_SIZE);
+    return 1;
+  }
+
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint8_t root[SHA256_SIZE];
+  uint64_t length = 0;
+  bool ok = tree_hash_file(in_file, (size_t)threads, root, &length);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (!ok) {
+    fprintf(stderr, "sign: Couldn't read the input\n");
+    return 1;
+  }
+
+  tree_root_message(m, root, n);
+  rsa_sign(s, m, d, n);
+
+  FILE *out_file = output_file != NULL ? fopen(output_file, "w") : stdout;
+  if (out_file == NULL) {
+    fprintf(stderr, "sign: Couldn't open %s to write the signature\n",
+            output_file);
+    return 1;
+  }
+  signature_write(out_file, root, length, s);
+
+  if (verbose) {
+    char hex[2 * SHA256_SIZE + 1];
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    sha256_hex(hex, root);
+    fprintf(stderr, "root: %s\n", hex);
+    fprintf(stderr, "bytes: %llu, threads: %ld, hash time: %.3f s, rate: "
+                    "%.1f MB/s\n",
+            (unsigned long long)length, threads, seconds,
+            seconds > 0 ? length / seconds / 1e6 : 0.0);
+  }
+
+  if (out_file != stdout) {
+    fclose(out_file);
+  }
+  if (in_file != stdin) {
+    fclose(in_file);
+  }
+  mpz_clears(n, d, m, s, NULL);
+  free(default_signature);
+  return 0;
+}
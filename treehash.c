@@ -0,0 +1,179 @@
+#include "treehash.h"
+#include "sha256.h"
+#include "workqueue.h"
+#include <ctype.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Leaves shared by the hashing threads, handed out in order */
+typedef struct {
+  int fd;
+  uint64_t length;
+  size_t leaves;
+  uint8_t (*hashes)[SHA256_SIZE];
+  WorkQueue queue; /* One item per leaf */
+} LeafQueue;
+
+static void leaf_hash(uint8_t hash[SHA256_SIZE], const uint8_t *data,
+                      size_t len) {
+  static const uint8_t prefix = 0x00;
+  Sha256 h;
+  sha256_init(&h);
+  sha256_update(&h, &prefix, 1);
+  sha256_update(&h, data, len);
+  sha256_final(&h, hash);
+}
+
+/* Thread body: reads and hashes leaves until there are none left */
+static void *leaf_worker(void *arg) {
+  LeafQueue *q = (LeafQueue *)arg;
+  uint8_t *buffer = (uint8_t *)malloc(TREE_LEAF);
+  size_t index;
+  size_t taken;
+  while (workqueue_take(&q->queue, &index, &taken)) {
+    uint64_t offset = (uint64_t)index * TREE_LEAF;
+    size_t len = q->length - offset < TREE_LEAF ? q->length - offset
+                                                 : TREE_LEAF;
+    size_t total = 0;
+    while (total < len) {
+      ssize_t got = pread(q->fd, buffer + total, len - total,
+                          (off_t)(offset + total));
+      if (got <= 0) {
+        break;
+      }
+      total += (size_t)got;
+    }
+    if (total < len) {
+      workqueue_fail(&q->queue);
+    }
+    leaf_hash(q->hashes[index], buffer, total);
+  }
+  free(buffer);
+  return NULL;
+}
+
+/* Combines a level of hashes into the next until the root is left */
+static void tree_combine(uint8_t (*hashes)[SHA256_SIZE], size_t count,
+                         uint8_t root[SHA256_SIZE]) {
+  static const uint8_t prefix = 0x01;
+  while (count > 1) {
+    size_t next = 0;
+    for (size_t i = 0; i < count; i += 2) {
+      if (i + 1 == count) {
+        memmove(hashes[next++], hashes[i], SHA256_SIZE);
+        break;
+      }
+      Sha256 h;
+      sha256_init(&h);
+      sha256_update(&h, &prefix, 1);
+      sha256_update(&h, hashes[i], 2 * SHA256_SIZE);
+      sha256_final(&h, hashes[next++]);
+    }
+    count = next;
+  }
+  memcpy(root, hashes[0], SHA256_SIZE);
+}
+
+/* Hashes input that can't be read at an offset, one leaf at a time */
+static bool tree_hash_stream(FILE *file, uint8_t root[SHA256_SIZE],
+                             uint64_t *length) {
+  uint8_t *buffer = (uint8_t *)malloc(TREE_LEAF);
+  size_t cap = 16;
+  size_t count = 0;
+  uint8_t (*hashes)[SHA256_SIZE] = malloc(cap * SHA256_SIZE);
+  *length = 0;
+
+  while (true) {
+    size_t len = fread(buffer, 1, TREE_LEAF, file);
+    if (len == 0 && count > 0) {
+      break;
+    }
+    if (count == cap) {
+      cap *= 2;
+      hashes = realloc(hashes, cap * SHA256_SIZE);
+    }
+    leaf_hash(hashes[count++], buffer, len);
+    *length += len;
+    if (len < TREE_LEAF) {
+      break;
+    }
+  }
+
+  bool ok = !ferror(file);
+  tree_combine(hashes, count, root);
+  free(hashes);
+  free(buffer);
+  return ok;
+}
+
+bool tree_hash_file(FILE *file, size_t threads, uint8_t root[SHA256_SIZE],
+                    uint64_t *length) {
+  struct stat info;
+  if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)) {
+    return tree_hash_stream(file, root, length);
+  }
+
+  LeafQueue q;
+  q.fd = fileno(file);
+  q.length = (uint64_t)info.st_size;
+  q.leaves = q.length == 0 ? 1 : (q.length + TREE_LEAF - 1) / TREE_LEAF;
+  q.hashes = malloc(q.leaves * SHA256_SIZE);
+  workqueue_init(&q.queue, q.leaves, 1);
+  bool ok = workqueue_run(&q.queue, leaf_worker, &q, threads);
+
+  tree_combine(q.hashes, q.leaves, root);
+  *length = q.length;
+  workqueue_clear(&q.queue);
+  free(q.hashes);
+  return ok;
+}
+
+bool tree_root_fits(mpz_t n) {
+  return mpz_sizeinbase(n, 2) > 8 * SHA256_SIZE;
+}
+
+bool tree_root_message(mpz_t m, const uint8_t root[SHA256_SIZE], mpz_t n) {
+  mpz_import(m, SHA256_SIZE, 1, 1, 1, 0, root);
+  return tree_root_fits(n);
+}
+
+void signature_write(FILE *out, const uint8_t root[SHA256_SIZE],
+                     uint64_t length, mpz_t s) {
+  char hex[2 * SHA256_SIZE + 1];
+  sha256_hex(hex, root);
+  fprintf(out, "#rsas %d\n", SIGNATURE_VERSION);
+  fprintf(out, "leaf %d\n", TREE_LEAF);
+  fprintf(out, "length %llu\n", (unsigned long long)length);
+  fprintf(out, "root %s\n", hex);
+  gmp_fprintf(out, "%Zx\n", s);
+}
+
+bool signature_read(FILE *in, uint8_t root[SHA256_SIZE], uint64_t *length,
+                    mpz_t s) {
+  int version = 0;
+  int leaf = 0;
+  unsigned long long bytes = 0;
+  char hex[2 * SHA256_SIZE + 1];
+  if (fscanf(in, "#rsas %d leaf %d length %llu root %64s", &version, &leaf,
+             &bytes, hex) != 4 ||
+      version != SIGNATURE_VERSION || leaf != TREE_LEAF ||
+      strlen(hex) != 2 * SHA256_SIZE || gmp_fscanf(in, "%Zx", s) != 1) {
+    return false;
+  }
+  for (int i = 0; i < SHA256_SIZE; i++) {
+    char pair[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+    if (!isxdigit((unsigned char)pair[0]) ||
+        !isxdigit((unsigned char)pair[1])) {
+      return false;
+    }
+    root[i] = (uint8_t)strtoul(pair, NULL, 16);
+  }
+  *length = bytes;
+  return true;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "sha256.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// A tree hash of a file. The file is cut into leaves of TREE_LEAF bytes
+// (the last may be shorter, and an empty file is one empty leaf), each
+// hashed as SHA-256(0x00 || leaf). Pairs of hashes are then combined as
+// SHA-256(0x01 || left || right) level by level, an odd hash at the end
+// of a level moving up as it is, until one root is left. The prefixes keep
+// a leaf from being passed off as a node. Leaves are independent, so they
+// are hashed on several threads at once.
+//
+#define TREE_LEAF (1 << 20)
+
+//
+// Hashes a whole file. A regular file is read from the start with one
+// pread() per leaf, spread over the threads; anything else, such as a
+// pipe, is read and hashed in order from its current position.
+//
+// file: the file to hash.
+// threads: the number of threads to hash leaves with.
+// root: will store the root hash.
+// length: will store the number of bytes hashed.
+// returns: false if the file could not be read.
+//
+bool tree_hash_file(FILE *file, size_t threads, uint8_t root[SHA256_SIZE],
+                    uint64_t *length);
+
+//
+// A file signature, as written by sign and read by verify:
+//
+//   #rsas 1
+//   leaf <TREE_LEAF>
+//   length <bytes>
+//   root <root hash in hex>
+//   <signature in hex>
+//
+// The signature is rsa_sign() of the root, read as a big-endian number.
+// The root must be less than n, or different roots would share a
+// signature, so keys of 8 * SHA256_SIZE bits or fewer can't sign files.
+//
+#define SIGNATURE_VERSION 1
+
+//
+// Returns true if a key with modulus n is wide enough to sign any root.
+//
+bool tree_root_fits(mpz_t n);
+
+//
+// Sets m to the message that is signed for a root hash.
+//
+// m: will store the root as a number.
+// root: the root hash.
+// n: the public modulus.
+// returns: false if n is too small for the root, see tree_root_fits().
+//
+bool tree_root_message(mpz_t m, const uint8_t root[SHA256_SIZE], mpz_t n);
+
+//
+// Writes a file signature.
+//
+// out: the file to write.
+// root: the root hash of the signed file.
+// length: the length of the signed file.
+// s: the signature of the root.
+//
+void signature_write(FILE *out, const uint8_t root[SHA256_SIZE],
+                     uint64_t length, mpz_t s);
+
+//
+// Reads a file signature.
+//
+// in: the file to read.
+// root: will store the root hash.
+// length: will store the length of the signed file.
+// s: will store the signature.
+// returns: false if the file is not a signature this version can check.
+//
+bool signature_read(FILE *in, uint8_t root[SHA256_SIZE], uint64_t *length,
+                    mpz_t s);
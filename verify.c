@@ -0,0 +1,164 @@
+#include "rsa.h"
+#include "treehash.h"
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS "i:s:n:t:vh"
+#define MAX_THREADS 256
+
+static void usage(char *program) {
+  fprintf(stderr, "Usage: %s [options]\n", program);
+  fprintf(stderr, "  %s checks a file against a signature made by sign, "
+                  "using the\n",
+          program);
+  fprintf(stderr, "  specified public key file.\n");
+  fprintf(stderr, "    -i <infile> : Check <infile>. Default: standard "
+                  "input.\n");
+  fprintf(stderr, "    -s <sigfile>: Signature is in <sigfile>. Default: "
+                  "<infile>.sig.\n");
+  fprintf(stderr, "    -n <pbfile> : Public key is in <pbfile>. Default: "
+                  "rsa.pub.\n");
+  fprintf(stderr, "    -t <threads>: Hash with <threads> threads. Default: "
+                  "number of CPUs.\n");
+  fprintf(stderr, "    -v          : Print the signer and the root hash.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+int main(int argc, char **argv) {
+  int opt = 0;
+  char *input_file = NULL;
+  char *signature_file = NULL;
+  char *public_key_file = "rsa.pub";
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool verbose = false;
+
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 'i':
+      input_file = optarg;
+      break;
+    case 's':
+      signature_file = optarg;
+      break;
+    case 'n':
+      public_key_file = optarg;
+      break;
+    case 't':
+      threads = atol(optarg);
+      if (threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "Number of threads must be 1-%d, not %s.\n",
+                MAX_THREADS, optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  /* The signature sits next to the file unless it is named */
+  char *default_signature = NULL;
+  if (signature_file == NULL) {
+    if (input_file == NULL) {
+      fprintf(stderr, "verify: -s is needed when checking standard input\n");
+      usage(argv[0]);
+      return 1;
+    }
+    default_signature = (char *)malloc(strlen(input_file) + 5);
+    sprintf(default_signature, "%s.sig", input_file);
+    signature_file = default_signature;
+  }
+
+  FILE *pub_file = fopen(public_key_file, "r");
+  if (pub_file == NULL) {
+    fprintf(stderr, "verify: Couldn't open %s to read public key\n",
+            public_key_file);
+    return 1;
+  }
+  mpz_t n;
+  mpz_t e;
+  mpz_t s;
+  mpz_t m;
+  mpz_inits(n, e, s, m, NULL);
+  char *username = calloc(10000, sizeof(char));
+  rsa_read_pub(n, e, s, username, pub_file);
+  fclose(pub_file);
+
+  if (!tree_root_fits(n)) {
+    fprintf(stderr, "verify: A %zu-bit key is too small to sign a %d-bit "
+                    "root\n",
+            mpz_sizeinbase(n, 2), 8 * SHA256_SIZE);
+    return 1;
+  }
+
+  /* The key must be the one its owner signed */
+  mpz_set_str(m, username, 62);
+  if (!rsa_verify(m, s, e, n)) {
+    fprintf(stderr, "verify: Couldn't verify user signature in %s\n",
+            public_key_file);
+    return 1;
+  }
+
+  FILE *sig_file = fopen(signature_file, "r");
+  uint8_t signed_root[SHA256_SIZE];
+  uint64_t signed_length = 0;
+  if (sig_file == NULL ||
+      !signature_read(sig_file, signed_root, &signed_length, s)) {
+    fprintf(stderr, "verify: Couldn't read signature %s\n", signature_file);
+    return 1;
+  }
+  fclose(sig_file);
+
+  FILE *in_file = input_file != NULL ? fopen(input_file, "rb") : stdin;
+  if (in_file == NULL) {
+    fprintf(stderr, "verify: Couldn't open %s to read\n", input_file);
+    return 1;
+  }
+  uint8_t root[SHA256_SIZE];
+  uint64_t length = 0;
+  if (!tree_hash_file(in_file, (size_t)threads, root, &length)) {
+    fprintf(stderr, "verify: Couldn't read the input\n");
+    return 1;
+  }
+
+  /* The file must hash to the signed root, and the root must be signed
+  by the key */
+  bool ok = tree_root_message(m, root, n) && length == signed_length &&
+            memcmp(root, signed_root, SHA256_SIZE) == 0 &&
+            rsa_verify(m, s, e, n);
+  if (verbose) {
+    char hex[2 * SHA256_SIZE + 1];
+    sha256_hex(hex, root);
+    fprintf(stderr, "signer: %s", username);
+    fprintf(stderr, "root: %s\n", hex);
+  }
+  if (ok) {
+    printf("verify: Signature is valid\n");
+  } else {
+    fprintf(stderr, "verify: Signature does not match\n");
+  }
+
+  if (in_file != stdin) {
+    fclose(in_file);
+  }
+  free(default_signature);
+  free(username);
+  mpz_clears(n, e, s, m, NULL);
+  return ok ? 0 : 1;
+}
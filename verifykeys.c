@@ -0,0 +1,221 @@
+#include "rsa.h"
+#include "workqueue.h"
+#include <dirent.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "t:vh"
+#define MAX_THREADS 256
+#define USERNAME_SIZE 10000
+
+/* One public key file and the outcome of verifying it */
+typedef struct {
+  char *path;
+  char username[USERNAME_SIZE];
+  int status; /* 1 verified, 0 bad signature, -1 unreadable */
+} KeyCheck;
+
+/* Work shared by the verifier threads */
+typedef struct {
+  KeyCheck *checks;
+  WorkQueue queue; /* One item per key */
+} CheckQueue;
+
+static void usage(char *program) {
+  fprintf(stderr, "Usage: %s [options] <pbfile|directory>...\n", program);
+  fprintf(stderr, "  %s verifies the username signature of many public key "
+                  "files,\n",
+          program);
+  fprintf(stderr, "  reading every .pub file in each given directory.\n");
+  fprintf(stderr, "    -t <threads>: Verify with <threads> threads. Default: "
+                  "number of CPUs.\n");
+  fprintf(stderr, "    -v          : Print passing keys as well as failing "
+                  "ones.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+/* Appends path to the list of keys to check, growing it when full */
+static void add_check(KeyCheck **checks, size_t *count, size_t *capacity,
+                      const char *path) {
+  if (*count == *capacity) {
+    *capacity = *capacity == 0 ? 64 : *capacity * 2;
+    *checks = (KeyCheck *)realloc(*checks, *capacity * sizeof(KeyCheck));
+  }
+  KeyCheck *check = &(*checks)[*count];
+  check->path = strdup(path);
+  check->username[0] = '\0';
+  check->status = -1;
+  *count += 1;
+}
+
+/* Orders keys by path so directory listings give a stable report */
+static int compare_checks(const void *a, const void *b) {
+  return strcmp(((const KeyCheck *)a)->path, ((const KeyCheck *)b)->path);
+}
+
+/* Adds path itself, or every .pub file inside it if it is a directory */
+static void add_path(KeyCheck **checks, size_t *count, size_t *capacity,
+                     const char *path) {
+  struct stat info;
+  if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+    add_check(checks, count, capacity, path);
+    return;
+  }
+
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    add_check(checks, count, capacity, path);
+    return;
+  }
+
+  size_t first = *count;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t length = strlen(entry->d_name);
+    if (length > 4 && strcmp(entry->d_name + length - 4, ".pub") == 0) {
+      char *full = (char *)malloc(strlen(path) + length + 2);
+      sprintf(full, "%s/%s", path, entry->d_name);
+      add_check(checks, count, capacity, full);
+      free(full);
+    }
+  }
+  closedir(dir);
+  qsort(*checks + first, *count - first, sizeof(KeyCheck), compare_checks);
+}
+
+/* Reads one public key and verifies its username signature */
+static void check_key(KeyCheck *check) {
+  FILE *pbfile = fopen(check->path, "r");
+  if (pbfile == NULL) {
+    check->status = -1;
+    return;
+  }
+
+  mpz_t n;
+  mpz_t e;
+  mpz_t s;
+  mpz_t expected_s;
+  mpz_inits(n, e, s, expected_s, NULL);
+
+  rsa_read_pub(n, e, s, check->username, pbfile);
+  fclose(pbfile);
+  check->username[strcspn(check->username, "\n")] = '\0';
+
+  if (mpz_sgn(n) == 0 || check->username[0] == '\0' ||
+      mpz_set_str(expected_s, check->username, 62) != 0) {
+    check->status = -1;
+  } else {
+    check->status = rsa_verify(expected_s, s, e, n) ? 1 : 0;
+  }
+
+  mpz_clears(n, e, s, expected_s, NULL);
+}
+
+/* Thread body: takes keys off the shared queue until none are left */
+static void *verifier(void *arg) {
+  CheckQueue *queue = (CheckQueue *)arg;
+
+  size_t index;
+  size_t taken;
+  while (workqueue_take(&queue->queue, &index, &taken)) {
+    check_key(&queue->checks[index]);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int opt = 0;
+  bool verbose = false;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 't':
+      threads = atol(optarg);
+      if (threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "Number of threads must be 1-%d, not %s.\n",
+                MAX_THREADS, optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  KeyCheck *checks = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  for (int i = optind; i < argc; i++) {
+    add_path(&checks, &count, &capacity, argv[i]);
+  }
+
+  CheckQueue queue;
+  queue.checks = checks;
+  workqueue_init(&queue.queue, count, 1);
+  if ((size_t)threads > count && count > 0) {
+    threads = (long)count;
+  }
+
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  workqueue_run(&queue.queue, verifier, &queue, (size_t)threads);
+  workqueue_clear(&queue.queue);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  /* Prints the report in the order the keys were given */
+  size_t passed = 0;
+  size_t failed = 0;
+  size_t unreadable = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (checks[i].status == 1) {
+      passed++;
+      if (verbose) {
+        printf("PASS %s %s\n", checks[i].path, checks[i].username);
+      }
+    } else if (checks[i].status == 0) {
+      failed++;
+      printf("FAIL %s %s\n", checks[i].path, checks[i].username);
+    } else {
+      unreadable++;
+      printf("ERROR %s: couldn't read public key\n", checks[i].path);
+    }
+    free(checks[i].path);
+  }
+
+  printf("keys: %zu, passed: %zu, failed: %zu, unreadable: %zu\n", count,
+         passed, failed, unreadable);
+  printf("threads: %ld, time: %.3f s, throughput: %.1f keys/s\n", threads,
+         seconds, seconds > 0 ? count / seconds : 0.0);
+
+  free(checks);
+  return failed > 0 || unreadable > 0 ? 1 : 0;
+}
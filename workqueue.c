@@ -0,0 +1,61 @@
+#include "workqueue.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void workqueue_init(WorkQueue *q, size_t count, size_t step) {
+  pthread_mutex_init(&q->lock, NULL);
+  q->count = count;
+  q->step = step > 0 ? step : 1;
+  q->next = 0;
+  q->ok = true;
+}
+
+bool workqueue_take(WorkQueue *q, size_t *first, size_t *taken) {
+  pthread_mutex_lock(&q->lock);
+  *first = q->next;
+  *taken = q->count - q->next < q->step ? q->count - q->next : q->step;
+  q->next += *taken;
+  pthread_mutex_unlock(&q->lock);
+  return *taken > 0;
+}
+
+void workqueue_fail(WorkQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  q->ok = false;
+  pthread_mutex_unlock(&q->lock);
+}
+
+bool workqueue_run(WorkQueue *q, void *(*worker)(void *), void *arg,
+                   size_t threads) {
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (size_t)cpus : 1;
+  }
+  size_t steps = (q->count + q->step - 1) / q->step;
+  if (threads > steps) {
+    threads = steps;
+  }
+
+  /* The calling thread works too, so the items are done even if no other
+  thread can be created */
+  size_t started = 0;
+  pthread_t *helpers = NULL;
+  if (threads > 1) {
+    helpers = (pthread_t *)malloc((threads - 1) * sizeof(pthread_t));
+    while (started < threads - 1 &&
+           pthread_create(&helpers[started], NULL, worker, arg) == 0) {
+      started++;
+    }
+  }
+  worker(arg);
+  for (size_t t = 0; t < started; t++) {
+    pthread_join(helpers[t], NULL);
+  }
+  free(helpers);
+  return q->ok;
+}
+
+void workqueue_clear(WorkQueue *q) { pthread_mutex_destroy(&q->lock); }
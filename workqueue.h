@@ -0,0 +1,62 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//
+// A queue of numbered work items shared by a group of threads. Items
+// 0 to count - 1 are handed out in order, step at a time, to whichever
+// thread asks next, so threads that finish early take more of the work.
+//
+typedef struct {
+  pthread_mutex_t lock;
+  size_t count; /* Items in the queue */
+  size_t step;  /* Items handed out at a time */
+  size_t next;  /* First item not yet handed out */
+  bool ok;      /* Cleared by workqueue_fail() */
+} WorkQueue;
+
+//
+// Starts a queue of items.
+//
+// q: the queue.
+// count: the number of items.
+// step: the most items handed out at a time, at least 1.
+//
+void workqueue_init(WorkQueue *q, size_t count, size_t step);
+
+//
+// Hands out the next items.
+//
+// q: the queue.
+// first: will store the first item.
+// taken: will store the number of items, at most step.
+// returns: false if every item has been handed out.
+//
+bool workqueue_take(WorkQueue *q, size_t *first, size_t *taken);
+
+//
+// Records that some item failed; workqueue_run() then returns false.
+//
+void workqueue_fail(WorkQueue *q);
+
+//
+// Runs worker(arg) on up to threads threads, no more than there are steps
+// of items, the calling thread being one of them. The worker is expected
+// to take items from q until there are none left. A thread that can't be
+// created leaves its share to the others.
+//
+// q: the queue the worker takes items from.
+// worker: the thread body.
+// arg: passed to the worker.
+// threads: the number of threads wanted; 0 means one per CPU.
+// returns: false if workqueue_fail() was called.
+//
+bool workqueue_run(WorkQueue *q, void *(*worker)(void *), void *arg,
+                   size_t threads);
+
+//
+// Frees the queue's lock.
+//
+void workqueue_clear(WorkQueue *q);